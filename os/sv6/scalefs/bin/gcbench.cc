@@ -83,9 +83,11 @@ stats(int print)
       die("gct: unexpected read");
 
     if (print)
-      printf("%d: ndelay %" PRId64 " nfree %" PRId64 " nrun %" PRId64 " ncycles %lu nop %lu cycles/op %lu\n",
+      printf("%d: ndelay %" PRId64 " nfree %" PRId64 " nrun %" PRId64 " ncycles %lu nop %lu cycles/op %lu"
+             " delayed %lu max %lu nexpedite %lu nhelp %lu\n",
             c++, gs.ndelay, gs.nfree, gs.nrun, gs.ncycles, gs.nop, 
-              (gs.nop > 0) ? gs.ncycles/gs.nop : 0);
+              (gs.nop > 0) ? gs.ncycles/gs.nop : 0, gs.delayed_bytes,
+              gs.max_delayed_bytes, gs.nexpedite, gs.nhelp);
   }
 
   close(fd);
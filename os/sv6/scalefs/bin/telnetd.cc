@@ -1,3 +1,4 @@
+#include "user.h"
 #include "libutil.h"
 #include "sockutil.h"
 
@@ -38,6 +39,12 @@ main(void)
   int s;
   int r;
 
+  // Accept connections promptly under load.  Sessions go back to the
+  // normal class below, so that what users run from them doesn't inherit
+  // this one.
+  if (setschedclass(SCHED_CLASS_LATENCY) < 0)
+    fprintf(stderr, "telnetd: setschedclass failed\n");
+
   s = socket(AF_INET, SOCK_STREAM, 0);
   if (s < 0)
     die("telnetd socket: %d\n", s);
@@ -70,6 +77,7 @@ main(void)
 
     if (dfork() == 0) {
       static const char *argv[] = { "/login", 0 };
+      setschedclass(SCHED_CLASS_NORMAL);
       close(0);
       close(1);
       close(2);
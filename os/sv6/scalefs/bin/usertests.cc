@@ -4,16 +4,20 @@
 #include "traps.h"
 #include "pthread.h"
 #include "rnd.hh"
+#include "futex.h"
 
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <signal.h>
 #include <setjmp.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <utility>
 
@@ -1703,6 +1707,213 @@ thrtest(void)
   printf("thrtest ok\n");
 }
 
+// Move part of a file through a pipe into another file with splice.
+void
+splicetest(void)
+{
+  enum { size = 3*4096 + 1000, skip = 100 };
+  static char data[size], back[size];
+  int fds[2];
+
+  printf("splicetest\n");
+
+  int in = open("splicein", O_CREAT|O_RDWR, 0666);
+  int out = open("spliceout", O_CREAT|O_RDWR, 0666);
+  if (in < 0 || out < 0)
+    die("splicetest: open failed");
+  for (int i = 0; i < size; i++)
+    data[i] = (char)(i * 7 + i / 4096);
+  if (write(in, data, size) != size)
+    die("splicetest: write failed");
+  if (pipe(fds) != 0)
+    die("splicetest: pipe failed");
+
+  // Neither end may be a plain file on both sides, and a pipe has no
+  // offset to read from.
+  off_t off = 0;
+  if (splice(in, &off, out, nullptr, 10, 0) >= 0)
+    die("splicetest: file to file splice succeeded");
+  if (splice(fds[0], &off, out, nullptr, 10, 0) >= 0)
+    die("splicetest: splice from a pipe at an offset succeeded");
+
+  off_t inoff = skip, outoff = 0;
+  while (inoff < size) {
+    ssize_t r = splice(in, &inoff, fds[1], nullptr, size - inoff, 0);
+    if (r <= 0)
+      die("splicetest: splice in returned %ld", r);
+    for (ssize_t left = r; left > 0; ) {
+      ssize_t w = splice(fds[0], nullptr, out, &outoff, left, 0);
+      if (w <= 0)
+        die("splicetest: splice out returned %ld", w);
+      left -= w;
+    }
+  }
+  if (inoff != size || outoff != size - skip)
+    die("splicetest: offsets %ld %ld", inoff, outoff);
+  // Explicit offsets leave the file offsets alone.
+  if (lseek(in, 0, SEEK_CUR) != size || lseek(out, 0, SEEK_CUR) != 0)
+    die("splicetest: file offset moved");
+
+  if (pread(out, back, size, 0) != size - skip ||
+      memcmp(back, data + skip, size - skip) != 0)
+    die("splicetest: spliced data differs");
+
+  close(fds[0]);
+  close(fds[1]);
+  close(in);
+  close(out);
+  unlink("splicein");
+  unlink("spliceout");
+  printf("splicetest ok\n");
+}
+
+void
+mmsgtest(void)
+{
+  enum { nmsg = 4 };
+  struct sockaddr_un name;
+  char out[nmsg][8], in[nmsg + 2][8];
+  struct msgvec vec[nmsg + 2];
+
+  printf("mmsgtest\n");
+
+  int rsock = socket(PF_LOCAL, SOCK_DGRAM, 0);
+  int ssock = socket(PF_LOCAL, SOCK_DGRAM, 0);
+  if (rsock < 0 || ssock < 0)
+    die("mmsgtest: socket failed");
+  name.sun_family = AF_LOCAL;
+  strcpy(name.sun_path, "mmsgsock");
+  if (bind(rsock, (struct sockaddr*)&name, SUN_LEN(&name)) < 0)
+    die("mmsgtest: bind failed");
+  int qlen = 2 * nmsg;
+  if (setsockopt(rsock, SOL_LOCAL, LOCAL_QUEUELEN, &qlen, sizeof(qlen)) < 0)
+    die("mmsgtest: setting the queue length failed");
+
+  for (int i = 0; i < nmsg; i++) {
+    snprintf(out[i], sizeof(out[i]), "msg%d", i);
+    vec[i].msg_base = out[i];
+    vec[i].msg_len = strlen(out[i]) + 1 - (i % 2);
+  }
+  int r = sendmmsg(ssock, vec, nmsg, 0, (struct sockaddr*)&name,
+                   SUN_LEN(&name));
+  if (r != nmsg)
+    die("mmsgtest: sendmmsg returned %d", r);
+
+  // A batch returns what is queued without waiting for the rest.
+  memset(in, 0, sizeof(in));
+  for (int i = 0; i < nmsg + 2; i++) {
+    vec[i].msg_base = in[i];
+    vec[i].msg_len = sizeof(in[i]);
+  }
+  r = recvmmsg(rsock, vec, nmsg + 2, 0);
+  if (r != nmsg)
+    die("mmsgtest: recvmmsg returned %d", r);
+  for (int i = 0; i < nmsg; i++) {
+    if (vec[i].msg_len != strlen(out[i]) + 1 - (i % 2) ||
+        memcmp(in[i], out[i], vec[i].msg_len) != 0)
+      die("mmsgtest: message %d garbled", i);
+  }
+
+  // The queues exist now, so their length can't change.
+  if (setsockopt(rsock, SOL_LOCAL, LOCAL_QUEUELEN, &qlen, sizeof(qlen)) >= 0)
+    die("mmsgtest: queue length changed after use");
+
+  close(ssock);
+  close(rsock);
+  unlink("mmsgsock");
+  printf("mmsgtest ok\n");
+}
+
+void
+schedclasstest(void)
+{
+  printf("schedclasstest\n");
+
+  if (setschedclass(SCHED_CLASS_BATCH) != SCHED_CLASS_NORMAL)
+    die("schedclasstest: not in the normal class to begin with");
+  if (setschedclass(-1) >= 0 || setschedclass(SCHED_NCLASS) >= 0)
+    die("schedclasstest: bad class accepted");
+
+  // Children inherit the class.
+  int pid = fork();
+  if (pid < 0)
+    die("schedclasstest: fork failed");
+  if (pid == 0)
+    exit(setschedclass(SCHED_CLASS_NORMAL));
+  int status;
+  wait(&status);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != SCHED_CLASS_BATCH)
+    die("schedclasstest: child not in the batch class");
+
+  if (setschedclass(SCHED_CLASS_NORMAL) != SCHED_CLASS_BATCH)
+    die("schedclasstest: class not kept");
+  printf("schedclasstest ok\n");
+}
+
+static volatile u64 futex_word, futex_word_requeue;
+static std::atomic<int> futex_nwaiting, futex_nwoken;
+enum { futex_nthread = 4 };
+
+static void*
+futexthr(void *arg)
+{
+  ++futex_nwaiting;
+  while (futex_word == 0)
+    futex((const u64*)&futex_word, FUTEX_WAIT, 0, 0);
+  ++futex_nwoken;
+  return 0;
+}
+
+void
+futextest(void)
+{
+  printf("futextest\n");
+
+  for (int i = 0; i < futex_nthread; i++) {
+    pthread_t tid;
+    pthread_create(&tid, 0, &futexthr, 0);
+  }
+  while (futex_nwaiting != futex_nthread)
+    yield();
+  // Give the threads time to get to sleep.  One that hasn't yet sees the
+  // new value and doesn't wait at all.
+  nsleep(100000000ull);
+  futex_word = 1;
+
+  // A requeue must fail if the word no longer has the expected value.
+  if (futex_requeue((const u64*)&futex_word, 1,
+                    (const u64*)&futex_word_requeue, INT_MAX, 0) >= 0)
+    die("futextest: requeue with stale value succeeded");
+
+  // Wake one thread and move the others to the second word, so that
+  // they can only be woken through it.
+  long n = futex_requeue((const u64*)&futex_word, 1,
+                         (const u64*)&futex_word_requeue, INT_MAX, 1);
+  if (n < 0 || n > futex_nthread)
+    die("futextest: requeue returned %ld", n);
+  if (futex((const u64*)&futex_word, FUTEX_WAKE, INT_MAX, 0) != 0)
+    die("futextest: waiters left behind on the requeued word");
+
+  // Wake the rest, at most two at a time.
+  long woken = n ? 1 : 0;
+  for (int tries = 0; futex_nwoken != futex_nthread; tries++) {
+    long r = futex((const u64*)&futex_word_requeue, FUTEX_WAKE, 2, 0);
+    if (r < 0 || r > 2)
+      die("futextest: wake 2 returned %ld", r);
+    woken += r;
+    if (tries > 1000)
+      die("futextest: only %d of %d threads woke up", (int)futex_nwoken,
+          futex_nthread);
+    nsleep(1000000ull);
+  }
+  if (woken > n)
+    die("futextest: woke %ld threads, %ld were queued", woken, n);
+
+  for (int i = 0; i < futex_nthread; i++)
+    wait(NULL);
+  printf("futextest ok\n");
+}
+
 void
 unmappedtest(void)
 {
@@ -1764,6 +1975,54 @@ test_fault(char *p)
   return faulted;
 }
 
+void
+hugepagetest(void)
+{
+  const size_t lg = 2*1024*1024;
+  const size_t len = 2*lg;
+
+  printf("hugepagetest\n");
+  char *p = (char*)mmap(0, len, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    die("hugepagetest: mmap failed");
+  if ((uptr)p % lg)
+    die("hugepagetest: %p not aligned to a large page", p);
+
+  // The first half may only use small pages; the second asks for large
+  // ones.  Either way, the memory must behave the same.
+  if (madvise(p, lg, MADV_NOHUGEPAGE) < 0 ||
+      madvise(p + lg, lg, MADV_HUGEPAGE) < 0)
+    die("hugepagetest: madvise failed");
+  for (size_t off = 0; off < len; off += 4096)
+    if (p[off] != 0)
+      die("hugepagetest: fresh memory not zero at %#lx", off);
+  for (size_t off = 0; off < len; off += 4096)
+    p[off] = (char)(off / 4096);
+
+  // Split the large page: make part of it read-only, and unmap a page
+  // in the middle.  The rest must keep its contents.
+  if (mprotect(p + lg + 4096, 4096, PROT_READ) < 0)
+    die("hugepagetest: mprotect failed");
+  if (munmap(p + lg + 8*4096, 4096) < 0)
+    die("hugepagetest: munmap failed");
+  for (size_t off = 0; off < len; off += 4096) {
+    if (off == lg + 8*4096)
+      continue;
+    if (p[off] != (char)(off / 4096))
+      die("hugepagetest: lost data at %#lx", off);
+  }
+  p[lg + 2*4096] = 1;
+  if (p[lg + 2*4096] != 1)
+    die("hugepagetest: write after split failed");
+
+  if (munmap(p, len) < 0)
+    die("hugepagetest: munmap failed");
+  if (madvise(p, lg, MADV_HUGEPAGE) >= 0)
+    die("hugepagetest: madvise of unmapped memory succeeded");
+  printf("hugepagetest ok\n");
+}
+
 void
 vmoverlap(void)
 {
@@ -2081,6 +2340,7 @@ main(int argc, char *argv[])
 
   TEST(unmappedtest);
   TEST(vmoverlap);
+  TEST(hugepagetest);
   TEST(vmconcurrent);
   TEST(tlb);
 
@@ -2094,7 +2354,10 @@ main(int argc, char *argv[])
   TEST(preads);
 
   TEST(pipe1);
+  TEST(splicetest);
+  TEST(mmsgtest);
   TEST(preempt);
+  TEST(schedclasstest);
   TEST(exitwait);
   TEST(zombietest);
   TEST(killtest); 
@@ -2116,6 +2379,7 @@ main(int argc, char *argv[])
   TEST(bigdir); // slow
   TEST(tls_test);
   TEST(thrtest);
+  TEST(futextest);
   TEST(ftabletest);
   TEST(renametest);
 
@@ -37,6 +37,12 @@ public:
   // Mask or unmask PC
   virtual void mask_pc(bool mask) = 0;
 
+  // Make the timer interrupt every QUANTUM msecs
+  virtual void timer_periodic() = 0;
+
+  // Make the timer interrupt once, after msec msecs
+  virtual void timer_oneshot(u64 msec) = 0;
+
   // Start an AP
   virtual void start_ap(struct cpu *c, u32 addr) = 0;
 
@@ -124,6 +124,21 @@ public:
     free_order(ptr, size_to_order(size));
   }
 
+  // Allocate up to n MIN_SIZE blocks into pages, taking the largest
+  // blocks available that fit and splitting each one up, rather than
+  // allocating the blocks one at a time.  Returns the number of blocks
+  // allocated, which is less than n only if out of memory.
+  std::size_t alloc_pages(void **pages, std::size_t n);
+
+  // Free n MIN_SIZE blocks, each previously allocated by alloc_pages,
+  // by alloc(MIN_SIZE), or by split.
+  void free_pages(void * const *pages, std::size_t n);
+
+  // Turn a region previously allocated with <tt>alloc(size)</tt> into
+  // size / MIN_SIZE allocated MIN_SIZE blocks, which may then be
+  // freed individually.
+  void split(void *ptr, std::size_t size);
+
   // Return the lowest address the allocator can return.
   void *get_base() const
   {
@@ -32,6 +32,7 @@ struct condvar {
   void sleep_to(struct spinlock*, u64, struct spinlock * = nullptr);
   void wake_all(int yield=false, proc *callerproc=nullptr);
   void wake_one(proc *p);
+  bool wake_one();
 };
 
 void            timerintr(void);
@@ -51,9 +51,30 @@ struct file {
                            struct sockaddr_storage *src_addr,
                            size_t *addrlen)
   { return -1; }
+  // Batched sendto/recvfrom; vec is a user array of vlen messages.
+  // Both return the number of messages transferred.
+  virtual int sendmmsg(userptr<struct msgvec> vec, unsigned int vlen,
+                       int flags, const struct sockaddr *dest_addr,
+                       size_t addrlen)
+  { return -1; }
+  virtual int recvmmsg(userptr<struct msgvec> vec, unsigned int vlen,
+                       int flags)
+  { return -1; }
+  // optval is a kernel copy of the user's optlen bytes.
+  virtual int setsockopt(int level, int optname, const void *optval,
+                         size_t optlen)
+  { return -1; }
 
   virtual sref<mnode> get_mnode() { return sref<mnode>(); }
 
+  // Move up to n bytes from this file to out without copying them
+  // through user space.  inoff and outoff, if non-null, replace the
+  // current file offset at either end.
+  virtual ssize_t splice(file *out, size_t n, off_t *inoff, off_t *outoff)
+  { return -1; }
+  // The pipe behind this file if it is a pipe's write end, to splice to.
+  virtual struct pipe* splice_pipe() { return nullptr; }
+
   virtual void inc() = 0;
   virtual void dec() = 0;
 
@@ -76,6 +97,7 @@ public:
   const bool append;
   u32 off;
   sleeplock off_lock;
+  mfile::readahead ra;  // Protected by off_lock
 
   int fsync() override;
   int stat(struct stat*, enum stat_flags) override;
@@ -83,6 +105,7 @@ public:
   ssize_t write(const char *addr, size_t n) override;
   ssize_t pread(char* addr, size_t n, off_t off) override;
   ssize_t pwrite(const char *addr, size_t n, off_t offset) override;
+  ssize_t splice(file *out, size_t n, off_t *inoff, off_t *outoff) override;
   void onzero() override
   {
     delete this;
@@ -101,6 +124,7 @@ public:
 
   int stat(struct stat*, enum stat_flags) override;
   ssize_t read(char *addr, size_t n) override;
+  ssize_t splice(file *out, size_t n, off_t *inoff, off_t *outoff) override;
   void onzero() override;
 
 private:
@@ -156,6 +180,10 @@ public:
     return inner->write(addr, n);
   }
 
+  struct pipe* splice_pipe() override {
+    return inner->splice_pipe();
+  }
+
   void pre_close() override {
     // This FD is being closed.  Now we need to know the moment its
     // reference count actually drops to zero so we can immediately
@@ -201,6 +229,7 @@ public:
 
   int stat(struct stat*, enum stat_flags) override;
   ssize_t write(const char *addr, size_t n) override;
+  struct pipe* splice_pipe() override { return pipe; }
   void onzero() override;
 
 private:
@@ -305,6 +334,19 @@ struct freeinum_bitmap {
   // read-only after initialization, so a single one will suffice.
   percpu<struct freelist> freelists;
   struct freelist reserve_freelist; // Global reserve pool of free inums.
+
+  // Layout of the per-CPU stripes, computed at boot. CPU i owns inums
+  // [first_free_inum + i*inums_per_cpu, first_free_inum + (i+1)*inums_per_cpu)
+  // and the rest of the inums belong to the reserve pool.
+  u32 first_free_inum;
+  u32 inums_per_cpu;
+
+  // Number of stripes (NCPU per-CPU stripes and the reserve stripe) that
+  // are still being scanned by the boot-time initialization threads.
+  // Allocations and frees wait on init_cv until this drops to zero.
+  std::atomic<int> stripes_pending;
+  spinlock init_lock;
+  condvar init_cv;
 };
 
 // device implementations
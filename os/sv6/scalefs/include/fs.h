@@ -39,10 +39,16 @@ struct superblock {
 #define NINDIRECT (BSIZE / sizeof(u32))
 #define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT)
 
-// Size of the physical journal file - /sv6journal
-#define PHYS_JOURNAL_SIZE ((NDIRECT + NINDIRECT) * BSIZE)
-
-// Considerations in determining the value of PHYS_JOURNAL_SIZE:
+// Size of the per-core physical journals, in blocks. tools/mkfs.c lays out
+// NCPU journals as contiguous runs of blocks right after the free bitmap, and
+// records their location in the superblock. Together they take up
+// 1/JOURNAL_DISK_FRACTION of the disk, but each journal is clamped to
+// [JOURNAL_MIN_BLKS, JOURNAL_MAX_BLKS].
+#define JOURNAL_MIN_BLKS        (NDIRECT + NINDIRECT)
+#define JOURNAL_MAX_BLKS        (64 * BLKS_PER_MEG) // 64 MB
+#define JOURNAL_DISK_FRACTION   32
+
+// Considerations in determining the value of JOURNAL_MIN_BLKS:
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // A simple example for a large transaction would be unlinking (or truncating)
 // a large file: it involves logging all the updated metadata blocks of the
@@ -74,7 +80,7 @@ struct superblock {
 // 4112 + 1027 * (16 + 4096) + 4112 = 4231248 bytes (~ 1034 blocks)
 //
 // So if you are about to surpass transactions of this size, remember to enlarge
-// the physical journal!
+// the physical journals!
 
 
 // On-disk inode structure
@@ -21,13 +21,16 @@ class rcu_freed {
  public:
   u64 _rcu_epoch;
   rcu_freed *_rcu_next;
+  u64 _rcu_size;                // bytes freed by do_gc, for gc_stat
 #if RCU_TYPE_DEBUG
   const char *_rcu_type;
 #endif
 
   rcu_freed(const char *debug_type, void* objbase, uint64_t objsize)
 #if RCU_TYPE_DEBUG
-    : _rcu_next(nullptr), _rcu_type(debug_type)
+    : _rcu_next(nullptr), _rcu_size(objsize), _rcu_type(debug_type)
+#else
+    : _rcu_size(objsize)
 #endif
   {
     mtgcregister(objbase, objsize, debug_type);
@@ -103,6 +103,10 @@ namespace mmu_shared_page_table {
     struct pgmap * const pml4;
 
     void __insert(uintptr_t va, pme_t pte);
+    void __insert_range(uintptr_t va, const pme_t *ptes, size_t n);
+    bool __insert_large(uintptr_t va, pme_t pte);
+    bool __can_insert_large(uintptr_t va);
+    bool __test_and_clear_accessed(uintptr_t va);
     void __invalidate(uintptr_t start, uintptr_t len, shootdown *sd);
 
   public:
@@ -125,6 +129,42 @@ namespace mmu_shared_page_table {
       __insert(va, pte);
     }
 
+    // Like insert, but for the n pages starting at @c va, with
+    // @c tracker_it pointing to the page tracker of the first page.
+    // Zero entries in @c ptes are skipped.
+    template<class ForwardIterator>
+    void insert_range(uintptr_t va, ForwardIterator tracker_it,
+                      const pme_t *ptes, size_t n)
+    {
+      __insert_range(va, ptes, n);
+    }
+
+    // Like insert, but map the LGPGSIZE-aligned region at @c va with
+    // a single large page PTE.  @c tracker_it must point to the page
+    // tracker of the first page.  Returns false (and inserts nothing)
+    // if the region is already mapped with small pages.
+    template<class ForwardIterator>
+    bool insert_large(uintptr_t va, ForwardIterator tracker_it, pme_t pte)
+    {
+      return __insert_large(va, pte);
+    }
+
+    // Whether insert_large at @c va would currently succeed.
+    bool can_insert_large(uintptr_t va)
+    {
+      return __can_insert_large(va);
+    }
+
+    // Clear the accessed bit of the mapping of @c va, if there is one,
+    // and return whether it was set.  @c tracker_it must point to the
+    // page tracker of the page at @c va.  This doesn't flush the TLB,
+    // so a page that stays in a TLB may look unused.
+    template<class ForwardIterator>
+    bool test_and_clear_accessed(uintptr_t va, ForwardIterator tracker_it)
+    {
+      return __test_and_clear_accessed(va);
+    }
+
     // Invalidate all mappings from virtual address @c va to
     // <tt>start+len</tt>.  This should be called whenever a page
     // mapping's permissions become more strict or the mapped page
@@ -206,7 +246,15 @@ namespace mmu_per_core_page_table {
     // Clear and TLB flush a region of this core's page table.
     void clear(uintptr_t start, uintptr_t end);
 
+    bool insert_large(uintptr_t va, pme_t pte);
+    void insert_range(uintptr_t va, const pme_t *ptes, size_t n);
+    bool test_and_clear_accessed(uintptr_t va, bitset<NCPU> cores);
+
   public:
+    // Whether insert_large at @c va would currently succeed on this
+    // core.
+    bool can_insert_large(uintptr_t va);
+
     page_map_cache()
     {
       for (size_t i = 0; i < NCPU; ++i)
@@ -220,6 +268,28 @@ namespace mmu_per_core_page_table {
 
     void insert(uintptr_t va, page_tracker *t, pme_t pte);
 
+    template<class ForwardIterator>
+    void insert_range(uintptr_t va, ForwardIterator tracker_it,
+                      const pme_t *ptes, size_t n)
+    {
+      insert_range(va, ptes, n);
+      for (size_t i = 0; i < n; i++, tracker_it += 1)
+        if (ptes[i])
+          tracker_it->tracker_cores.set(myid());
+    }
+
+    template<class ForwardIterator>
+    bool insert_large(uintptr_t va, ForwardIterator tracker_it, pme_t pte)
+    {
+      if (!insert_large(va, pte))
+        return false;
+      auto end = tracker_it + LGPGSIZE/PGSIZE;
+      for (; tracker_it < end; tracker_it += tracker_it.span())
+        if (tracker_it.is_set())
+          tracker_it->tracker_cores.set(myid());
+      return true;
+    }
+
     template<class ForwardIterator>
     void invalidate(uintptr_t start, uintptr_t len,
                     ForwardIterator tracker_it, shootdown *sd)
@@ -260,6 +330,17 @@ namespace mmu_per_core_page_table {
       }
     }
 
+    // Clear the accessed bit of the mapping of @c va in each core's
+    // page table and return whether any was set.  Remote page tables
+    // are only touched by their own core, so this runs there.
+    template<class ForwardIterator>
+    bool test_and_clear_accessed(uintptr_t va, ForwardIterator tracker_it)
+    {
+      if (!tracker_it.is_set())
+        return false;
+      return test_and_clear_accessed(va, tracker_it->tracker_cores);
+    }
+
     void switch_to() const;
     void switch_from() const {}
 
@@ -114,10 +114,12 @@ void            iunlock(sref<inode>);
 void            drop_bufcache(sref<inode> ip);
 void            itrunc(sref<inode>, u32 offset = 0, transaction *trans = NULL);
 int             readi(sref<inode>, char*, u32, u32);
+int             readi_pages(sref<inode>, char**, u32, u32);
 void            stati(sref<inode>, struct stat*);
 int             writei(sref<inode>, const char*, u32, u32, transaction *trans = NULL,
                        bool writeback = false, bool lazy_trans_update = false,
                        bool dont_cache = false);
+int             writei_pages(sref<inode>, char**, u32, u32, transaction*);
 void            update_size(sref<inode>, u32, transaction *trans = NULL);
 sref<inode>     nameiparent(sref<inode> cwd, const char*, char*);
 int             dirlink(sref<inode>, const char*, u32, bool inc_link, transaction *trans);
@@ -136,6 +138,8 @@ typedef u64* futexkey_t;
 int             futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key);
 long            futexwait(futexkey_t key, u64 val, u64 timer);
 long            futexwake(futexkey_t key, u64 nwake);
+long            futexrequeue(futexkey_t key, u64 nwake, futexkey_t key2,
+                             u64 nrequeue, u64 val);
 
 // hz.c
 void            microdelay(u64);
@@ -152,6 +156,7 @@ void            idlezombie(struct proc*);
 // kalloc.c
 char*           kalloc(const char *name, size_t size = PGSIZE, int cpu = -1);
 void            kfree(void*, size_t size = PGSIZE);
+void            ksplit(void*, size_t size);
 void*           ksalloc(int slabtype);
 void            ksfree(int slabtype, void*);
 void*           early_kalloc(size_t size, size_t align);
@@ -162,7 +167,9 @@ void            kmalignfree(void *, int align, u64 size);
 void            verifyfree(char *ptr, u64 nbytes);
 void            kminit(void);
 void            kmemprint(print_stream *s);
+void            kmemlocal(int cpu, size_t *free, size_t *limit);
 void            kmbalance(void);
+void            kmidle(void);
 
 // kbd.c
 void            kbdintr(void);
@@ -180,6 +187,9 @@ void            netrx(void *va, u16 len);
 int             nettx(void *va, u16 len);
 void            nethwaddr(u8 *hwaddr);
 
+// pagecache.cc
+void            pagecache_track(u64 mnum, u64 pageidx, class page_info *pi);
+
 // picirq.c
 void            picenable(int);
 void            piceoi(void);
@@ -190,6 +200,8 @@ int             pipealloc(sref<file>*, sref<file>*, int flags);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, const char*, int);
+ssize_t         pipesplicein(struct pipe*, sref<mnode>, u64, size_t);
+ssize_t         pipespliceout(struct pipe*, struct file*, off_t*, size_t);
 struct pipe*    pipesockalloc();
 void            pipesockclose(struct pipe *);
 
@@ -232,6 +244,8 @@ void            sched(void);
 void            post_swtch(void);
 void            scheddump(void);
 int             steal(void);
+void            schedtick(void);
+bool            schednohz(void);
 void            addrun(struct proc*);
 int             dwork_push(struct dwork*, int);
 
@@ -281,6 +295,7 @@ size_t          safe_read_vm(void *dst, uintptr_t src, size_t n);
 // zalloc.cc
 char*           zalloc(const char* name);
 void            zfree(void* p);
+bool            zidle(void);
 
 // other exported/imported functions
 void cmain(u64 mbmagic, u64 mbaddr);
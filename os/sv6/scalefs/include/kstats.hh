@@ -32,6 +32,22 @@
   X(uint64_t, page_fault_alloc_cycles)                \
   X(uint64_t, page_fault_fill_count)                  \
   X(uint64_t, page_fault_fill_cycles)                 \
+  X(uint64_t, page_fault_large_count)                 \
+  /* Large pages mapped for fresh anonymous memory, and faults that   \
+   * fell back to small pages because there was no contiguous memory  \
+   * or the region already has a small page table. */                  \
+  X(uint64_t, page_fault_large_anon_count)            \
+  X(uint64_t, page_fault_large_fallback_count)        \
+  /* Pages mapped speculatively by fault-around, and of those,  \
+   * the ones found accessed or not when they were unmapped. */ \
+  X(uint64_t, page_fault_around_mapped)               \
+  X(uint64_t, page_fault_around_used)                 \
+  X(uint64_t, page_fault_around_unused)               \
+  /* Page-cache pages looked at by the reclaimer's CLOCK hand, and \
+   * of those, the ones given a second chance and the ones evicted. */ \
+  X(uint64_t, pagecache_scan_count)                   \
+  X(uint64_t, pagecache_referenced_count)             \
+  X(uint64_t, pagecache_evict_count)                  \
                                                 \
   X(uint64_t, mmap_count)                       \
   X(uint64_t, mmap_cycles)                      \
@@ -46,6 +62,16 @@
   X(uint64_t, kalloc_hot_list_flush_count)      \
   X(uint64_t, kalloc_hot_list_steal_count)      \
   X(uint64_t, kalloc_hot_list_remote_free_count)        \
+  /* Batches of kmalloc objects returned to their home CPU. */ \
+  X(uint64_t, kmalloc_remote_free_count)        \
+  /* kmalloc magazines lent by a neighbor's depot. */ \
+  X(uint64_t, kmalloc_steal_count)              \
+  /* zallocs served from / missing the pre-zeroed pool; the hit rate \
+   * is hit / (hit + miss). */                  \
+  X(uint64_t, zalloc_hit_count)                 \
+  X(uint64_t, zalloc_miss_count)                \
+  /* Pages zeroed ahead of time by idle loops. */ \
+  X(uint64_t, zalloc_prezero_count)             \
 
 #define KSTATS_REFCACHE(X)                      \
   X(uint64_t, refcache_review_count)            \
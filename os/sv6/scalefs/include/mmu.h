@@ -6,6 +6,7 @@
 
 #define PGSIZE          4096
 #define PGSHIFT		12		// log2(PGSIZE)
+#define LGPGSIZE        (PGSIZE << 9)	// Large (2MB) page size
 
 #define PXSHIFT(n)	(PGSHIFT+(9*(n)))
 #define PX(n, la)	((((uintptr_t) (la)) >> PXSHIFT(n)) & 0x1FF)
@@ -23,6 +24,7 @@
 #define PTE_MBZ		0x180	// Bits must be zero
 #define PTE_LOCK        0x200   // xv6: lock
 #define PTE_UNUSED      0x400   // xv6: unused
+#define PTE_AROUND      PTE_UNUSED // sv6: speculatively mapped by fault-around
 #define PTE_COW         0x800   // xv6: copy-on-write
 #define PTE_NX		0x8000000000000000ull // No-execute enable
 
@@ -463,6 +463,12 @@ public:
       return sref<page_info>::newref(get_page_info_raw());
     }
 
+    void mark_referenced() const {
+      page_info* pi = get_page_info_raw();
+      if (pi)
+        pi->mark_referenced();
+    }
+
     void reset_page_info() {
       value_ = value_ & 0xF;
     }
@@ -521,6 +527,10 @@ private:
   // Only one fsync can execute on the mnode at a time
   sleeplock fsync_lock_;
 
+  void install_pages(u64 pageidx, char **pgs, u32 n, size_t nbytes);
+  bool load_folio(u64 pageidx);
+  void load_pages(u64 pageidx, u32 npages);
+
 public:
   class resizer : public lock_guard<sleeplock>,
                   public seq_writer {
@@ -548,9 +558,36 @@ public:
     return seq_reader<u64>(&size_, &size_seq_);
   }
 
-  page_state get_page(u64 pageidx);
+  // Number of pages in a folio: a naturally aligned run of file pages that
+  // is backed by one large (LGPGSIZE) page of physical memory.
+  enum { FOLIO_PAGES = LGPGSIZE / PGSIZE };
+
+  // Per-open-file sequential access detector, which sizes the readahead
+  // window passed to get_page().
+  class readahead {
+  public:
+    enum { MIN_PAGES = 4, MAX_PAGES = 64 };
+
+    readahead() : next_(0), window_(0) {}
+
+    // Record a read of npages pages starting at pageidx and return the
+    // number of pages to fill on a miss.
+    u32 update(u64 pageidx, u32 npages);
+
+  private:
+    u64 next_;          // Page following the last page read
+    u32 window_;        // Current window, 0 if access is not sequential
+  };
+
+  // What became of a page offered to the page reclaimer's CLOCK hand.
+  enum class reclaim_result { gone, kept, evicted };
+
+  page_state get_page(u64 pageidx, u32 nfill = 1);
+  page_state get_cached_page(u64 pageidx);
   void put_page(u64 pageidx);
-  void set_page_dirty(u64 pageidx);
+  reclaim_result reclaim_page(u64 pageidx, page_info *pi);
+  void set_page_dirty(u64 pageidx, const sref<page_info> &pi, u32 off,
+                      u32 len);
   void sync_file(int cpu);
   void remove_pgtable_mappings(u64 start_offset);
   void drop_pagecache();
@@ -651,10 +688,11 @@ class blocking_io : public std::exception
 {
   sref<mfile> mf_;
   u64 pageidx_;
+  u32 nfill_;
 
 public:
-  blocking_io(sref<mfile> mf, u64 pageidx)
-    : mf_(std::move(mf)), pageidx_(pageidx) { }
+  blocking_io(sref<mfile> mf, u64 pageidx, u32 nfill = 1)
+    : mf_(std::move(mf)), pageidx_(pageidx), nfill_(nfill) { }
 
   ~blocking_io() noexcept
   {
@@ -664,7 +702,7 @@ public:
 
   void retry()
   {
-    mf_->get_page(pageidx_);
+    mf_->get_page(pageidx_, nfill_);
     mf_.reset();
   }
 
@@ -7,6 +7,7 @@
 #include "types.h"
 #include "oplog.hh"
 
+#include <atomic>
 #include <cstddef>
 #include <vector>
 
@@ -140,6 +141,13 @@ public:
         rmap_vec.clear();
       }
 
+      // Like sync(vec), but leaves the pairs in the rmap.
+      void peek(std::vector<rmap_entry> &vec) {
+        auto guard = synchronize_with_spinlock();
+        for (auto it = rmap_vec.begin(); it != rmap_vec.end(); it++)
+          vec.emplace_back(*it);
+      }
+
       void sync() {
         auto guard = synchronize_with_spinlock();
       }
@@ -148,7 +156,7 @@ public:
       std::vector<rmap_entry> rmap_vec;
   };
 
-  page_info() {
+  page_info() : referenced_(false) {
     rmap_pte = new rmap(false); // use_sleeplock = false.
     for (int cpu = 0; cpu < NCPU; cpu++)
       outstanding_ops[cpu] = 0;
@@ -233,9 +241,36 @@ public:
     outstanding_ops[cpu] = 0;
   }
 
+  // Like get_rmap_vector, but keeps the rmap intact.
+  void peek_rmap_vector(std::vector<rmap_entry> &vec) {
+    assert(rmap_pte);
+    int cpu = myid();
+    rmap_pte->peek(vec);
+    outstanding_ops[cpu] = 0;
+  }
+
+  // Page-cache pages are marked referenced on every lookup; the page
+  // reclaimer's CLOCK hand clears the mark and evicts pages that have not
+  // been marked again by its next pass.
+  void mark_referenced() {
+    // Avoid dirtying the cache line if it's already set.
+    if (!referenced_.load(std::memory_order_relaxed))
+      referenced_.store(true, std::memory_order_relaxed);
+  }
+
+  bool test_and_clear_referenced() {
+    if (!referenced_.load(std::memory_order_relaxed))
+      return false;
+    return referenced_.exchange(false, std::memory_order_relaxed);
+  }
+
+  // For pages carved up by kmalloc, the CPU whose freelists they feed.
+  u16 kmhome;
+
 private:
   rmap *rmap_pte;
   percpu<u64> outstanding_ops;
+  std::atomic<bool> referenced_;
 
 } __attribute__((aligned(16)));
 
@@ -55,7 +55,7 @@ struct sys_stat {
 
     that = new sys_stat();
     assert(that != nullptr);
-    fd = open("/dev/stat", O_RDONLY);
+    fd = open("/dev/schedstats", O_RDONLY);
     assert(fd != -1);
     r = ::read(fd, that->stats, sizeof(that->stats));
     assert(r == sizeof(that->stats));
@@ -74,6 +74,14 @@ struct sys_stat {
       that->stats[i].misses = stats[i].misses - o->stats[i].misses;
       that->stats[i].idle = stats[i].idle - o->stats[i].idle;
       that->stats[i].busy = stats[i].busy - o->stats[i].busy;
+      that->stats[i].switches = stats[i].switches - o->stats[i].switches;
+      that->stats[i].migrations = stats[i].migrations - o->stats[i].migrations;
+      that->stats[i].steal_tries = stats[i].steal_tries - o->stats[i].steal_tries;
+      that->stats[i].steal_cycles = stats[i].steal_cycles - o->stats[i].steal_cycles;
+      for (int b = 0; b < SCHED_HIST_BUCKETS; b++) {
+        that->stats[i].wait_hist[b] = stats[i].wait_hist[b] - o->stats[i].wait_hist[b];
+        that->stats[i].steal_hist[b] = stats[i].steal_hist[b] - o->stats[i].steal_hist[b];
+      }
     }
 
     return that;
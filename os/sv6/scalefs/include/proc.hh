@@ -6,6 +6,7 @@
 #include "fs.h"
 #include "sched.hh"
 #include <uk/signal.h>
+#include <uk/unistd.h>
 #include "ilist.hh"
 #include <stdexcept>
 #include "vmalloc.hh"
@@ -76,6 +77,7 @@ struct proc {
   char name[16];               // Process name (debugging)
   u64 tsc;
   u64 curcycles;
+  u64 runqtsc;                 // When last put on a runqueue
   unsigned cpuid;
   void *fpu_state;             // FXSAVE state, lazily allocated
   struct spinlock lock;
@@ -86,6 +88,7 @@ struct proc {
   struct gc_handle *gc;
   char lockname[16];
   int cpu_pin;
+  int sched_class;             // SCHED_CLASS_*
 #if MTRACE
   struct mtrace_stacks mtrace_stacks;
 #endif
@@ -93,7 +96,6 @@ struct proc {
   u64 cv_wakeup;               // Wakeup time for this process
   ilink<proc> cv_waiters;      // Linked list of processes waiting for oncv
   ilink<proc> cv_sleep;        // Linked list of processes sleeping on a cv
-  struct spinlock futex_lock;
   u64 user_fs_;
   u64 unmap_tlbreq_;
   int data_cpuid;              // Where vmap and kstack is likely to be cached
@@ -120,6 +122,7 @@ struct proc {
   void         set_state(procstate_t s);
   procstate_t  get_state(void) const { return state_; }
   int          set_cpu_pin(int cpu);
+  int          set_sched_class(int cls);
   static int   kill(int pid);
   int          kill();
   bool         cansteal(bool nonexec) {
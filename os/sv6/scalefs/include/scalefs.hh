@@ -6,6 +6,7 @@
 #include "oplog.hh"
 #include "bitset.hh"
 #include "disk.hh"
+#include "page_info.hh"
 #include <vector>
 #include <algorithm>
 #include "chainhash.hh"
@@ -120,18 +121,6 @@ struct transaction_diskblock {
     dc.reset();
   }
 
-  void writeback_through_bufcache()
-  {
-    sref<buf> bp = buf::get(1, blocknum, true);
-    {
-      auto locked = bp->write();
-      memmove(locked->data, blockdata, BSIZE);
-    }
-    // Can't use async I/O here (which uses sleep) because this is called during
-    // early boot, before the process is fully setup for scheduling.
-    writeback();
-  }
-
 };
 
 // A transaction represents all related updates that take place as the result of a
@@ -158,6 +147,13 @@ class transaction {
         delete b;
     }
 
+    // Keep a page-cache page that this transaction writes from (see
+    // write_block()) around until the transaction is done with.
+    void hold_page(sref<page_info> &&pi)
+    {
+      held_pages.push_back(std::move(pi));
+    }
+
     void add_dirty_blocknum(u32 bno)
     {
       dirty_blocknums.push_back(bno);
@@ -398,17 +394,6 @@ class transaction {
       }
     }
 
-    // Writes the blocks in the transaction to disk, and updates the
-    // corresponding bufcache entries too. Used on crash recovery to avoid
-    // rebooting after the changes have been applied.
-    void write_to_disk_update_bufcache()
-    {
-      deduplicate_blocks();
-
-      for (auto b = blocks.begin(); b != blocks.end(); b++)
-        (*b)->writeback_through_bufcache();
-    }
-
     void flush_block_queue()
     {
       if (bqueue_initialized)
@@ -438,6 +423,9 @@ class transaction {
 
     std::vector<u32> dirty_blocknums;
 
+    // Page-cache pages that queued block writes point into.
+    std::vector<sref<page_info>> held_pages;
+
     // Hash-table of blocks updated within the transaction. Used to ensure that
     // we don't log the same blocks repeatedly in the transaction.
     linearhash<u64, transaction_diskblock *> *trans_blocks;
@@ -475,8 +463,8 @@ class journal {
   friend mfs_interface;
   public:
     NEW_DELETE_OPS(journal);
-    journal() : last_applied_commit_tsc(0), current_off(0),
-                committed_trans_tsc(0), applied_trans_tsc(0)
+    journal() : last_applied_commit_tsc(0), start_blknum(0), nblocks(0),
+                current_off(0), committed_trans_tsc(0), applied_trans_tsc(0)
     {
       apply_dedup_trans = new transaction();
     }
@@ -499,13 +487,31 @@ class journal {
       return t1->commit_tsc < t2->commit_tsc;
     }
 
+    // Set the location of the journal on the disk, as laid out by mkfs.
+    void set_location(u32 first_blknum, u32 last_blknum) {
+      assert(last_blknum >= first_blknum + JOURNAL_MIN_BLKS - 1);
+      start_blknum = first_blknum;
+      nblocks = last_blknum - first_blknum + 1;
+    }
+
+    // Size of the journal in bytes.
+    u32 size() const {
+      return nblocks * BSIZE;
+    }
+
+    // The disk block that holds the journal's contents at offset 'off'.
+    u32 offset_to_blknum(u32 off) const {
+      assert(off < size());
+      return start_blknum + off / BSIZE;
+    }
+
     u32 current_offset() {
       scoped_acquire l(&offset_lock);
       return current_off;
     }
 
     void update_offset(u32 new_off) {
-      assert(new_off <= PHYS_JOURNAL_SIZE);
+      assert(new_off <= size());
       scoped_acquire l(&offset_lock);
       current_off = new_off;
     }
@@ -577,6 +583,16 @@ class journal {
     // path.
     sleeplock journal_lock;
 
+  public:
+    // Serializes writes to the on-disk journal (by the commit and the apply
+    // code paths).
+    sleeplock write_lock;
+
+  private:
+    // The journal occupies the blocks [start_blknum, start_blknum + nblocks).
+    u32 start_blknum;
+    u32 nblocks;
+
     // Current size of flushed out transactions on the disk.
     u32 current_off;
     spinlock offset_lock; // Protects access to current_off.
@@ -607,11 +623,11 @@ class mfs_interface
 
       u64 timestamp; // The transaction timestamp, serves as the transaction ID.
       u8 header_type; // The type of the journal header (start or commit)
+      u8 padding[3];
 
       // The following fields are used only if this is a start block.
-      u8 num_addr_blocks; // No. of address-blocks that follow the start block.
-      u8 padding[2];
-      u32 blocknums[1021]; // Block numbers of the data blocks in the transaction.
+      u32 num_addr_blocks; // No. of address-blocks that follow the start block.
+      u32 blocknums[1020]; // Block numbers of the data blocks in the transaction.
 
     } journal_header;
 
@@ -622,7 +638,8 @@ class mfs_interface
     // transaction, which helps apply them to the on-disk filesystem after commit.
     // The first few block numbers are stored in the start header block itself.
     // Dedicated address blocks are used if the block numbers overflow from the
-    // start header block.
+    // start header block; as many of them as needed follow the start block, so
+    // the size of a transaction is only limited by the size of the journal.
     typedef struct journal_addr_block {
       u32 blocknums[1024];
     } journal_addr_block;
@@ -630,9 +647,6 @@ class mfs_interface
     static_assert(sizeof(journal_addr_block) == BSIZE,
                   "Journal address block size should be equal to BSIZE\n");
 
-    static_assert((PHYS_JOURNAL_SIZE/BSIZE) <= 1021 + 1024,
-                   "Add more address blocks in the transaction commit code\n");
-
     // Types of journal headers
     enum : u8 {
       JOURNAL_TXN_START = 1,     // Start block
@@ -661,24 +675,21 @@ class mfs_interface
       u64 timestamp;
     };
 
-    // Keeps track of free and allocated blocks on the disk. Transactions that
-    // modify the block free bitmap on the disk go through a list of free_bit
-    // structs in memory first.
-    typedef struct free_bit {
-      u32 bno_;
-      int cpu;
-      bool is_free;
-      ilink<free_bit> link;
-
-      free_bit(u32 bno, bool f): bno_(bno), is_free(f) {}
-      NEW_DELETE_OPS(free_bit);
-
-      free_bit& operator=(const free_bit&) = delete;
-      free_bit(const free_bit&) = delete;
-
-      free_bit& operator=(free_bit&&) = default;
-      free_bit(free_bit&&) = default;
-    } free_bit;
+    // A run of free blocks [start, start + nblocks) on the disk, as a node
+    // of a freelist's treap.
+    struct free_extent {
+      u32 start;
+      u32 nblocks;
+      u32 prio;                 // Heap order of the treap
+      u32 maxrun;               // Largest nblocks in this subtree
+      free_extent *left, *right;
+
+      free_extent(u32 s, u32 n, u32 p)
+        : start(s), nblocks(n), prio(p), maxrun(n),
+          left(nullptr), right(nullptr) {}
+      u32 end() const { return start + nblocks; }
+      NEW_DELETE_OPS(free_extent);
+    };
 
     // The free block bitmap in memory. All block allocations (in transactions)
     // are performed using this in-memory data-structure. Blocks freed by a
@@ -686,26 +697,72 @@ class mfs_interface
     // This helps us guarantee that the blocks freed by a transaction are not
     // reused until it successfully commits to disk.
     struct freeblock_bitmap {
-      // We maintain the bitmap as both a vector and a linked-list so that we
-      // can perform both allocations and frees in O(1) time. The bit_vector
-      // contains entries for all blocks, whereas the bit_freelist contains
-      // entries only for blocks that are actually free. The allocator consumes
-      // items from the bit_freelist in O(1) time; the free code locates the
-      // free_bit data-structure corresponding to the block being freed in O(1)
-      // time using the bit_vector and inserts it into the bit_freelist (also
-      // in O(1) time). Items are never removed from the bit_vector so as to
-      // enable the O(1) lookups.
-      std::vector<free_bit*> bit_vector;
-
+      // Free blocks are kept as extents rather than one entry per block, so
+      // the memory used grows with the fragmentation of the free space and
+      // not with the size of the disk. Each freelist keeps its extents in a
+      // treap ordered by starting block number, and coalesces adjacent ones
+      // when blocks are freed. Every node also records the largest extent
+      // below it, so allocations and frees both take O(log n) time in the
+      // number of extents.
       struct freelist {
-        ilist<free_bit, &free_bit::link> bit_freelist;
-        spinlock list_lock; // Guards modifications to the bit_freelist
+        free_extent *root = nullptr;
+        u32 nextents = 0; // Number of extents in the treap.
+        u32 nfree = 0; // Total number of blocks in the extents.
+        u32 seed = 1; // For the treap priorities.
+        spinlock list_lock; // Guards modifications to the extents.
+
+        // Called with list_lock held.
+        u32 take(u32 want, u32 *got);
+        u32 take_at(u32 bno, u32 want, u32 *got);
+        void put(u32 bno, u32 nblocks);
+
+      private:
+        void carve(free_extent *e, u32 bno, u32 n);
+        void insert(u32 start, u32 nblocks);
+        void erase(free_extent *e);
       };
 
-      // We maintain per-CPU freelists for scalability. The bit_vector is
-      // read-only after initialization, so a single one will suffice.
+      // We maintain per-CPU freelists for scalability. Which freelist a block
+      // goes back to when it is freed is determined by the stripe layout
+      // below, no matter which freelist it was allocated from.
       percpu<struct freelist> freelists;
       struct freelist reserve_freelist; // Global reserve pool of free blocks.
+
+      // Layout of the per-CPU stripes, computed at boot. CPU i owns blocks
+      // [first_free_bit + i*bits_per_cpu, first_free_bit + (i+1)*bits_per_cpu)
+      // and the rest of the blocks belong to the reserve pool.
+      u32 first_free_bit;
+      u32 bits_per_cpu;
+
+      // Returns the stripe that block bno belongs to (NCPU denotes the
+      // reserve pool), and the first block past the end of that stripe
+      // in *end.
+      int stripe_of(u32 bno, u32 *end) const {
+        u32 stripes_end = first_free_bit + NCPU * bits_per_cpu;
+
+        if (bno < first_free_bit) {
+          *end = first_free_bit;
+          return NCPU;
+        } else if (bno >= stripes_end) {
+          *end = ~0u;
+          return NCPU;
+        }
+
+        int stripe = (bno - first_free_bit) / bits_per_cpu;
+        *end = first_free_bit + (stripe + 1) * bits_per_cpu;
+        return stripe;
+      }
+
+      struct freelist& freelist_of(int stripe) {
+        return stripe < NCPU ? freelists[stripe] : reserve_freelist;
+      }
+
+      // Number of stripes (NCPU per-CPU stripes and the reserve stripe) that
+      // are still being scanned by the boot-time initialization threads.
+      // Allocations and frees wait on init_cv until this drops to zero.
+      std::atomic<int> stripes_pending;
+      spinlock init_lock;
+      condvar init_cv;
     } freeblock_bitmap;
 
     NEW_DELETE_OPS(mfs_interface);
@@ -715,10 +772,11 @@ class mfs_interface
     u64 get_file_size(u64 mfile_mnum);
     void update_file_size(u64 mfile_mnum, u32 size, transaction *tr);
     void initialize_file(sref<mnode> m);
-    int load_file_page(u64 mfile_mnum, char *p, size_t pos, size_t nbytes);
+    int load_file_pages(u64 mfile_mnum, char **pages, size_t pos,
+                        size_t nbytes);
     sref<inode> prepare_sync_file_pages(u64 mfile_mnum, transaction *tr);
-    int sync_file_page(sref<inode> ip, char *p, size_t pos, size_t nbytes,
-                       transaction *tr);
+    int sync_file_pages(sref<inode> ip, char **pages, size_t pos,
+                        size_t nbytes, transaction *tr);
     void finish_sync_file_pages(sref<inode> ip, transaction *tr);
     sref<inode> alloc_inode_for_mnode(u64 mnum, u8 type);
     void create_file(u64 mnum, u8 type, transaction *tr);
@@ -757,6 +815,7 @@ class mfs_interface
     void print_txq_stats();
     bool fits_in_journal(size_t num_trans_blocks, int cpu);
     void write_journal(char *buf, size_t size, transaction *tr, int cpu);
+    bool read_journal(char *buf, size_t size, int cpu);
     void write_journal_transaction_blocks(const
            std::vector<transaction_diskblock*> &vec, const u64 timestamp,
            bitset<NDISK> &disks_written, int cpu);
@@ -770,6 +829,7 @@ class mfs_interface
                              transaction *trans);
     bool get_txn_commit_block(int cpu, transaction *trans);
     void recover_journal(int cpu, std::vector<transaction*> &trans_vec);
+    void apply_recovered_transactions(std::vector<transaction*> *trans_vecs);
     void reset_journal(int cpu);
     void init_journal(int cpu);
 
@@ -815,7 +875,11 @@ class mfs_interface
 
     // Block allocator functionality
     void initialize_freeblock_bitmap();
-    u32  alloc_block();
+    void init_freeblock_stripe(int stripe);
+    void wait_freeblock_bitmap();
+    u32  alloc_blocks(u32 nblocks, u32 *nalloc, u32 goal = 0);
+    u32  alloc_block(u32 goal = 0);
+    void free_blocks(u32 bno, u32 nblocks);
     void free_block(u32 bno);
     void print_free_blocks(print_stream *s);
 
@@ -869,7 +933,6 @@ class mfs_interface
 
   public:
     percpu<journal*> fs_journal;
-    percpu<sref<inode> > sv6_journal;
 
     // A hash-table to track the last transaction(*) that modified a given
     // inode-block or bitmap-block. (* = specifically, which journal's
@@ -1,5 +1,8 @@
 #pragma once
 
+// Log2 histogram buckets: bucket i counts samples of [2^i, 2^(i+1)) cycles.
+#define SCHED_HIST_BUCKETS 40
+
 struct sched_stat
 {
   u64 enqs;
@@ -9,4 +12,10 @@ struct sched_stat
   u64 idle;
   u64 busy;
   u64 schedstart;
+  u64 switches;                 // Context switches on this CPU
+  u64 migrations;               // Procs stolen to this CPU
+  u64 steal_tries;              // Steal attempts by this CPU
+  u64 steal_cycles;             // ... and cycles spent in them
+  u64 wait_hist[SCHED_HIST_BUCKETS];  // Runqueue wait, enqueue to run
+  u64 steal_hist[SCHED_HIST_BUCKETS]; // Steal attempt latency
 };
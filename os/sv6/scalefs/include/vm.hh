@@ -48,6 +48,12 @@ struct vmdesc : public mmu::page_tracker
 
     // Set if the page should be shared across fork().
     FLAG_SHARED = 1<<5,
+
+    // Set by madvise(MADV_HUGEPAGE) or madvise(MADV_NOHUGEPAGE) to
+    // ask for or against mapping anonymous memory with large pages
+    // (see VM_THP).
+    FLAG_HUGE = 1<<6,
+    FLAG_NOHUGE = 1<<7,
   };
 
   // Flags
@@ -146,6 +152,15 @@ struct vmap : public referenced {
   // mapping from vmdesc. Used while evicting pages from the page-cache.
   void clear_mapping(uptr addr);
 
+  // Whether addr is mapped MAP_SHARED and writable, so that stores to it
+  // dirty the page behind the page-cache's back.
+  bool maps_shared_writable(uptr addr);
+
+  // Clear the accessed bit of addr's page table entries and return
+  // whether it was set.  Loads and stores through a mapping never go
+  // through the page-cache, so this is how the page reclaimer sees them.
+  bool test_and_clear_accessed(uptr addr);
+
   // Populate vmdesc's.
   int willneed(uptr start, uptr len);
 
@@ -155,6 +170,10 @@ struct vmap : public referenced {
   // Modify protection on a range.  flags must be 0 or FLAG_MAPPED.
   int mprotect(uptr start, uptr len, uint64_t flags);
 
+  // Set the large page hint of a range to flag, which must be 0,
+  // FLAG_HUGE, or FLAG_NOHUGE.
+  int hugepage(uptr start, uptr len, uint64_t flag);
+
   // XXX(Austin) HACK for benchmarking.  Used to simulate the shared
   // pages we could have if we had a unified buffer cache.
   int dup_page(uptr dest, uptr src);
@@ -215,5 +234,26 @@ private:
   // locking vpfs_ at @c it.  This throws bad_alloc if a page must be
   // allocated and cannot be.
   page_info *ensure_page(const vpf_array::iterator &it, access_type type,
-                         bool *allocated = nullptr);
+                         bool *allocated = nullptr, u32 nfill = 1);
+
+  // Make page the backing page of the frame at @c it, clearing its COW
+  // flag if @c copied.  The caller must hold the lock on @c it.
+  void set_page(const vpf_array::iterator &it, const sref<page_info> &page,
+                bool copied);
+
+  // Fill in ptes[] for the already resident pages of [start, start+n
+  // pages) that map the same way as @c desc (skipping va itself).  The
+  // caller must hold the lock on the range.  Returns the number of PTEs
+  // filled in.
+  size_t fault_around(const vmdesc &desc, uptr va, uptr start, size_t n,
+                      pme_t *ptes);
+
+  // Try to map the LGPGSIZE-aligned region around va with a single large
+  // page, if it maps a file folio.  Returns false if it doesn't apply.
+  bool map_folio(uptr va, access_type type);
+
+  // Try to map the LGPGSIZE-aligned region around va with a single large
+  // page, if it is anonymous memory that is either not populated yet or
+  // already backed by one large page.  Returns false if it doesn't apply.
+  bool map_anon_large(uptr va, access_type type);
 };
@@ -192,6 +192,58 @@ buddy_allocator::free_order(void *ptr, size_t order)
   }
 }
 
+void
+buddy_allocator::split(void *ptr, size_t size)
+{
+  // Within an allocated block, both buddies of every lower-order pair
+  // are in the same state, so their bitmap bits are already zero, just
+  // as they are for a run of allocated order 0 blocks.  Only the debug
+  // state needs to be brought in line.
+  for (size_t order = size_to_order(size); order-- > 0; )
+    for (uintptr_t p = (uintptr_t)ptr; p < (uintptr_t)ptr + size;
+         p += (uintptr_t)MIN_SIZE << order)
+      mark_allocated((void*)p, order, true);
+}
+
+size_t
+buddy_allocator::alloc_pages(void **pages, size_t n)
+{
+  size_t got = 0;
+  size_t order = MAX_ORDER;
+
+  while (got < n && !empty()) {
+    // The largest order that fits what is left and that we have a
+    // block of, or can split one down to.
+    while (order > 0 && (1ul << order) > n - got)
+      --order;
+    if (order > highest_avail_order)
+      order = highest_avail_order;
+    void *block = alloc_order(order);
+    if (!block) {
+      if (order == 0)
+        break;
+      --order;
+      continue;
+    }
+    split(block, MIN_SIZE << order);
+    for (size_t i = 0; i < (1ul << order); ++i)
+      pages[got++] = (char*)block + i * MIN_SIZE;
+  }
+
+  free_bytes -= got * MIN_SIZE;
+  if (free_bytes < lowest_free_bytes)
+    lowest_free_bytes = free_bytes;
+  return got;
+}
+
+void
+buddy_allocator::free_pages(void * const *pages, size_t n)
+{
+  free_bytes += n * MIN_SIZE;
+  for (size_t i = 0; i < n; ++i)
+    free_order(pages[i], 0);
+}
+
 bool
 buddy_allocator::flip_bit(void *ptr, size_t order)
 {
@@ -147,6 +147,21 @@ condvar::wake_one(proc *p)
   wakeup(p);
 }
 
+// Wake up the process that has been sleeping on this condvar the
+// longest, if any.  Returns true if there was one.
+bool
+condvar::wake_one()
+{
+  scoped_acquire cv_l(&lock);
+  if (waiters.empty())
+    return false;
+  // sleep_to pushes to the front.
+  struct proc *p = &waiters.back();
+  scoped_acquire p_l(&p->lock);
+  wake_one(p);
+  return true;
+}
+
 // Wake up all processes sleeping on this condvar.
 void
 condvar::wake_all(int yield, proc *callerproc)
@@ -78,14 +78,17 @@ file_mnode::read(char *addr, size_t n)
   } else if (m->type() != mnode::types::file) {
     return -1;
   } else {
-    mfile::page_state ps = m->as_file()->get_page(off / PGSIZE);
+    l = off_lock.guard();
+    u64 pgidx = off / PGSIZE;
+    u32 npages = (PGROUNDUP((u64)off + n) - PGROUNDDOWN(off)) / PGSIZE;
+    mfile::page_state ps = m->as_file()->get_page(pgidx,
+                                                  ra.update(pgidx, npages));
     if (!ps.get_page_info())
       return 0;
 
     if (ps.is_partial_page() && off >= *m->as_file()->read_size())
       return 0;
 
-    l = off_lock.guard();
     r = readm(m, addr, off, n);
   }
   if (r > 0)
@@ -142,9 +145,36 @@ file_mnode::pread(char *addr, size_t n, off_t off)
       return -1;
     return devsw[major].pread(m->as_dev(), addr, off, n);
   }
+  if (m->type() == mnode::types::file && n) {
+    // Read the requested range in with a single clustered read.
+    u32 npages = (PGROUNDUP(off + n) - PGROUNDDOWN(off)) / PGSIZE;
+    m->as_file()->get_page(off / PGSIZE, npages);
+  }
   return readm(m, addr, off, n);
 }
 
+ssize_t
+file_mnode::splice(file *out, size_t n, off_t *inoff, off_t *outoff)
+{
+  // Only file-to-pipe splices share pages; pipes splice out themselves.
+  struct pipe *p = out->splice_pipe();
+  if (!readable || !p || outoff || m->type() != mnode::types::file)
+    return -1;
+
+  ssize_t r;
+  if (inoff) {
+    r = pipesplicein(p, m, *inoff, n);
+    if (r > 0)
+      *inoff += r;
+    return r;
+  }
+  auto l = off_lock.guard();
+  r = pipesplicein(p, m, off, n);
+  if (r > 0)
+    off += r;
+  return r;
+}
+
 ssize_t
 file_mnode::pwrite(const char *addr, size_t n, off_t off)
 {
@@ -177,6 +207,14 @@ file_pipe_reader::read(char *addr, size_t n)
   return piperead(pipe, addr, n);
 }
 
+ssize_t
+file_pipe_reader::splice(file *out, size_t n, off_t *inoff, off_t *outoff)
+{
+  if (inoff)
+    return -1;
+  return pipespliceout(pipe, out, outoff, n);
+}
+
 void
 file_pipe_reader::onzero(void)
 {
@@ -66,6 +66,8 @@ get_superblock(struct superblock *sb)
   sb->size = sb_root.size;
   sb->ninodes = sb_root.ninodes;
   sb->nblocks = sb_root.nblocks;
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    sb->journal_blknums[cpu] = sb_root.journal_blknums[cpu];
 }
 
 // Zero the in-memory buffer-cache block corresponding to a disk block.
@@ -101,15 +103,45 @@ throw_out_of_blocks()
 #endif
 }
 
+// Blocks set aside for a known number of upcoming allocations, so that they
+// come out of as few contiguous runs as possible (see writei_pages()).
+struct block_reservation
+{
+  u32 want = 0;         // Allocations still expected
+  u32 next = 0;         // Next reserved block
+  u32 left = 0;         // Number of reserved blocks starting at next
+
+  // Give back whatever wasn't used.
+  void release()
+  {
+    if (left)
+      rootfs_interface->free_blocks(next, left);
+    left = 0;
+  }
+};
+
 // Allocate a disk block. This makes changes only to the in-memory
 // free-bit-vector (maintained by rootfs_interface), not the one on the disk.
+// If 'goal' is non-zero, the allocator tries to return that block. If 'resv'
+// is given and still expects allocations, the block comes from there,
+// reserving the next run (starting at 'goal' if possible) once it runs dry.
 static u32
-balloc(u32 dev, transaction *trans = NULL, bool zero_on_alloc = false)
+balloc(u32 dev, transaction *trans = NULL, bool zero_on_alloc = false,
+       u32 goal = 0, block_reservation *resv = NULL)
 {
   int b;
 
   if (dev == 1) {
-    b = rootfs_interface->alloc_block();
+    if (resv && resv->want) {
+      if (!resv->left)
+        resv->next = rootfs_interface->alloc_blocks(resv->want, &resv->left,
+                                                    goal);
+      b = resv->next++;
+      resv->left--;
+      resv->want--;
+    } else {
+      b = rootfs_interface->alloc_block(goal);
+    }
     if (b < sb_root.size) {
       if (trans)
         trans->add_allocated_block(b);
@@ -216,47 +248,109 @@ balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool alloc)
 // A non-zero ip->ref keeps these unlocked inodes in the cache.
 
 
-// Initialize the freeinum_bitmap from the disk when the system boots.
+// Scan one stripe of the on-disk inode table and build its freelist. Stripes
+// 0 to NCPU-1 belong to the corresponding CPUs. Stripe NCPU is the global
+// reserve pool: it gets whatever is left over at the end of the inode table,
+// to be used when a per-CPU freelist runs out (before stealing free inums from
+// other CPUs' freelists), as well as the leftover inums in
+// [1, first_free_inum).
 static void
-initialize_freeinum_bitmap(void)
+init_freeinum_stripe(int stripe)
 {
-  sref<buf> bp;
   superblock sb;
-  int ninums;
-  u32 first_free_inodeblock_inum = 0;
-
   get_superblock(&sb);
 
-  // Allocate the memory for the inum_vector in one shot, instead of doing it
-  // piecemeal using .push_back() in a loop.
-  freeinum_bitmap.inum_vector.reserve(sb.ninodes);
+  u32 first_free_inum = freeinum_bitmap.first_free_inum;
+  u32 inums_per_cpu = freeinum_bitmap.inums_per_cpu;
+  auto &fl = (stripe < NCPU) ? freeinum_bitmap.freelists[stripe] :
+                               freeinum_bitmap.reserve_freelist;
 
-  for (u32 inum = 0; inum < sb.ninodes; inum += IPB) {
-    bp = buf::get(1, IBLOCK(inum));
-    auto copy = bp->read();
+  auto scan = [&](u32 lo, u32 hi) {
+    for (u32 inum = lo - lo % IPB; inum < hi; inum += IPB) {
+      sref<buf> bp = buf::get(1, IBLOCK(inum));
+      auto copy = bp->read();
+      u32 end = std::min(hi, inum + (u32)IPB);
 
-    ninums = std::min((u32)IPB, sb.ninodes - inum);
+      auto list_lock = fl.list_lock.guard();
 
-    for (int i = 0; i < ninums; i++) {
-      const dinode *dip = (const struct dinode*)copy->data + (inum + i)%IPB;
+      for (u32 i = std::max(lo, inum); i < end; i++) {
+        const dinode *dip = (const struct dinode*)copy->data + i%IPB;
 
-      // Maintain a vector as well as a linked-list representation of the free
-      // inums, to speed up freeing and allocation of blocks, respectively.
-      free_inum *finum = new free_inum(inum + i, !dip->type);
-      freeinum_bitmap.inum_vector.push_back(finum);
+        // Maintain a vector as well as a linked-list representation of the
+        // free inums, to speed up freeing and allocation of inums,
+        // respectively.
+        free_inum *finum = new free_inum(i, !dip->type);
+        finum->cpu = stripe; // NCPU denotes the reserve pool.
+        freeinum_bitmap.inum_vector[i] = finum;
 
-      // Make note of the first inode block (inum) that starts with a free inum
-      // (which is an approximation that, that entire inode block (and all
-      // the subsequent ones) contains only free inums). That's where we'll
-      // start allocating per-CPU resources from (further down in the code),
-      // in order to avoid initializing CPU0 with nearly no free inums.
-      if (!first_free_inodeblock_inum && !dip->type && i == 0)
-        first_free_inodeblock_inum = inum;
+        // inum 0 is not used, so don't add it to any freelist.
+        if (finum->is_free && i != 0)
+          fl.inum_freelist.push_back(finum);
+      }
     }
+  };
+
+  if (stripe < NCPU) {
+    u32 start = first_free_inum + stripe * inums_per_cpu;
+
+    if (VERBOSE)
+      cprintf("Per-CPU inode allocator: CPU %d   inodes [%u - %u]\n",
+              stripe, start, start + inums_per_cpu - 1);
+
+    scan(start, start + inums_per_cpu);
+  } else {
+    scan(first_free_inum + NCPU * inums_per_cpu, sb.ninodes);
+    scan(0, first_free_inum);
   }
 
-  // Distribute the inums among the CPUs and add the free inums to the per-CPU
-  // freelists.
+  if (--freeinum_bitmap.stripes_pending == 0) {
+    scoped_acquire a(&freeinum_bitmap.init_lock);
+    freeinum_bitmap.init_cv.wake_all();
+  }
+}
+
+// Boot-time thread that builds the freelists of the freeinum_bitmap stripes
+// assigned to its CPU.
+static void
+freeinum_bitmap_worker(void *arg)
+{
+  int worker = (int)(uptr)arg;
+
+  // Stripe NCPU denotes the global reserve pool.
+  for (int stripe = worker; stripe <= NCPU; stripe += ncpu)
+    init_freeinum_stripe(stripe);
+}
+
+// Initialize the freeinum_bitmap from the disk when the system boots.
+//
+// Like the freeblock_bitmap, we only decide on the per-CPU stripes here and
+// let one thread per CPU read the inode blocks of its stripes and build their
+// freelists.
+static void
+initialize_freeinum_bitmap(void)
+{
+  superblock sb;
+  u32 first_free_inodeblock_inum = 0;
+
+  get_superblock(&sb);
+
+  // Make note of the first inode block (inum) that starts with a free inum
+  // (which is an approximation that, that entire inode block (and all
+  // the subsequent ones) contains only free inums). That's where we'll
+  // start allocating per-CPU resources from, in order to avoid initializing
+  // CPU0 with nearly no free inums. inum 0 is never used, so the first inode
+  // block doesn't count.
+  for (u32 inum = IPB; inum < sb.ninodes; inum += IPB) {
+    sref<buf> bp = buf::get(1, IBLOCK(inum));
+    auto copy = bp->read();
+    const dinode *dip = (const struct dinode*)copy->data;
+    if (!dip->type) {
+      first_free_inodeblock_inum = inum;
+      break;
+    }
+  }
+
+  // Distribute the inums among the CPUs.
 
   // TODO: Remove this assert and handle cases where multiple CPUs have to share
   // the same inode blocks.
@@ -264,60 +358,37 @@ initialize_freeinum_bitmap(void)
 
   u32 ninodeblocks = sb.ninodes/IPB - first_free_inodeblock_inum/IPB;
   u32 inodeblocks_per_cpu = ninodeblocks/NCPU;
-  u32 inums_per_cpu = inodeblocks_per_cpu * IPB;
 
-  for (int cpu = 0; cpu < NCPU; cpu++) {
-    auto list_lock = freeinum_bitmap.freelists[cpu].list_lock.guard();
+  freeinum_bitmap.first_free_inum = first_free_inodeblock_inum;
+  freeinum_bitmap.inums_per_cpu = inodeblocks_per_cpu * IPB;
 
-    if (VERBOSE)
-      cprintf("Per-CPU inode allocator: CPU %d   inodes [%u - %u]\n",
-              cpu, first_free_inodeblock_inum + cpu * inums_per_cpu,
-              first_free_inodeblock_inum + ((cpu+1) * inums_per_cpu) - 1);
-
-    for (u32 inum = cpu * inums_per_cpu; inum < (cpu+1) * inums_per_cpu; inum++) {
-      if (!inum)
-        continue; // inum 0 is not used, so don't add it to any freelist.
-
-      auto finum = freeinum_bitmap.inum_vector.at(inum +
-                                                  first_free_inodeblock_inum);
-      finum->cpu = cpu;
-      if (finum->is_free)
-        freeinum_bitmap.freelists[cpu].inum_freelist.push_back(finum);
-    }
-  }
+  // Size the inum_vector up front, so that the stripes can fill in their
+  // (disjoint) ranges of it concurrently.
+  freeinum_bitmap.inum_vector.reserve(sb.ninodes);
+  for (u32 inum = 0; inum < sb.ninodes; inum++)
+    freeinum_bitmap.inum_vector.push_back(nullptr);
 
-  // Build a global reserve pool of free inums using whatever is remaining,
-  // to be used when a per-CPU freelist runs out, before stealing free inums
-  // from other CPUs' freelists.
-  if (NCPU * inodeblocks_per_cpu < ninodeblocks) {
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 inum = NCPU * inums_per_cpu;
-         inum + first_free_inodeblock_inum < sb.ninodes; inum++) {
-      if (!inum)
-        continue; // inum 0 is not used, so don't add it to any freelist.
-
-      auto finum = freeinum_bitmap.inum_vector.at(inum +
-                                                  first_free_inodeblock_inum);
-      finum->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (finum->is_free)
-        freeinum_bitmap.reserve_freelist.inum_freelist.push_back(finum);
-    }
-  }
+  freeinum_bitmap.stripes_pending.store(NCPU + 1);
 
-  // Any other leftover free inums from [1 to first_free_inodeblock_inum) also
-  // go to the reserve pool. Also make sure to set the CPU number for those
-  // free-inums irrespective of whether they are free.
-  {
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 inum = 1; inum < first_free_inodeblock_inum; inum++) {
-      auto finum = freeinum_bitmap.inum_vector.at(inum);
-      finum->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (finum->is_free)
-        freeinum_bitmap.reserve_freelist.inum_freelist.push_back(finum);
-    }
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "fiinit_%u", c);
+    threadpin(freeinum_bitmap_worker, (void*)(uptr)c, namebuf, c);
   }
 }
 
+// Wait until all the stripes of the freeinum_bitmap have been initialized.
+static void
+wait_freeinum_bitmap(void)
+{
+  if (freeinum_bitmap.stripes_pending.load() == 0)
+    return;
+
+  scoped_acquire a(&freeinum_bitmap.init_lock);
+  while (freeinum_bitmap.stripes_pending.load() != 0)
+    freeinum_bitmap.init_cv.sleep(&freeinum_bitmap.init_lock);
+}
+
 // Allocate an inode number from the freeinum_bitmap.
 static u32
 alloc_inode_number(void)
@@ -326,6 +397,8 @@ alloc_inode_number(void)
   int cpu = myid();
   static bool warned_once = false;
 
+  wait_freeinum_bitmap();
+
   // Use the linked-list representation of the free-inums to perform inum
   // allocation in O(1) time. This list only contains the inums that are
   // actually free, so we can allocate any one of them.
@@ -402,6 +475,8 @@ try_neighbor:
 void
 free_inode_number(u32 inum)
 {
+  wait_freeinum_bitmap();
+
   // Use the vector representation of the free-inums to free the inum in
   // O(1) time (by optimizing the blocknumber-to-free_inum lookup).
   free_inum *finum = freeinum_bitmap.inum_vector.at(inum);
@@ -724,17 +799,26 @@ iunlock(sref<inode> ip)
 // Return the disk block address of the nth block in inode ip. If there is no
 // such block, bmap allocates one. The caller must hold ilock() for write if
 // invoking bmap() from writei().
+//
+// New blocks are allocated right after the block that precedes them in the
+// file (counting the indirect blocks too) whenever possible, so that files
+// that are written sequentially end up contiguous on the disk.
 static u32
 bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = false,
-     bool lazy_trans_update = false)
+     bool lazy_trans_update = false, block_reservation *resv = NULL)
 {
   scoped_gc_epoch e;
   bool skip_disk_read = false;
   u32* ap;
+  u32 ablock;
+
+  // The block following b on the disk, or no preference if b isn't allocated.
+  auto next_to = [](u32 b) -> u32 { return b ? b + 1 : 0; };
 
   if (bn < NDIRECT) {
     if (ip->addrs[bn] == 0)
-      ip->addrs[bn] = balloc(ip->dev, trans, zero_on_alloc);
+      ip->addrs[bn] = balloc(ip->dev, trans, zero_on_alloc,
+                             bn ? next_to(ip->addrs[bn-1]) : 0, resv);
 
     return ip->addrs[bn];
   }
@@ -742,7 +826,8 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
 
   if (bn < NINDIRECT) {
     if (ip->addrs[NDIRECT] == 0) {
-      ip->addrs[NDIRECT] = balloc(ip->dev, trans, true);
+      ip->addrs[NDIRECT] = balloc(ip->dev, trans, true,
+                                  next_to(ip->addrs[NDIRECT-1]));
       // We allocated the block just now. So need to read it from the disk.
       skip_disk_read = true;
     }
@@ -753,7 +838,8 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
     ap = (u32 *)locked->data;
 
     if (ap[bn] == 0) {
-      ap[bn] = balloc(ip->dev, trans, zero_on_alloc);
+      ap[bn] = balloc(ip->dev, trans, zero_on_alloc,
+                      next_to(bn ? ap[bn-1] : ip->addrs[NDIRECT]), resv);
       if (trans) {
         if (lazy_trans_update)
           bp->add_blocknum_to_transaction(trans);
@@ -782,7 +868,9 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
   ap = (u32 *)flocked->data;
 
   if (ap[bn / NINDIRECT] == 0) {
-    ap[bn / NINDIRECT] = balloc(ip->dev, trans, true);
+    ap[bn / NINDIRECT] = balloc(ip->dev, trans, true,
+                                next_to(bn / NINDIRECT ? ap[bn / NINDIRECT - 1] :
+                                        ip->addrs[NDIRECT+1]));
     // We allocated the block just now. So need to read it from the disk.
     skip_disk_read = true;
 
@@ -795,13 +883,16 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
   }
 
   // Second-level doubly-indirect block
-  sref<buf> sp = buf::get(ip->dev, ap[bn / NINDIRECT], skip_disk_read);
+  ablock = ap[bn / NINDIRECT];
+  sref<buf> sp = buf::get(ip->dev, ablock, skip_disk_read);
   skip_disk_read = false;
   auto slocked = sp->write();
   ap = (u32 *)slocked->data;
 
   if (ap[bn % NINDIRECT] == 0) {
-    ap[bn % NINDIRECT] = balloc(ip->dev, trans, zero_on_alloc);
+    ap[bn % NINDIRECT] = balloc(ip->dev, trans, zero_on_alloc,
+                                next_to(bn % NINDIRECT ? ap[bn % NINDIRECT - 1] :
+                                        ablock), resv);
     if (trans) {
       if (lazy_trans_update)
         sp->add_blocknum_to_transaction(trans);
@@ -813,6 +904,45 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
   return ap[bn % NINDIRECT];
 }
 
+// Like bmap(), but never allocates: returns 0 if the nth block of the inode is
+// a hole.
+static u32
+bmap_lookup(sref<inode> ip, u32 bn)
+{
+  scoped_gc_epoch e;
+  u32 ablock;
+
+  if (bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if (bn < NINDIRECT) {
+    if (!ip->addrs[NDIRECT])
+      return 0;
+    sref<buf> bp = buf::get(ip->dev, ip->addrs[NDIRECT]);
+    auto copy = bp->read();
+    return ((u32 *)copy->data)[bn];
+  }
+  bn -= NINDIRECT;
+
+  if (bn >= NINDIRECT * NINDIRECT)
+    panic("bmap_lookup: %d out of range", bn);
+
+  if (!ip->addrs[NDIRECT+1])
+    return 0;
+  {
+    sref<buf> fp = buf::get(ip->dev, ip->addrs[NDIRECT+1]);
+    auto copy = fp->read();
+    ablock = ((u32 *)copy->data)[bn / NINDIRECT];
+  }
+
+  if (!ablock)
+    return 0;
+  sref<buf> sp = buf::get(ip->dev, ablock);
+  auto copy = sp->read();
+  return ((u32 *)copy->data)[bn % NINDIRECT];
+}
+
 // Caller must hold ilock for write. The caller must also arrange to invoke
 // iupdate() when suitable, to flush the new inode size to the disk.
 void
@@ -947,52 +1077,32 @@ itrunc(sref<inode> ip, u32 offset, transaction *trans)
   ip->size = offset;
 }
 
-// Drop the (clean) buffer-cache blocks associated with this file.
+// Drop the (clean) buffer-cache blocks associated with this file. File data
+// never goes through the bufcache (see readi_pages() and writei()), so only the
+// indirect blocks need to be dropped.
 // Caller must hold ilock for read.
 void
 drop_bufcache(sref<inode> ip)
 {
   scoped_gc_epoch e;
 
-  for (int i = 0; i < NDIRECT; i++) {
-    if (ip->addrs[i])
-      buf::put(ip->dev, ip->addrs[i]);
-  }
-
-  // Note: If the indirect or doubly indirect blocks are themselves not in the
-  // bufcache, none of the data-blocks they point to will be in the bufcache
-  // either. So check that first! Don't read blocks from the disk into the
-  // bufcache just to throw them out!
-
-  if (ip->addrs[NDIRECT] && buf::in_bufcache(ip->dev, ip->addrs[NDIRECT])) {
-    sref<buf> bp = buf::get(ip->dev, ip->addrs[NDIRECT]);
-    auto copy = bp->read();
-    u32 *a = (u32*)copy->data;
-    for (int i = 0; i < NINDIRECT; i++) {
-      if (a[i])
-        buf::put(ip->dev, a[i]);
-    }
-    // Drop the indirect block.
+  if (ip->addrs[NDIRECT])
     buf::put(ip->dev, ip->addrs[NDIRECT]);
-  }
+
+  // Note: If the doubly indirect block is itself not in the bufcache, none of
+  // the second-level blocks it points to will be in the bufcache either. So
+  // check that first! Don't read blocks from the disk into the bufcache just
+  // to throw them out!
 
   if (ip->addrs[NDIRECT+1] && buf::in_bufcache(ip->dev, ip->addrs[NDIRECT+1])) {
     sref<buf> bp1 = buf::get(ip->dev, ip->addrs[NDIRECT+1]);
     auto copy1 = bp1->read();
     u32 *a1 = (u32*)copy1->data;
 
+    // Drop the second-level doubly-indirect blocks.
     for (int i = 0; i < NINDIRECT; i++) {
-      if (a1[i] && buf::in_bufcache(ip->dev, a1[i])) {
-        sref<buf> bp2 = buf::get(ip->dev, a1[i]);
-        auto copy2 = bp2->read();
-        u32 *a2 = (u32*)copy2->data;
-        for (int j = 0; j < NINDIRECT; j++) {
-          if (a2[j])
-            buf::put(ip->dev, a2[j]);
-        }
-        // Drop the second-level doubly-indirect block.
+      if (a1[i])
         buf::put(ip->dev, a1[i]);
-      }
     }
 
     // Drop the first-level doubly-indirect block.
@@ -1047,6 +1157,84 @@ readi(sref<inode> ip, char *dst, u32 off, u32 n)
   return n;
 }
 
+// Read n bytes starting at the page-aligned offset off into the pages pgs[]
+// (PGSIZE each), on behalf of the page-cache. File data bypasses
+// the bufcache altogether: the blocks are DMA'd straight into the pages. They
+// are gathered into runs that are contiguous on the disk and each run is
+// fetched with a single scatter-gather read; all the reads are issued before
+// waiting on any of them, so the disk(s) can work on them in parallel. Holes
+// in the file are zero-filled (and, unlike readi(), not allocated).
+//
+// The same locking considerations as readi() apply. The bufcache never holds
+// file data (the fsync path writes it with writei_pages()), so the disk is
+// always up-to-date for blocks that are not dirty in the page-cache.
+int
+readi_pages(sref<inode> ip, char **pgs, u32 off, u32 n)
+{
+  scoped_gc_epoch e;
+
+  enum { RUN_MAX_BLKS = SG_IO_SIZE / BSIZE };
+  static_assert(PGSIZE % BSIZE == 0, "page must hold whole blocks");
+
+  struct run {
+    NEW_DELETE_OPS(run);
+    sref<disk_completion> dc;
+    kiovec iov[RUN_MAX_BLKS];
+    u32 start, nblks;
+  };
+
+  if (ip->type == T_DEV)
+    return -1;
+
+  assert(off % PGSIZE == 0);
+  if (off > ip->size || off + n < off)
+    return -1;
+  if (off + n > ip->size)
+    n = ip->size - off;
+
+  std::vector<run*> runs;
+  run *cur = nullptr;
+
+  for (u32 tot = 0; tot < n; tot += BSIZE) {
+    char *dst = pgs[tot / PGSIZE] + tot % PGSIZE;
+    u32 bno = bmap_lookup(ip, (off + tot) / BSIZE);
+    if (!bno) {
+      memset(dst, 0, BSIZE);
+      continue;
+    }
+
+    // disk_readv() picks the disk using only the first block of the request,
+    // so a run must not cross a stripe boundary.
+    if (!cur || cur->start + cur->nblks != bno || cur->nblks == RUN_MAX_BLKS ||
+        bno % RUN_MAX_BLKS == 0) {
+      if (cur)
+        disk_readv(ip->dev, cur->iov, cur->nblks, (u64)cur->start * BSIZE,
+                   cur->dc);
+      cur = new run();
+      cur->dc = make_sref<disk_completion>();
+      cur->start = bno;
+      cur->nblks = 0;
+      runs.push_back(cur);
+    }
+    cur->iov[cur->nblks++] = kiovec { dst, BSIZE };
+  }
+
+  if (cur)
+    disk_readv(ip->dev, cur->iov, cur->nblks, (u64)cur->start * BSIZE, cur->dc);
+
+  for (auto r : runs) {
+    r->dc->wait();
+    delete r;
+  }
+
+  // The last block may extend past the end of the file; don't expose
+  // whatever the disk holds there.
+  if (PGOFFSET(n))
+    memset(pgs[n / PGSIZE] + PGOFFSET(n), 0, PGSIZE - PGOFFSET(n));
+
+  return n;
+}
+
 // Write data to the inode. Called in the fsync() path to flush dirty data from
 // the page-cache (MemFS) to the inode's data blocks on the disk via the
 // bufcache.
@@ -1133,6 +1321,58 @@ writei(sref<inode> ip, const char *src, u32 off, u32 n, transaction *trans,
   return tot;
 }
 
+// Write n bytes at the page-aligned offset off of a file, from the page-cache
+// pages pgs[] (PGSIZE each), to the inode's data blocks on the disk. This is
+// the fsync() counterpart of readi_pages(): the blocks backing any holes in the
+// range are reserved up front, so that a freshly written run of pages gets one
+// contiguous run of blocks where possible. The pages are then handed to the
+// transaction's block queue, which turns writes to contiguous blocks into
+// large scatter-gather writes. File data never goes through the bufcache.
+//
+// As with writei(), the inode size is not updated and the caller must hold
+// ilock for write.
+int
+writei_pages(sref<inode> ip, char **pgs, u32 off, u32 n, transaction *trans)
+{
+  scoped_gc_epoch e;
+
+  if (ip->type == T_DEV)
+    return -1;
+
+  assert(off % PGSIZE == 0 && trans);
+  if (off + n < off)
+    return -1;
+  if (off + n > MAXFILE*BSIZE)
+    n = MAXFILE*BSIZE - off;
+
+  u32 first = off / BSIZE, nblocks = (n + BSIZE - 1) / BSIZE;
+  block_reservation resv;
+
+  for (u32 i = 0; i < nblocks; i++) {
+    if (!bmap_lookup(ip, first + i))
+      resv.want++;
+  }
+
+  for (u32 i = 0; i < nblocks; i++) {
+    u32 blocknum;
+    try {
+      // Whole blocks are written, so there's no need to zero new ones.
+      blocknum = bmap(ip, first + i, trans, false, true, &resv);
+    } catch (out_of_blocks& e) {
+      console.println("writei_pages: out of blocks");
+      resv.release();
+      // If we haven't written anything, return an error
+      return i ? i * BSIZE : -1;
+    }
+
+    char *src = pgs[(i * BSIZE) / PGSIZE] + (i * BSIZE) % PGSIZE;
+    trans->write_block(ip->dev, src, blocknum);
+  }
+
+  resv.release();
+  return n;
+}
+
 void
 update_size(sref<inode> ip, u32 size, transaction *trans)
 {
@@ -2,14 +2,28 @@
 #include "kernel.hh"
 #include "spinlock.hh"
 #include "cpputil.hh"
-#include "ns.hh"
 #include "errno.h"
 #include "condvar.hh"
 #include "proc.hh"
 #include "cpu.hh"
-#include "spercpu.hh"
+#include "ilist.hh"
 #include "kmtrace.hh"
 
+#include <algorithm>
+
+// Futexes are kept in a fixed hash table of buckets, each with its own
+// lock and list of waiters.  A waiter lives on the stack of the thread
+// that waits, so waiting allocates nothing, and unrelated futexes only
+// share a lock when they hash to the same bucket.  Wakers take waiters
+// off the list themselves, so a thread that was woken is never counted
+// (or woken) twice, and FUTEX_WAKE can wake exactly N of them.
+//
+// Requeueing moves waiters from one futex to another without waking
+// them, which lets a condvar broadcast wake a single thread and hand
+// the rest to the mutex they will contend for anyway.
+
+#define FUTEX_HASH_BITS 8
+
 //
 // futexkey
 //
@@ -20,16 +34,19 @@
 
 typedef u64* futexkey_t;
 
-u64
+static u64
 futexkey_hash(futexkey_t const& key)
 {
-  return (u64)key;
+  // Futex words are at least 4-byte aligned.
+  return ((u64)key >> 2) * 0x9e3779b97f4a7c15ull >> (64 - FUTEX_HASH_BITS);
 }
 
-u64
+static u32
 futexkey_val(futexkey_t const& key)
 {
-  return *key;
+  // Futex words are 32 bits, as on Linux.  Reading 64 bits would look
+  // past the end of an int-sized pthread mutex, or even of its page.
+  return *(volatile u32*)key;
 }
 
 int
@@ -37,6 +54,8 @@ futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key)
 {
   u64* kaddr;
 
+  if ((uptr)useraddr & 3)
+    return -1;
   kaddr = (u64*)pagelookup(vmap, (uptr)useraddr);
   if (kaddr == nullptr) {
     cprintf("futexkey: pagelookup failed\n");
@@ -46,223 +65,154 @@ futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key)
   return 0;
 }
 
-//
-// nscache
-//
-struct nscache {
-  struct spinlock lock_;
-  volatile u64 head_;
-  volatile u64 tail_;
-  xns<u32, proc*, proc::hash>* ns_[16];
-
-  nscache();
-  xns<u32, proc*, proc::hash>* alloc();
-  bool cache(xns<u32, proc*, proc::hash>* ns);
-
-  NEW_DELETE_OPS(nscache);
-};
-
-// XXX(austin) If we used percpu_safety::cli here, would nscache no
-// longer need the lock?
-DEFINE_PERCPU(nscache, nscache_, NO_CRITICAL);
-
-nscache::nscache(void)
-  : lock_("nscache::lock_", LOCKSTAT_FUTEX), head_(0), tail_(0)
-{
+namespace {
+  struct futex_waiter {
+    // Both are protected by the lock of the bucket key hashes to.  key
+    // only changes when a requeue holds the locks of both buckets.
+    futexkey_t key;
+    bool queued;
+    proc* const p;
+    ilink<futex_waiter> link;
+
+    futex_waiter(futexkey_t key, proc* p) : key(key), queued(false), p(p) { }
+  };
+
+  struct futex_bucket {
+    struct spinlock lock;
+    ilist<futex_waiter, &futex_waiter::link> waiters;
+    __padout__;
+
+    futex_bucket() : lock("futex_bucket", LOCKSTAT_FUTEX) { }
+
+    // Caller must hold lock.
+    void wake(futex_waiter* w)
+    {
+      waiters.erase(waiters.iterator_to(w));
+      w->queued = false;
+      // w may be gone as soon as we drop lock, and so may w->p if it
+      // timed out, so wake it while we still hold lock.
+      w->p->cv->wake_all();
+    }
+  } __mpalign__;
 }
 
-xns<u32, proc*, proc::hash>*
-nscache::alloc(void)
-{
-  xns<u32, proc*, proc::hash>* ns = nullptr;
-  
-  acquire(&lock_);
-  if (head_ - tail_ > 0) {
-    u64 i = tail_%NELEM(ns_);
-    ++tail_;
-    ns = ns_[i];
-  }
-  release(&lock_);
-  return ns;
-}
+static futex_bucket buckets[1 << FUTEX_HASH_BITS];
 
-bool
-nscache::cache(xns<u32, proc*, proc::hash>* ns)
+static futex_bucket*
+bucket(futexkey_t key)
 {
-  bool cached = false;
-
-  acquire(&lock_);
-  if (head_ - tail_ < NELEM(ns_)) {
-    u64 i = head_%NELEM(ns_);
-    ++head_;
-    ns_[i] = ns;
-    cached = true;
-  }
-  release(&lock_);
-  return cached;
+  return &buckets[futexkey_hash(key)];
 }
 
-//
-// futexaddr
-//
-struct futexaddr : public referenced, public rcu_freed
-{
-  static futexaddr* alloc(futexkey_t key);
-
-  virtual void do_gc() override;
-  virtual void onzero() override;
-
-  futexkey_t key_;
-  bool inserted_;
-  xns<u32, proc*, proc::hash>* const nspid_;
-
-private:
-  futexaddr(futexkey_t key, xns<u32, proc*, proc::hash>* nspid);
-  NEW_DELETE_OPS(futexaddr);
-};
-
-xns<futexkey_t, futexaddr*, futexkey_hash> *nsfutex __mpalign__;
-
-futexaddr*
-futexaddr::alloc(futexkey_t key)
+// Take w off whatever futex it is waiting on, unless a waker got to it
+// first.  w may be requeued while we look for its bucket.
+static void
+unqueue(futex_waiter* w)
 {
-  xns<u32, proc*, proc::hash>* nspid;
-  futexaddr* fa;
-
-  nspid = nscache_->alloc();
-  if (nspid == nullptr)
-    nspid = new xns<u32, proc*, proc::hash>(false);
-
-  if (nspid == nullptr)
-    return nullptr;
-  fa = new futexaddr(key, nspid);
-  if (fa == nullptr) {
-    delete nspid;
-    return nullptr;
+  for (;;) {
+    futexkey_t key = *(futexkey_t volatile*)&w->key;
+    futex_bucket* b = bucket(key);
+    auto l = b->lock.guard();
+    if (w->key != key)
+      continue;
+    if (w->queued) {
+      b->waiters.erase(b->waiters.iterator_to(w));
+      w->queued = false;
+    }
+    return;
   }
-
-  return fa;
-}
-
-futexaddr::futexaddr(futexkey_t key, xns<u32, proc*, proc::hash>* nspid)
-  : rcu_freed("futexaddr", this, sizeof(*this)),
-    key_(key), inserted_(false), nspid_(nspid)
-{
-}
-
-void
-futexaddr::do_gc(void)
-{
-  delete this;
-}
-
-void
-futexaddr::onzero(void)
-{
-  if (inserted_)
-    assert(nsfutex->remove(key_, nullptr));
-  // Normally deallocate members in the destructor, but in this case
-  // we don't want to wait for the gc to fill the cache
-  if (!nscache_->cache(nspid_))
-    delete nspid_;
-  gc_delayed((futexaddr*)this);
 }
 
 long
 futexwait(futexkey_t key, u64 val, u64 timer)
 {
-  futexaddr* fa;
+  futex_waiter w(key, myproc());
+  futex_bucket* b = bucket(key);
 
-  mtreadavar("futex:ns:%p", key);
-  {
-    scoped_gc_epoch gc;
-  again:
-    fa = nsfutex->lookup(key);
-    if (fa == nullptr) {
-      fa = futexaddr::alloc(key);
-      if (fa == nullptr) {
-        cprintf("futexwait futexaddr::alloc failed\n");
-        return -1;
-      }
-      if (!nsfutex->insert(key, fa)) {
-        fa->dec();
-        goto again;
-      }
-      mtwriteavar("futex:ns:%p", key);
-      fa->inserted_ = true;
-    } else {
-      if (!fa->tryinc()) {
-        goto again;
-      }
-    }
-  }
-  assert(fa->key_ == key);
-  mtwriteavar("futex:%p.%p", key, fa);
+  mtwriteavar("futex:%p", key);
 
-  acquire(&myproc()->futex_lock);  
-  auto cleanup = scoped_cleanup([&fa](){
-    release(&myproc()->futex_lock);
-    fa->dec();
-  });
+  // If sleep throws because we were killed, or we time out, we are
+  // still queued.  This runs after l below has been released.
+  auto cleanup = scoped_cleanup([&w](){ unqueue(&w); });
 
-  // This first check is an optimization
-  if (futexkey_val(fa->key_) != val)
+  auto l = b->lock.guard();
+  // Wakers change the value before they take the bucket lock, so
+  // checking it under the lock cannot miss a wakeup.
+  if (futexkey_val(key) != (u32)val)
     return -EWOULDBLOCK;
 
-  if (!fa->nspid_->insert(myproc()->pid, myproc()))
-    return -1;
-
-  if (futexkey_val(fa->key_) != val) {
-    fa->nspid_->remove(myproc()->pid, nullptr);
-    return -EWOULDBLOCK;
-  }
+  b->waiters.push_back(&w);
+  w.queued = true;
 
   u64 nsecto = timer == 0 ? 0 : timer+nsectime();
-  myproc()->cv->sleep_to(&myproc()->futex_lock, nsecto);
-
-  assert(fa->nspid_->remove(myproc()->pid, nullptr));
+  myproc()->cv->sleep_to(&b->lock, nsecto);
   return 0;
 }
 
+// Wake up to nwake threads waiting on key.  Returns the number woken.
 long
 futexwake(futexkey_t key, u64 nwake)
 {
-  futexaddr* fa;
+  futex_bucket* b = bucket(key);
   u64 nwoke = 0;
 
-  if (nwake == 0)
-    return -1;
-
-  mtreadavar("futex:ns:%p", key);
-  {
-    scoped_gc_epoch gc;
-    fa = nsfutex->lookup(key);
-    if (fa == nullptr || !fa->tryinc())
-      return 0;
-  }
-
-  auto cleanup = scoped_cleanup([&fa](){
-    fa->dec();
-  });
-  mtwriteavar("futex:%p.%p", key, fa);
+  mtwriteavar("futex:%p", key);
 
-  fa->nspid_->enumerate([&nwoke, &nwake](u32 pid, proc* p) {
-    acquire(&p->futex_lock);
-    p->cv->wake_all();
-    release(&p->futex_lock);
+  auto l = b->lock.guard();
+  for (auto it = b->waiters.begin(); it != b->waiters.end() && nwoke < nwake; ) {
+    futex_waiter* w = &*it++;
+    if (w->key != key)
+      continue;
+    b->wake(w);
     ++nwoke;
-    if (nwoke >= nwake)
-      return 1;
-    return 0;
-  });
+  }
+  return nwoke;
+}
 
-  return 0;
+// If key still holds val, wake up to nwake threads waiting on key and
+// move up to nrequeue of the others over to key2, in the order they
+// started waiting.  Returns the number woken plus the number moved.
+long
+futexrequeue(futexkey_t key, u64 nwake, futexkey_t key2, u64 nrequeue,
+             u64 val)
+{
+  futex_bucket* b = bucket(key);
+  futex_bucket* b2 = bucket(key2);
+  u64 nwoke = 0, nmoved = 0;
+
+  mtwriteavar("futex:%p", key);
+  mtwriteavar("futex:%p", key2);
+
+  // Lock the two buckets in address order.
+  auto l = std::min(b, b2)->lock.guard();
+  lock_guard<spinlock> l2;
+  if (b2 != b)
+    l2 = std::max(b, b2)->lock.guard();
+  if (futexkey_val(key) != (u32)val)
+    return -EAGAIN;
+
+  for (auto it = b->waiters.begin(); it != b->waiters.end(); ) {
+    futex_waiter* w = &*it++;
+    if (w->key != key)
+      continue;
+    if (nwoke < nwake) {
+      b->wake(w);
+      ++nwoke;
+    } else if (nmoved < nrequeue) {
+      w->key = key2;
+      if (b2 != b) {
+        b->waiters.erase(b->waiters.iterator_to(w));
+        b2->waiters.push_back(w);
+      }
+      ++nmoved;
+    } else {
+      break;
+    }
+  }
+  return nwoke + nmoved;
 }
 
 void
 initfutex(void)
 {
-  nsfutex = new xns<futexkey_t, futexaddr*, futexkey_hash>(false);
-  if (nsfutex == 0)
-    panic("initfutex");
 }
@@ -13,6 +13,8 @@
 #include "file.hh"
 #include "uk/gcstat.h"
 
+#include <algorithm>
+
 using std::atomic;
 
 // A simple RCU implementation, but general:
@@ -30,22 +32,26 @@ using std::atomic;
 // a gcc thread performs two jobs:
 // 1. in parallel gc threads free the elements on the delayed-free lists
 //   (costs linear in the number of elements to be freed, but a local operation)
-// 2a (global scheme). one gcc thread perform step 1: updates global_epoch
-//   (costs linear in the number of cores, but a global operation)
-// 2b (local scheme). each core reads the global_min and cur_epoch from its
-//   neighbor. it updates its global_min by computing the min(global_min read from
-//   neighbor and its min_epoch). it sets its cur_epoch to the
-//   neighbor's cur_epoch.  core 0 is the ring leader: it increases epoch,
-//   if global_min from last core >= cur_epoch-2.  If local communication scales,
-//   this gc scheme will scale, but the delay to increase cur_epoch is linear
-//   in the number of cores.
+// 2. the gc threads combine the cores' epochs up a tree that follows the
+//   machine's topology: cores of a NUMA node first, GC_FANOUT at a time,
+//   then the nodes.  On each gc run a core publishes its epochs at its
+//   leaf, recombines every node on the path up to the root and, if the
+//   root allows it, increments global_epoch.  So any core's run can
+//   advance the epoch, as with a flat scan, but it only reads GC_FANOUT
+//   lines per level, most of them from its own node.
 //
 // To limit the number of delayed free lists per core, each core also has a
-// variable nexttofree_epoch, which <= min_epoch. cur_epoch isn't increased
-// unless nexttofree_epoch >= cur_epoch-2, implicitly also ensuring the
-// constraint that cur_epoch is only increases when min_epoch >= cur_epoch-2.
+// variable nexttofree_epoch, which <= min_epoch. global_epoch isn't increased
+// unless nexttofree_epoch >= global_epoch-2 on every core, which also
+// ensures that min_epoch >= global_epoch-2.
+//
+// Delayed-free memory is bounded per core.  Once a core has more than
+// GC_DELAYED_HIGH bytes waiting, all gc threads run every
+// GC_EXPEDITE_INTERVAL instead of every GCINTERVAL until it is back under
+// half of that, which speeds up the tree.  Past twice the mark, threads
+// leaving an epoch on that core also free its lists that are ready.
 
-enum { gc_debug = 0, gc_global = GC_GLOBAL };
+enum { gc_debug = 0 };
 
 // Head of a delayed free list. Always read and updated while holding lock_
 struct headinfo {
@@ -53,23 +59,24 @@ struct headinfo {
   u64 epoch;
 };
 
-// nexttofree_epoch << min_epoch << global_epoch (or cur_epoch)
+// nexttofree_epoch << min_epoch << global_epoch
 struct gc_state {
   atomic<u64> nexttofree_epoch; // the lowest epoch # to free on this core
   atomic<u64> min_epoch;        // the lowest epoch # a process on this core is in
-  atomic<u64> cur_epoch;        // the current epoch this core is running in
-  atomic<u64> global_min;       // used to compute global_min over nexttofree
   struct spinlock lock_ __mpalign__;
   struct condvar cv;
   headinfo delayed[NEPOCH];     // NEPOCH delayed-free lists
   gc_handle proclist;           // list of process in an epoch on this core
+  u64 delayed_bytes;            // bytes on the delayed-free lists
+  bool expedite;                // delayed_bytes went over GC_DELAYED_HIGH
+  bool freeing;                 // some thread is in free_ready()
 public:
   gc_state();
   void dequeue(gc_handle *h);
   void enqueue(gc_handle *h);
-  int gc_free(rcu_freed *r, u64 epoch);
+  int gc_free(rcu_freed *r, u64 epoch, u64 *bytes);
+  bool free_ready(int c);
   void do_gc(void);
-  void inc_cur_epoch(void);
 };
 
 DEFINE_PERCPU(gc_state, gc_states, NO_MIGRATE);
@@ -77,87 +84,146 @@ DEFINE_PERCPU(gc_stat, stat, NO_CRITICAL);
 int ngc_cpu;
 int gc_batchsize;
 
-// Increment of global_epoch acquires gc_lock, but processes cannot read it
-// without locks
-static struct gc_lock {
-  struct spinlock l __mpalign__;
-  gc_lock() : l("gc", LOCKSTAT_GC) { }
-} gc_lock;
 atomic<u64> global_epoch __mpalign__;
+// Number of cores with expedite set
+static atomic<int> gc_nexpedite;
+
+// A node of the epoch tree.  Leaves hold the epochs of one core, other
+// nodes the minimum over their children.  Both only grow, so a stale
+// value is still a lower bound.
+struct gc_tree_node {
+  atomic<u64> minfree;          // min nexttofree_epoch below this node
+  atomic<u64> minepoch;         // min min_epoch below this node
+  int cpu;                      // for leaves, -1 otherwise
+  int nchild;
+  gc_tree_node *child[GC_FANOUT];
+  gc_tree_node *parent;
+} __mpalign__;
+
+// Every interior node has at least two children.
+static gc_tree_node gc_tree[2*NCPU];
+static gc_tree_node *gc_leaf[NCPU];
+static gc_tree_node *gc_root;
+
+// Hang the nodes in level under new parents, GC_FANOUT at a time, until
+// one is left, and return it.
+static gc_tree_node*
+gc_tree_build(gc_tree_node **level, int n, int *used)
+{
+  while (n > 1) {
+    int m = 0;
+    for (int i = 0; i < n; i += GC_FANOUT) {
+      int k = std::min(n - i, GC_FANOUT);
+      if (k == 1) {
+        level[m++] = level[i];
+        continue;
+      }
+      gc_tree_node *p = &gc_tree[(*used)++];
+      p->cpu = -1;
+      p->nchild = k;
+      for (int j = 0; j < k; j++) {
+        p->child[j] = level[i+j];
+        level[i+j]->parent = p;
+      }
+      level[m++] = p;
+    }
+    n = m;
+  }
+  return level[0];
+}
 
-// Sceheme 2a: Increment global_epoch if (1) each core has freed all epochs <=
-// global-2 and (2) each core has no processes in an epoch <= global - 2 This
-// operation is the only global operation.
 static void
-gc_inc_global_epoch(void)
+gc_tree_init(void)
 {
-  int r = tryacquire(&gc_lock.l);
-  if (r == 0) return;
-  assert(r == 1);
-  u64 t0 = rdtsc();
-  u64 global = global_epoch;  // make "local" copy
-  u64 minfree = global;
-  u64 minepoch = global;
-  for (int c = 0; c < ngc_cpu; c++) {
-    // is reading nexttofree_epoch and min_epoch a single cache miss?
-    if (gc_states[c].nexttofree_epoch < minfree) {
-      minfree = gc_states[c].nexttofree_epoch;
-    }
-    if (gc_states[c].min_epoch < minepoch) {
-      minepoch = gc_states[c].min_epoch;
+  gc_tree_node *nodes[NCPU];
+  gc_tree_node *cores[NCPU];
+  bool done[NCPU] = {};
+  int used = 0, nnodes = 0;
+
+  for (int c = 0; c < ncpu; c++) {
+    gc_tree_node *l = &gc_tree[used++];
+    l->cpu = c;
+    l->minfree = l->minepoch = global_epoch.load();
+    gc_leaf[c] = l;
+  }
+
+  // A subtree for the cores of each NUMA node, then one over the nodes.
+  for (int c = 0; c < ncpu; c++) {
+    if (done[c])
+      continue;
+    int n = 0;
+    for (int d = c; d < ncpu; d++) {
+      if (!done[d] && cpus[d].node == cpus[c].node) {
+        cores[n++] = gc_leaf[d];
+        done[d] = true;
+      }
     }
+    nodes[nnodes++] = gc_tree_build(cores, n, &used);
   }
-  if ((minfree < global-2) || (minepoch < global-2))
-    goto done;
-  if (minepoch > global-2) {
-    if (gc_debug) cprintf("update global_epoch to: %lu\n", minepoch+1);
-    global_epoch = global + 1;
+  gc_root = gc_tree_build(nodes, nnodes, &used);
+  gc_root->parent = nullptr;
+  assert(used <= NELEM(gc_tree));
+}
+
+// Recompute n from its children.  Cores that don't take part in gc (see
+// ngc_cpu) are left out.  Several cores may combine n at once and the
+// last store wins, but every value stored is a lower bound.  Don't
+// dirty the line if nothing changed.
+static void
+gc_tree_combine(gc_tree_node *n)
+{
+  u64 minfree = ~0ull, minepoch = ~0ull;
+  for (int i = 0; i < n->nchild; i++) {
+    gc_tree_node *c = n->child[i];
+    if (c->cpu >= ngc_cpu)
+      continue;
+    minfree = std::min(minfree, c->minfree.load());
+    minepoch = std::min(minepoch, c->minepoch.load());
   }
-done:
-  release(&gc_lock.l);
-  u64 t1 = rdtsc();
-  stat[mycpu()->id].ncycles += (t1-t0);
-  stat[mycpu()->id].nop++;
+  if (n->minfree.load() != minfree)
+    n->minfree = minfree;
+  if (n->minepoch.load() != minepoch)
+    n->minepoch = minepoch;
 }
 
-// Scheme 2b: Scalable way of computing global_min by arranging nodes in a
-// virtual ring.
-// XXX ring could follow physical proximity
-void
-gc_state::inc_cur_epoch(void)
+// Publish this core's epochs and combine the tree nodes up to the root.
+// Then increment global_epoch if (1) each core has freed all epochs <=
+// global-2 and (2) each core has no processes in an epoch <= global-2.
+static void
+gc_inc_global_epoch(gc_state *gs)
 {
   u64 t0 = rdtsc();
-  if (mycpu()->id == 0) {
-    u64 min = gc_states[ngc_cpu-1].global_min;
-    if (min >= cur_epoch - 2) {
-      if (gc_debug) cprintf("%d: update my epoch to: %lu\n",
-                          mycpu()->id, cur_epoch+1);
-      cur_epoch += 1;
-    }
-    global_min = nexttofree_epoch.load();
-  } else {
-    int neighbor = mycpu()->id - 1;
-    u64 neighbor_global_min = gc_states[neighbor].global_min;
-    u64 e = gc_states[neighbor].cur_epoch.load();
-    assert(cur_epoch <= e);
-    cur_epoch = e;
-    global_min = neighbor_global_min > nexttofree_epoch ?
-      global_min = nexttofree_epoch.load() :  global_min = neighbor_global_min;
+  int c = mycpu()->id;
+  gc_tree_node *n = gc_leaf[c];
+  n->minfree = gs->nexttofree_epoch.load();
+  n->minepoch = gs->min_epoch.load();
+
+  while (n->parent) {
+    n = n->parent;
+    gc_tree_combine(n);
+  }
+
+  // Another core may have got here first; only ever move the epoch on
+  // from the value we checked against.
+  u64 global = global_epoch;
+  if (n->minfree >= global-2 && n->minepoch > global-2) {
+    if (global_epoch.compare_exchange_strong(global, global + 1) && gc_debug)
+      cprintf("update global_epoch to: %lu\n", global+1);
   }
   u64 t1 = rdtsc();
-  stat[mycpu()->id].ncycles += (t1-t0);
-  stat[mycpu()->id].nop++;
+  stat[c].ncycles += (t1-t0);
+  stat[c].nop++;
 }
 
 gc_state::gc_state() :
-  lock_("gc_state", LOCKSTAT_GC), cv(condvar("gc_cv"))
+  lock_("gc_state", LOCKSTAT_GC), cv(condvar("gc_cv")), delayed_bytes(0),
+  expedite(false), freeing(false)
 {
   proclist.next = &proclist;
   proclist.prev = &proclist;
   for (int i = 0; i < NEPOCH; i++) {
     delayed[i].epoch = i;
   }
-  cur_epoch = NEPOCH-2;
 }
 
 // caller should hold lock_
@@ -174,7 +240,7 @@ gc_state::enqueue(gc_handle *h)
 void
 gc_state::dequeue(gc_handle *h)
 {
-  u64 m = gc_global ? global_epoch : cur_epoch;
+  u64 m = global_epoch;
   for (gc_handle* entry = this->proclist.next; entry != &this->proclist;
        entry = entry->next) {
     if (entry == h) {
@@ -190,10 +256,10 @@ gc_state::dequeue(gc_handle *h)
   }
 }
 
-// Free the elements in delayed-free list r (from epoch epoch).
-// Runs without holding _lock
+// Free the elements in delayed-free list r (from epoch epoch), adding
+// their size to *bytes.  Runs without holding _lock
 int
-gc_state::gc_free(rcu_freed *r, u64 epoch)
+gc_state::gc_free(rcu_freed *r, u64 epoch, u64 *bytes)
 {
   int nfree = 0;
   rcu_freed *nr;
@@ -206,44 +272,65 @@ gc_state::gc_free(rcu_freed *r, u64 epoch)
       assert(0);
     }
     nr = r->_rcu_next;
+    *bytes += r->_rcu_size;
     r->do_gc();
     nfree++;
   }
   return nfree;
 }
 
-// Caller must hold lock_.  This function cannot be called recursively,
-// but it won't if only gc_worker() runs do_gc.
-void
-gc_state::do_gc(void)
+// Free all delayed-free lists until min_epoch, for core c.  Caller must
+// hold lock_, which is given up while freeing.  Only one thread frees a
+// core's lists at a time; returns false if another one already is.
+bool
+gc_state::free_ready(int c)
 {
   u64 i;
 
-  stat->nrun++;
+  if (freeing)
+    return false;
+  freeing = true;
 
-  // free all delayed-free lists until min_epoch
   for (i = nexttofree_epoch; i < min_epoch; i++) {
     rcu_freed *head = delayed[i%NEPOCH].head;
+    u64 bytes = 0;
 
     // give up lock during free; gc_free() may call gc_begin/end_epoch
     release(&lock_);
 
-    int nfree = gc_free(head,i);
+    int nfree = gc_free(head, i, &bytes);
 
     acquire(&lock_);
     delayed[i%NEPOCH].head = nullptr;
     delayed[i%NEPOCH].epoch += NEPOCH;
-    stat->nfree += nfree;
+    delayed_bytes -= bytes;
+    stat[c].nfree += nfree;
     if (gc_debug && nfree > 0) {
-      cprintf("%d: epoch %lu freed %d\n", mycpu()->id, i, nfree);
+      cprintf("%d: epoch %lu freed %d\n", c, i, nfree);
     }
 
   }
   nexttofree_epoch = i;
+  freeing = false;
+
+  if (expedite && delayed_bytes < GC_DELAYED_HIGH / 2) {
+    expedite = false;
+    --gc_nexpedite;
+  }
+  return true;
+}
+
+// Caller must hold lock_.  Only gc_worker() runs do_gc, which keeps the
+// tree leaf of each core single-writer.
+void
+gc_state::do_gc(void)
+{
+  stat->nrun++;
+
+  free_ready(mycpu()->id);
 
   // try to increment global_epoch
-  if (gc_global) gc_inc_global_epoch();
-  else inc_cur_epoch();
+  gc_inc_global_epoch(this);
 }
 
 static void
@@ -254,13 +341,13 @@ gc_worker(void *x)
 
   acquire(&gc_states->lock_);
   for (;;) {
+    u64 interval = gc_nexpedite ? GC_EXPEDITE_INTERVAL : GCINTERVAL;
     gc_states->cv.sleep_to(&gc_states->lock_,
-                          nsectime() + ((u64)GCINTERVAL)*1000000ull);
+                          nsectime() + interval*1000000ull);
 
     // if no processes are running on this core, update min_epoch
     if (gc_states->proclist.next == &gc_states->proclist) {
-      gc_states->min_epoch = gc_global ? global_epoch.load() :
-        gc_states->cur_epoch.load();
+      gc_states->min_epoch = global_epoch.load();
     }
 
     gc_states->do_gc();
@@ -283,7 +370,9 @@ readstat(mdev*, char *dst, u32 off, u32 n)
     return 0;
   }
 
-  memcpy(dst, &stat[i], sz);
+  gc_stat s = stat[i];
+  s.delayed_bytes = gc_states[i].delayed_bytes;
+  memcpy(dst, &s, sz);
 
   return n;
 }
@@ -310,6 +399,7 @@ initgc(void)
   ngc_cpu = ncpu;
   global_epoch = NEPOCH-2;
   gc_batchsize = 100000000;
+  gc_tree_init();
 
   devsw[MAJ_GC].write = writectrl;
   devsw[MAJ_GC].pread = readstat;
@@ -333,10 +423,11 @@ gc_delayed(rcu_freed *e)
 
   int c =  mycpu()->id;
   struct gc_state *gs = &gc_states[c];
+  bool wake = false;
 
   scoped_acquire x(&gs->lock_);
 
-  u64 epoch = gc_global ? global_epoch : gs->cur_epoch;
+  u64 epoch = global_epoch;
 
   if (gc_debug)
     cprintf("(%d, %d): gc_delayed: %lu ndelayed %lu\n", c, myproc()->pid,
@@ -353,6 +444,20 @@ gc_delayed(rcu_freed *e)
   e->_rcu_epoch = epoch;
   e->_rcu_next = gs->delayed[epoch % NEPOCH].head;
   gs->delayed[epoch % NEPOCH].head = e;
+
+  gs->delayed_bytes += e->_rcu_size;
+  if (gs->delayed_bytes > stat[c].max_delayed_bytes)
+    stat[c].max_delayed_bytes = gs->delayed_bytes;
+  if (!gs->expedite && gs->delayed_bytes > GC_DELAYED_HIGH) {
+    gs->expedite = true;
+    stat[c].nexpedite++;
+    // The gc threads may be in the middle of a GCINTERVAL sleep.
+    wake = gc_nexpedite++ == 0;
+  }
+  x.release();
+
+  if (wake && myproc())
+    gc_wakeup();
 }
 
 void
@@ -366,7 +471,7 @@ gc_begin_epoch(void)
   struct gc_state *gs = &gc_states[c];
 
   scoped_acquire x(&gs->lock_);
-  u64 epoch = gc_global ? global_epoch : gs->cur_epoch;
+  u64 epoch = global_epoch;
   myproc()->gc->core = c;
   cmpxch(&myproc()->gc->epoch, v+1, (epoch<<8)+1);
   // We effectively need an mfence here, and cmpxch provides one
@@ -402,6 +507,13 @@ gc_end_epoch(void)
     // to wakeup this core's gc thread, and yield the core to it.
     gs->cv.wake_all(true);
   }
+
+  // Help a core that is far behind on freeing, as long as we hold no
+  // other spinlock that the freed objects' do_gc could need.
+  if (gs->delayed_bytes > 2 * GC_DELAYED_HIGH && mycpu()->ncli == 1) {
+    if (gs->free_ready(c))
+      stat[c].nhelp++;
+  }
 }
 
 void
@@ -29,6 +29,19 @@ static const char *levelnames[] = {
   "PT", "PD", "PDP", "PML4"
 };
 
+// Account for a user PTE that is going away, if fault-around put it
+// there.
+static inline void
+account_fault_around(pme_t entry)
+{
+  if (entry & PTE_AROUND) {
+    if (entry & PTE_A)
+      kstats::inc(&kstats::page_fault_around_used);
+    else
+      kstats::inc(&kstats::page_fault_around_unused);
+  }
+}
+
 // One level in an x86-64 page table, typically the top level.  Many
 // of the methods of pgmap assume they are being invoked on a
 // top-level PML4.
@@ -55,10 +68,14 @@ private:
 
   void free(int level, int end = 512, bool release = true)
   {
-    if (level != 0) {
+    if (level == 0) {
+      for (int i = 0; i < end; i++)
+        account_fault_around(e[i].load(memory_order_relaxed));
+    } else {
       for (int i = 0; i < end; i++) {
         pme_t entry = e[i].load(memory_order_relaxed);
-        if (entry & PTE_P)
+        // Large page mappings don't point to a lower level.
+        if ((entry & PTE_P) && !(entry & PTE_PS))
           ((pgmap*) p2v(PTE_ADDR(entry)))->free(level - 1);
       }
     }
@@ -74,7 +91,7 @@ private:
     if (level != 0) {
       for (int i = 0; i < end; i++) {
         pme_t entry = e[i].load(memory_order_relaxed);
-        if (entry & PTE_P)
+        if ((entry & PTE_P) && !(entry & PTE_PS))
           count += ((pgmap*) p2v(PTE_ADDR(entry)))->internal_pages(level - 1);
       }
     }
@@ -160,7 +177,10 @@ public:
     // Walk the page table structure to find @c va at @c level and set
     // @c cur.  If @c create is zero and the path to @c va does not
     // exist, sets @c cur to nullptr.  Otherwise, the path will be
-    // created with the flags @c create.
+    // created with the flags @c create.  A large page mapping above
+    // @c level counts as a missing path; if @c create is set, it is
+    // replaced by a fresh (empty) page structure, so the caller must
+    // not rely on that mapping any more.
     void resolve(pme_t create = 0)
     {
       cur = pml4;
@@ -168,7 +188,7 @@ public:
         atomic<pme_t> *entryp = &cur->e[PX(reached, va)];
         pme_t entry = entryp->load(memory_order_relaxed);
       retry:
-        if (entry & PTE_P) {
+        if ((entry & PTE_P) && !(entry & PTE_PS)) {
           cur = (pgmap*) p2v(PTE_ADDR(entry));
         } else if (!create) {
           cur = nullptr;
@@ -563,6 +583,20 @@ core_tracking_shootdown::perform() const
   run_on_cpus(targets, [this]() { clear_tlb(); });
 }
 
+// Clear the accessed bit of the mapping of va in pml4, large or small,
+// and return whether it was set.
+static bool
+pgmap_test_and_clear_accessed(pgmap *pml4, uintptr_t va)
+{
+  auto lg = pml4->find(va, pgmap::L_2M);
+  if (lg.is_set() && (lg->load(memory_order_relaxed) & PTE_PS))
+    return lg->fetch_and(~(pme_t)PTE_A, memory_order_relaxed) & PTE_A;
+  auto it = pml4->find(va);
+  if (!it.is_set())
+    return false;
+  return it->fetch_and(~(pme_t)PTE_A, memory_order_relaxed) & PTE_A;
+}
+
 namespace mmu_shared_page_table {
   page_map_cache::page_map_cache() : pml4(kpml4.kclone())
   {
@@ -583,15 +617,62 @@ namespace mmu_shared_page_table {
     pml4->find(va).create(PTE_U)->store(pte, memory_order_relaxed);
   }
 
+  void
+  page_map_cache::__insert_range(uintptr_t va, const pme_t *ptes, size_t n)
+  {
+    auto it = pml4->find(va);
+    for (size_t i = 0; i < n; i++, it += PGSIZE)
+      if (ptes[i])
+        it.create(PTE_U)->store(ptes[i], memory_order_relaxed);
+  }
+
+  bool
+  page_map_cache::__insert_large(uintptr_t va, pme_t pte)
+  {
+    auto it = pml4->find(va, pgmap::L_2M).create(PTE_U);
+    pme_t old = it->load(memory_order_relaxed);
+    // Other cores may be walking the page table below this entry, so
+    // we can't replace it.
+    if ((old & PTE_P) && !(old & PTE_PS))
+      return false;
+    it->store(pte | PTE_PS, memory_order_relaxed);
+    return true;
+  }
+
+  bool
+  page_map_cache::__can_insert_large(uintptr_t va)
+  {
+    auto it = pml4->find(va, pgmap::L_2M);
+    if (!it.is_set())
+      return true;
+    pme_t old = it->load(memory_order_relaxed);
+    return !((old & PTE_P) && !(old & PTE_PS));
+  }
+
+  bool
+  page_map_cache::__test_and_clear_accessed(uintptr_t va)
+  {
+    return pgmap_test_and_clear_accessed(pml4, va);
+  }
+
   void
   page_map_cache::__invalidate(
     uintptr_t start, uintptr_t len, shootdown *sd)
   {
     sd->set_cache_tracker(this);
+    // Large page mappings overlapping the range go as a whole.
+    for (auto it = pml4->find(start, pgmap::L_2M); it.index() < start + len;
+         it += it.span()) {
+      if (it.is_set() && (it->load(memory_order_relaxed) & PTE_PS)) {
+        it->store(0, memory_order_relaxed);
+        sd->add_range(it.index() & ~(LGPGSIZE - 1),
+                      (it.index() & ~(LGPGSIZE - 1)) + LGPGSIZE);
+      }
+    }
     for (auto it = pml4->find(start); it.index() < start + len;
          it += it.span()) {
       if (it.is_set()) {
-        it->store(0, memory_order_relaxed);
+        account_fault_around(it->exchange(0, memory_order_relaxed));
         sd->add_range(it.index(), it.index() + it.span());
       }
     }
@@ -629,6 +710,86 @@ namespace mmu_per_core_page_table {
     t->tracker_cores.set(myid());
   }
 
+  void
+  page_map_cache::insert_range(uintptr_t va, const pme_t *ptes, size_t n)
+  {
+    scoped_cli cli;
+    auto mypml4 = *pml4;
+    assert(mypml4);
+    auto it = mypml4->find(va);
+    for (size_t i = 0; i < n; i++, it += PGSIZE)
+      if (ptes[i])
+        it.create(PTE_U)->store(ptes[i], memory_order_relaxed);
+  }
+
+  bool
+  page_map_cache::insert_large(uintptr_t va, pme_t pte)
+  {
+    scoped_cli cli;
+    auto mypml4 = *pml4;
+    assert(mypml4);
+    auto it = mypml4->find(va, pgmap::L_2M).create(PTE_U);
+    pme_t old = it->load(memory_order_relaxed);
+    if ((old & PTE_P) && !(old & PTE_PS)) {
+      // Only this core ever walks its page table, so an empty page
+      // table can be replaced, once the paging-structure caches have
+      // forgotten it.
+      pgmap *pt = (pgmap*) p2v(PTE_ADDR(old));
+      for (auto pit = mypml4->find(va); pit.index() < va + LGPGSIZE;
+           pit += pit.span())
+        if (pit.is_set())
+          return false;
+      it->store(0, memory_order_relaxed);
+      invlpg((void*)va);
+      kfree(pt);
+    }
+    it->store(pte | PTE_PS, memory_order_relaxed);
+    return true;
+  }
+
+  bool
+  page_map_cache::can_insert_large(uintptr_t va)
+  {
+    scoped_cli cli;
+    auto mypml4 = *pml4;
+    if (!mypml4)
+      return true;
+    auto it = mypml4->find(va, pgmap::L_2M);
+    if (!it.is_set())
+      return true;
+    pme_t old = it->load(memory_order_relaxed);
+    if (!(old & PTE_P) || (old & PTE_PS))
+      return true;
+    // insert_large can only replace an empty page table.
+    for (auto pit = mypml4->find(va); pit.index() < va + LGPGSIZE;
+         pit += pit.span())
+      if (pit.is_set())
+        return false;
+    return true;
+  }
+
+  bool
+  page_map_cache::test_and_clear_accessed(uintptr_t va, bitset<NCPU> cores)
+  {
+    std::atomic<bool> accessed(false);
+    auto local = [this, va, &accessed]() {
+      pgmap *mypml4 = *pml4;
+      if (mypml4 && pgmap_test_and_clear_accessed(mypml4, va))
+        accessed = true;
+    };
+
+    {
+      scoped_cli cli;
+      if (cores[myid()]) {
+        local();
+        cores.reset(myid());
+      }
+    }
+    if (cores.any())
+      run_on_cpus(cores, local);
+    return accessed;
+  }
+
   void
   page_map_cache::switch_to() const
   {
@@ -667,9 +828,18 @@ namespace mmu_per_core_page_table {
     // inserted something into it previously.  (Note that this may
     // not hold if we start tracking shootdowns conservatively.)
     assert(mypml4);
+    // Large page mappings overlapping the range go as a whole.
+    for (auto it = mypml4->find(start, pgmap::L_2M); it.index() < end;
+         it += it.span()) {
+      if (it.is_set() && (it->load(memory_order_relaxed) & PTE_PS)) {
+        it->store(0, memory_order_relaxed);
+        if (current)
+          invlpg((void*)it.index());
+      }
+    }
     for (auto it = mypml4->find(start); it.index() < end; it += it.span()) {
       if (it.is_set()) {
-        it->store(0, memory_order_relaxed);
+        account_fault_around(it->exchange(0, memory_order_relaxed));
         if (current)
           invlpg((void*)it.index());
       }
@@ -78,11 +78,16 @@ idleloop(void)
     myproc()->set_state(RUNNABLE);
     sched();
     finishzombies();
-    if (steal() == 0) {
-        // XXX(Austin) This will prevent us from immediately picking
-        // up work that's trying to push itself to this core (pinned
-        // thread).  Use an IPI to poke idle cores.
-        asm volatile("hlt");
+    if (steal() == 0 && !zidle()) {
+        kmidle();
+        // Stretch our tick if there's still nothing to do.  Work that
+        // gets queued here from now on pokes us with an IPI, which the
+        // sti's interrupt shadow keeps pending until we're in hlt.
+        cli();
+        if (schednohz())
+          sti();
+        else
+          asm volatile("sti; hlt");
     }
   }
   // mvrlu_finish();
@@ -282,6 +282,23 @@ struct cpu_mem
   // Hot page cache of recently freed pages
   void *hot_pages[KALLOC_HOT_PAGES];
   size_t nhot;
+
+  // Pages moved between the hot list and the buddies at a time.  This
+  // follows the core's page allocation rate: it doubles when refills or
+  // flushes come in quick succession and halves when they are rare.
+  // The hot list is flushed once it holds two batches.
+  size_t hot_batch;
+  u64 hot_last;                 // nsectime() of the last refill or flush
+
+  void adapt_hot_batch()
+  {
+    u64 now = nsectime();
+    if (now - hot_last < KALLOC_HOT_FAST)
+      hot_batch = std::min(hot_batch * 2, (size_t)KALLOC_HOT_PAGES / 2);
+    else if (now - hot_last > KALLOC_HOT_SLOW)
+      hot_batch = std::max(hot_batch / 2, (size_t)KALLOC_HOT_BATCH);
+    hot_last = now;
+  }
 };
 
 // Prefer mycpu()->mem for local access to this.  This is NOINIT since
@@ -679,6 +696,22 @@ kmemprint(print_stream *s)
   s->println();
 }
 
+// Return the free bytes and the capacity (free_limit) of cpu's local
+// buddy allocators.  This is what the page reclaimer watches to decide
+// whether cpu is under memory pressure.
+void
+kmemlocal(int cpu, size_t *free, size_t *limit)
+{
+  auto &local = cpu_mem[cpu].steal.get_local();
+
+  *free = *limit = 0;
+  for (auto buddy = local.low; buddy < local.high; ++buddy) {
+    auto l = buddies[buddy].lock.guard();
+    *free += buddies[buddy].alloc.get_free_bytes();
+    *limit += buddies[buddy].free_limit;
+  }
+}
+
 static int
 kmemstatsread(mdev*, char *dst, u32 off, u32 n)
 {
@@ -708,34 +741,34 @@ kalloc(const char *name, size_t size, int cpu)
     scoped_cli cli;
     auto mem = cpu >= 0 ? cpus[cpu].mem : mycpu()->mem;
     if (mem->nhot == 0) {
-      // No hot pages; fill half of the cache
+      // No hot pages; refill a batch, taking as many pages as we can
+      // from each buddy in one go.
       kstats::inc(&kstats::kalloc_hot_list_refill_count);
-      auto buddyit = mem->steal.begin(), buddyend = mem->steal.end();
-      auto lb = &buddies[*buddyit];
-      auto l = lb->lock.guard();
-      while (mem->nhot < KALLOC_HOT_PAGES / 2 && buddyit != buddyend) {
-        void *page = lb->alloc.alloc_nothrow(PGSIZE);
-        if (!page) {
-          // Move to the next allocator
-          if (++buddyit == buddyend && mem->nhot == 0) {
-            // We couldn't allocate any pages; we're probably out of
-            // memory, but drop through to the more aggressive
-            // general-purpose allocator.
-            goto general;
-          }
-          lb = &buddies[*buddyit];
-          l.release();
-          l = lb->lock.guard();
-          if (!mem->steal.is_local(*buddyit)) {
-            kstats::inc(&kstats::kalloc_hot_list_steal_count);
+      mem->adapt_hot_batch();
+      for (auto buddyidx : mem->steal) {
+        auto lb = &buddies[buddyidx];
+        size_t n;
+        {
+          auto l = lb->lock.guard();
+          n = lb->alloc.alloc_pages(mem->hot_pages + mem->nhot,
+                                    mem->hot_batch - mem->nhot);
+        }
+        if (n && !mem->steal.is_local(buddyidx)) {
+          kstats::inc(&kstats::kalloc_hot_list_steal_count);
 #if PRINT_STEAL
-            cprintf("CPU %d stealing hot list from buddy %lu\n",
-                    cpu >= 0 ? cpu : myid(), *buddyit);
+          cprintf("CPU %d stealing hot list from buddy %lu\n",
+                  cpu >= 0 ? cpu : myid(), buddyidx);
 #endif
-          }
-        } else {
-          mem->hot_pages[mem->nhot++] = page;
         }
+        mem->nhot += n;
+        if (mem->nhot == mem->hot_batch)
+          break;
+      }
+      if (mem->nhot == 0) {
+        // We couldn't allocate any pages; we're probably out of
+        // memory, but drop through to the more aggressive
+        // general-purpose allocator.
+        goto general;
       }
       source = "refilled hot list";
     }
@@ -1085,6 +1118,8 @@ initkalloc(void)
       // there's only one subnode).
       cpu->mem->steal.add(node_low, node_low + node_buddies);
       cpu->mem->nhot = 0;
+      cpu->mem->hot_batch = KALLOC_HOT_BATCH;
+      cpu->mem->hot_last = 0;
       cpu->mem->mempool = node_low;
       ++cpu_index;
     }
@@ -1144,52 +1179,49 @@ kfree(void *v, size_t size)
   if (size == PGSIZE) {
     // Free to the hot list
     scoped_cli cli;
-    if (mem->nhot == KALLOC_HOT_PAGES) {
-      // There's no more room in the hot pages list, so free half of
-      // it.  We sort the list so we can merge it with the buddy
-      // allocator list, minimizing and batching our locks.
+    if (mem->nhot >= 2 * mem->hot_batch) {
+      // The hot list is full, so free its oldest batch.  We sort the
+      // batch so we can hand each buddy its pages in one go, which
+      // also helps them merge.
       kstats::inc(&kstats::kalloc_hot_list_flush_count);
-      std::sort(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2));
-      locked_buddy *lb = nullptr;
-      lock_guard<spinlock> lock;
-      for (size_t i = 0; i < KALLOC_HOT_PAGES / 2; ++i) {
+      mem->adapt_hot_batch();
+      size_t nflush = std::min(mem->nhot, mem->hot_batch);
+      std::sort(mem->hot_pages, mem->hot_pages + nflush);
+      for (size_t i = 0; i < nflush; ) {
         void *ptr = mem->hot_pages[i];
-        // Do we have the right buddy?
-        if (!lb || !(lb->alloc.contains(ptr) &&
-                     lb->alloc.get_free_bytes() < lb->free_limit)) {
-          // Find the first buddy in steal order that contains ptr and
-          // hasn't reached its free limit.  We do it this way in case
-          // there are overlapping buddies.
-          lock.release();
-          lb = nullptr;
-          for (auto buddyidx : mem->steal) {
-            auto lbtry = &buddies[buddyidx];
-            // We can access free_bytes and free_limit without locking
-            // here since it's okay if we actually go a little over
-            // free_limit.
-            if (lbtry->alloc.contains(ptr) &&
-                lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
-              lb = lbtry;
-              break;
-            }
+        // Find the first buddy in steal order that contains ptr and
+        // hasn't reached its free limit.  We do it this way in case
+        // there are overlapping buddies.  We can access free_bytes and
+        // free_limit without locking here since it's okay if we
+        // actually go a little over free_limit.
+        locked_buddy *lb = nullptr;
+        for (auto buddyidx : mem->steal) {
+          auto lbtry = &buddies[buddyidx];
+          if (lbtry->alloc.contains(ptr) &&
+              lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
+            lb = lbtry;
+            break;
           }
-          assert(lb);
-          if (!mem->steal.is_local(lb - &buddies[0])) {
-            kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
+        }
+        assert(lb);
+        if (!mem->steal.is_local(lb - &buddies[0])) {
+          kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
 #if PRINT_STEAL
-            cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
-                    lb - &buddies[0]);
+          cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
+                  lb - &buddies[0]);
 #endif
-          }
-          lock = lb->lock.guard();
         }
-        lb->alloc.free(ptr, PGSIZE);
+        // The sorted run of pages that lb contains
+        size_t j = i + 1;
+        while (j < nflush && lb->alloc.contains(mem->hot_pages[j]))
+          ++j;
+        auto l = lb->lock.guard();
+        lb->alloc.free_pages(mem->hot_pages + i, j - i);
+        i = j;
       }
-      lock.release();
       // Shift hot page list down
-      // XXX(Austin) Could use two lists and switch off
-      mem->nhot = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
-      memmove(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2),
+      mem->nhot -= nflush;
+      memmove(mem->hot_pages, mem->hot_pages + nflush,
               mem->nhot * sizeof *mem->hot_pages);
     }
     mem->hot_pages[mem->nhot++] = v;
@@ -1211,6 +1243,31 @@ kfree(void *v, size_t size)
 }
 #endif
 
+// Split a block of size bytes returned by kalloc() into pages that can
+// each be passed to kfree() on their own.
+void
+ksplit(void *v, size_t size)
+{
+  assert(size % PGSIZE == 0);
+  if (size == PGSIZE)
+    return;
+
+  if (KERNEL_HEAP_PROFILE) {
+    auto alloc_rip = alloc_debug_info::of(v, size)->kalloc_rip();
+    for (size_t off = 0; off < size; off += PGSIZE)
+      alloc_debug_info::of((char*)v + off, PGSIZE)->set_kalloc_rip(alloc_rip);
+  }
+
+  for (auto &lb : buddies) {
+    if (lb.alloc.contains(v)) {
+      auto l = lb.lock.guard();
+      lb.alloc.split(v, size);
+      return;
+    }
+  }
+  panic("ksplit: pointer %p is not in an allocated region", v);
+}
+
 void
 ksfree(int slab, void *v)
 {
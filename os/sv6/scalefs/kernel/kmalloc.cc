@@ -16,20 +16,58 @@
 #include "page_info.hh"
 #include "heapprof.hh"
 #include "numa.hh"
+#include "critical.hh"
+#include "kstats.hh"
 
+#include <atomic>
 #include <type_traits>
 
 // allocate in power-of-two sizes up to 2^KMMAX (PGSIZE)
 #define KMMAX PGSHIFT
 
+// Each CPU keeps, per size class, a loaded and a previous magazine that
+// only it touches (with interrupts disabled), and a depot of full
+// magazines behind a lock.  A magazine is just a list of free objects;
+// the first object of a magazine that sits in a depot or on a remote
+// list also holds the link to the next magazine and the object count.
+//
+// Every kmalloc page belongs to the CPU whose freelists it was carved
+// for (page_info::kmhome).  Objects freed on another CPU are collected
+// into a batch per size class and pushed back to their home CPU's
+// lock-free remote list a magazine at a time (or sooner, when the CPU
+// refills that size class or goes idle), so memory doesn't drift to the
+// CPUs that free it.  A CPU that runs dry takes its remote list
+// first, then its depot, then a spare magazine from the fullest depot in
+// its NUMA node, before it carves up a new page.
+
+#define KM_MAG_SIZE   32        // objects per magazine
+#define KM_STEAL_MIN  2         // depot magazines a neighbor must have to lend one
+
 struct header {
   struct header *next;
+  struct header *nextmag;
+  u64 count;
 };
+static_assert(sizeof(header) <= (1 << 6), "header too big for smallest bucket");
 
 struct bucket {
-  spinlock lock;
-  header* hdr;
-  u64 count;
+  // Only used by the owning CPU with interrupts disabled.
+  header* loaded;
+  u64 nloaded;
+  header* prev;
+  u64 nprev;
+  header* out;                  // batch of objects to return to outhome
+  u64 nout;
+  int outhome;
+
+  spinlock lock;                // protects depot
+  header* depot;
+  u64 ndepot;                   // magazines in depot
+  u64 count;                    // objects in depot
+
+  // Magazines freed back to us by other CPUs.
+  std::atomic<header*> remote __mpalign__;
+  __padout__;
 };
 
 struct freelist {
@@ -46,13 +84,41 @@ kminit(void)
     freelists[c].name[0] = (char) c + '0';
     safestrcpy(freelists[c].name+1, "freelist", MAXNAME-1);
     for (int b = 0; b < KMMAX+1; b++) {
-      scoped_acquire guard(&freelists[c].buckets[b].lock);
-      freelists[c].buckets[b].hdr = nullptr;
-      freelists[c].buckets[b].count = 0;
+      struct bucket &bk = freelists[c].buckets[b];
+      scoped_acquire guard(&bk.lock);
+      bk.loaded = bk.prev = bk.out = bk.depot = nullptr;
+      bk.nloaded = bk.nprev = bk.nout = bk.ndepot = bk.count = 0;
+      bk.outhome = -1;
+      bk.remote = nullptr;
     }
   }
 }
 
+// Caller must hold bk.lock.
+static void
+depot_put(struct bucket &bk, header *mag, u64 n)
+{
+  mag->nextmag = bk.depot;
+  mag->count = n;
+  bk.depot = mag;
+  bk.ndepot++;
+  bk.count += n;
+}
+
+// Caller must hold bk.lock.
+static header*
+depot_get(struct bucket &bk, u64 *n)
+{
+  header *mag = bk.depot;
+  if (!mag)
+    return nullptr;
+  bk.depot = mag->nextmag;
+  bk.ndepot--;
+  bk.count -= mag->count;
+  *n = mag->count;
+  return mag;
+}
+
 // get more space for freelists[c].buckets[b]
 static int
 morecore(int c, int b)
@@ -76,14 +142,19 @@ morecore(int c, int b)
 
   int sz = 1 << b;
   assert(sz >= sizeof(header));
-  scoped_acquire guard(&freelists[c].buckets[b].lock);
+  page_info::of(p)->kmhome = c;
+  header *mag = nullptr;
+  u64 n = 0;
   for(char *q = p + CACHELINE * r; q + sz <= p + PGSIZE; q += sz){
     struct header *h = (struct header *) q;
-    h->next = freelists[c].buckets[b].hdr;
-    freelists[c].buckets[b].hdr = h;
-    freelists[c].buckets[b].count++;
+    h->next = mag;
+    mag = h;
+    n++;
   }
 
+  struct bucket &bk = freelists[c].buckets[b];
+  scoped_acquire guard(&bk.lock);
+  depot_put(bk, mag, n);
   return 0;
 }
 
@@ -98,27 +169,148 @@ bucket(u64 nbytes)
   return b;
 }
 
-static void *
-kmalloc_small(size_t b, const char *name, int cpu)
+// Hand the objects batched in bk.out back to their home CPU.  Caller
+// must be bk's CPU with interrupts disabled.
+static void
+flush_out(struct bucket &bk, int b)
 {
-  struct header *h;
-  int c = cpu >= 0 ? cpu : mycpu()->id;
+  header *mag = bk.out;
+  if (!mag)
+    return;
+  mag->count = bk.nout;
+  std::atomic<header*> &remote = freelists[bk.outhome].buckets[b].remote;
+  header *head = remote.load(std::memory_order_relaxed);
+  do {
+    mag->nextmag = head;
+  } while (!remote.compare_exchange_weak(head, mag, std::memory_order_release,
+                                         std::memory_order_relaxed));
+  bk.out = nullptr;
+  bk.nout = 0;
+  bk.outhome = -1;
+  kstats::inc(&kstats::kmalloc_remote_free_count);
+}
+
+// Lend a magazine from the fullest depot among c's NUMA node neighbors.
+static header*
+steal_mag(int c, int b, u64 *n)
+{
+  numa_node *node = cpus[c].node;
+  if (!node)
+    return nullptr;
+
+  int victim = -1;
+  u64 most = KM_STEAL_MIN - 1;
+  for (auto cpuid : node->cpuids) {
+    u64 nd = freelists[cpuid].buckets[b].ndepot;
+    if (cpuid != c && nd > most) {
+      victim = cpuid;
+      most = nd;
+    }
+  }
+  if (victim < 0)
+    return nullptr;
+
+  struct bucket &vk = freelists[victim].buckets[b];
+  scoped_acquire guard(&vk.lock);
+  if (vk.ndepot < KM_STEAL_MIN)
+    return nullptr;
+  kstats::inc(&kstats::kmalloc_steal_count);
+  return depot_get(vk, n);
+}
+
+// Load a magazine into bk, which is empty.  Caller must be c with
+// interrupts disabled.
+static bool
+refill(struct bucket &bk, int c, int b)
+{
+  // A CPU that seldom frees other CPUs' objects would otherwise keep a
+  // partial batch indefinitely.
+  flush_out(bk, b);
+
+  if (bk.nprev) {
+    std::swap(bk.loaded, bk.prev);
+    std::swap(bk.nloaded, bk.nprev);
+    return true;
+  }
+
+  // Objects other CPUs gave back: load one magazine, keep the rest.
+  header *mags = bk.remote.exchange(nullptr, std::memory_order_acquire);
+  if (mags) {
+    bk.loaded = mags;
+    bk.nloaded = mags->count;
+    mags = mags->nextmag;
+    if (mags) {
+      scoped_acquire guard(&bk.lock);
+      while (mags) {
+        header *next = mags->nextmag;
+        depot_put(bk, mags, mags->count);
+        mags = next;
+      }
+    }
+    return true;
+  }
+
+  for (;;) {
+    {
+      scoped_acquire guard(&bk.lock);
+      bk.loaded = depot_get(bk, &bk.nloaded);
+      if (bk.loaded)
+        return true;
+    }
+    if ((bk.loaded = steal_mag(c, b, &bk.nloaded)) != nullptr)
+      return true;
+    if (morecore(c, b) < 0)
+      return false;
+  }
+}
+
+// Allocate from another CPU's freelists, for kmalloc(..., cpu).
+static header*
+kmalloc_remote(size_t b, int c)
+{
+  struct bucket &bk = freelists[c].buckets[b];
 
   for (;;) {
-    scoped_acquire guard(&freelists[c].buckets[b].lock);
-    h = freelists[c].buckets[b].hdr;
-    if (h) {
-      freelists[c].buckets[b].hdr = h->next;
-      freelists[c].buckets[b].count--;
-      break;
+    {
+      scoped_acquire guard(&bk.lock);
+      u64 n;
+      header *h = depot_get(bk, &n);
+      if (h) {
+        if (--n)
+          depot_put(bk, h->next, n);
+        return h;
+      }
     }
+    if (morecore(c, b) < 0)
+      return nullptr;
+  }
+}
+
+static void *
+kmalloc_small(size_t b, const char *name, int cpu)
+{
+  struct header *h;
 
-    guard.release();
-    if (morecore(c, b) < 0) {
-      cprintf("kmalloc(%d) failed\n", 1 << b);
-      return 0;
+  {
+    scoped_cli cli;
+    int c = myid();
+    if (cpu >= 0 && cpu != c) {
+      h = kmalloc_remote(b, cpu);
+    } else {
+      struct bucket &bk = freelists[c].buckets[b];
+      if (bk.nloaded || refill(bk, c, b)) {
+        h = bk.loaded;
+        bk.loaded = h->next;
+        bk.nloaded--;
+      } else {
+        h = nullptr;
+      }
     }
   }
+  if (!h) {
+    cprintf("kmalloc(%d) failed\n", 1 << b);
+    return 0;
+  }
 
   if (ALLOC_MEMSET) {
     char* chk = (char*)h + sizeof(struct header);
@@ -189,11 +381,35 @@ kmfree(void *ap, u64 nbytes)
     if (ALLOC_MEMSET)
       memset(ap, 3, (1<<b));
 
-    int c = mycpu()->id;
-    scoped_acquire guard(&freelists[c].buckets[b].lock);
-    h->next = freelists[c].buckets[b].hdr;
-    freelists[c].buckets[b].hdr = h;
-    freelists[c].buckets[b].count++;
+    int home = page_info::of(ap)->kmhome;
+    scoped_cli cli;
+    int c = myid();
+    struct bucket &bk = freelists[c].buckets[b];
+
+    if (home != c) {
+      if (bk.out && bk.outhome != home)
+        flush_out(bk, b);
+      h->next = bk.out;
+      bk.out = h;
+      bk.outhome = home;
+      if (++bk.nout >= KM_MAG_SIZE)
+        flush_out(bk, b);
+      return;
+    }
+
+    if (bk.nloaded >= KM_MAG_SIZE) {
+      if (bk.nprev) {
+        scoped_acquire guard(&bk.lock);
+        depot_put(bk, bk.prev, bk.nprev);
+      }
+      bk.prev = bk.loaded;
+      bk.nprev = bk.nloaded;
+      bk.loaded = nullptr;
+      bk.nloaded = 0;
+    }
+    h->next = bk.loaded;
+    bk.loaded = h;
+    bk.nloaded++;
   }
 }
 
@@ -259,6 +475,19 @@ alloc_debug_info::of(void *p, size_t size)
   return (alloc_debug_info*)((char*)p + aligned);
 }
 
+// Hand back the objects this CPU has batched up for other CPUs, so
+// they don't sit here while it idles.  Called from the idle loop.
+void
+kmidle(void)
+{
+  scoped_cli cli;
+  struct freelist &fl = freelists[myid()];
+  for (int b = 0; b < KMMAX+1; b++)
+    flush_out(fl.buckets[b], b);
+}
+
+// Even out the depots of all CPUs, a magazine at a time.  Lent
+// magazines still go home when their objects are freed.
 void
 kmbalance(void)
 {
@@ -271,7 +500,7 @@ kmbalance(void)
     u64 ncpu = 0;
     for (auto &node : numa_nodes) {
       for (auto cpuid : node.cpuids) {
-        total += freelists[cpuid].buckets[b].count;
+        total += freelists[cpuid].buckets[b].ndepot;
         ncpu++;
       }
     }
@@ -279,25 +508,24 @@ kmbalance(void)
     header* extras = nullptr;
     for (auto &node : numa_nodes) {
       for (auto cpuid : node.cpuids) {
-        while (freelists[cpuid].buckets[b].count > total/ncpu) {
-          header* h = freelists[cpuid].buckets[b].hdr;
-          assert(h);
-          freelists[cpuid].buckets[b].hdr = h->next;
-          freelists[cpuid].buckets[b].count--;
-          h->next = extras;
-          extras = h;
+        struct bucket &bk = freelists[cpuid].buckets[b];
+        while (bk.ndepot > total/ncpu) {
+          u64 n;
+          header* mag = depot_get(bk, &n);
+          assert(mag);
+          mag->nextmag = extras;
+          extras = mag;
         }
       }
     }
 
     for (auto &node : numa_nodes) {
       for (auto cpuid : node.cpuids) {
-        while (extras && freelists[cpuid].buckets[b].count <= total/ncpu + 1) {
-          header* h = extras;
-          extras = h->next;
-          h->next = freelists[cpuid].buckets[b].hdr;
-          freelists[cpuid].buckets[b].hdr = h;
-          freelists[cpuid].buckets[b].count++;
+        struct bucket &bk = freelists[cpuid].buckets[b];
+        while (extras && bk.ndepot <= total/ncpu) {
+          header* mag = extras;
+          extras = mag->nextmag;
+          depot_put(bk, mag, mag->count);
         }
       }
     }
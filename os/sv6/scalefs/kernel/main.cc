@@ -69,6 +69,7 @@ void initdev(void);
 void inithpet(void);
 void initrtc(void);
 void initmfs(void);
+void initpagecache(void);
 void idleloop(void);
 void init_scalefs(void);
 
@@ -259,6 +260,7 @@ cmain(u64 mbmagic, u64 mbaddr)
   initinode_late();
 
   initmfs();
+  initpagecache();         // Requires initmfs
 
   if (VERBOSE)
     cprintf("ncpu %d %lu MHz\n", ncpu, cpuhz / 1000000);
@@ -187,7 +187,7 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
 
       memmove((char*) pi->va() + pgoff, buf + off, pgend - pgoff);
       m->as_file()->dirty(true);
-      m->as_file()->set_page_dirty(pgbase / PGSIZE);
+      m->as_file()->set_page_dirty(pgbase / PGSIZE, pi, pgoff, pgend - pgoff);
 
       if (resize && *resize)
         resize->resize_nogrow(pos + pgend - pgoff);
@@ -193,13 +193,36 @@ mfile::resizer::resize_append(u64 size, sref<page_info> pi)
   mf_->pages_.fill(it, ps);
   mf_->size_ = size;
   mf_->dirty(true);
+  if (mf_->fs_ == root_fs)
+    pagecache_track(mf_->mnum_, it.index(), pi.get());
 }
 
+// Mark the page at pageidx dirty after the caller wrote bytes [off, off+len)
+// of pi, the page it found there.
 void
-mfile::set_page_dirty(u64 pageidx)
+mfile::set_page_dirty(u64 pageidx, const sref<page_info> &pi, u32 off, u32 len)
 {
   auto it = pages_.find(pageidx);
   auto lock = pages_.acquire(it);
+  if (!it.is_set())
+    return;
+
+  // The page reclaimer may have evicted pi (and perhaps someone read the
+  // page back in) between the caller's lookup and now.  The caller's write
+  // is the latest data, so make sure that is what stays cached.
+  sref<page_info> cur = it->get_page_info();
+  if (cur != pi) {
+    if (!cur) {
+      page_state ps(pi);
+      ps.set_partial_page(it->is_partial_page());
+      pages_.fill(it, ps);
+      if (fs_ == root_fs)
+        pagecache_track(mnum_, pageidx, pi.get());
+    } else {
+      // Other writers may have updated the rest of cur meanwhile.
+      memmove((char*)cur->va() + off, (char*)pi->va() + off, len);
+    }
+  }
   it->set_dirty_bit(true);
 }
 
@@ -214,8 +237,125 @@ mfile::resizer::initialize_from_disk(u64 size)
   mf_->size_ = size;
 }
 
+u32
+mfile::readahead::update(u64 pageidx, u32 npages)
+{
+  if (pageidx == next_) {
+    // Moved on to the next page: grow the window.
+    window_ = window_ ? std::min(2 * window_, (u32)MAX_PAGES) : MIN_PAGES;
+  } else if (pageidx + 1 != next_) {
+    // Neither the next page nor a continuation of the last one.
+    window_ = 0;
+  }
+
+  next_ = pageidx + npages;
+  return std::min(std::max(window_, npages), (u32)MAX_PAGES);
+}
+
+// Install freshly read pages pgs[0..n) holding nbytes of the file, starting at
+// pageidx, in the page-cache.
+void
+mfile::install_pages(u64 pageidx, char **pgs, u32 n, size_t nbytes)
+{
+  for (u32 i = 0; i < n; i++) {
+    auto pi = sref<page_info>::transfer(new (page_info::of(pgs[i])) page_info());
+    auto it = pages_.find(pageidx + i);
+    auto lock = pages_.acquire(it);
+
+    // Someone else may have filled the page (and perhaps dirtied it) while
+    // we were reading; their copy wins.
+    if (it->get_page_info() != nullptr)
+      continue;
+
+    page_state ps(pi);
+    if (i == n - 1 && PGOFFSET(nbytes))
+      ps.set_partial_page(true);
+    pages_.fill(it, ps);
+    if (fs_ == root_fs)
+      pagecache_track(mnum_, pageidx + i, pi.get());
+  }
+}
+
+// Try to read in the FOLIO_PAGES-aligned run of pages containing pageidx as a
+// single physically contiguous, LGPGSIZE-aligned allocation (a folio), so that
+// vmap can map it with one large page. This is only done if the whole run lies
+// within the file and none of it is cached yet.
+bool
+mfile::load_folio(u64 pageidx)
+{
+  u64 base = pageidx & ~(u64)(FOLIO_PAGES - 1);
+  u64 size = size_;
+
+  if ((base + FOLIO_PAGES) * PGSIZE > size)
+    return false;
+
+  for (auto it = pages_.find(base), end = pages_.find(base + FOLIO_PAGES);
+       it < end; it += it.span()) {
+    if (!it.is_set() || it->get_page_info() != nullptr)
+      return false;
+  }
+
+  char *folio = kalloc("file folio", LGPGSIZE);
+  if (!folio)
+    return false;
+  // The pages of a folio are reference counted and freed one by one.
+  ksplit(folio, LGPGSIZE);
+
+  char **pgs = (char**)kmalloc(FOLIO_PAGES * sizeof(char*), "folio pages");
+  for (u32 i = 0; i < FOLIO_PAGES; i++)
+    pgs[i] = folio + i * PGSIZE;
+
+  size_t bytes_read = rootfs_interface->load_file_pages(mnum_, pgs,
+                                                        base * PGSIZE, LGPGSIZE);
+  assert(bytes_read == LGPGSIZE);
+  install_pages(base, pgs, FOLIO_PAGES, LGPGSIZE);
+
+  kmfree(pgs, FOLIO_PAGES * sizeof(char*));
+  return true;
+}
+
+// Read in the pages [pageidx, pageidx + npages) from the disk, stopping at the
+// first page that is already cached or lies past the end of the file. The
+// whole run is fetched by a single call into the disk layer, which batches
+// reads of blocks that are contiguous on the disk. Requests for a full
+// readahead window or more are served with a whole folio if possible.
+void
+mfile::load_pages(u64 pageidx, u32 npages)
+{
+  char *pgs[readahead::MAX_PAGES];
+  u64 size = size_;
+  u32 n;
+
+  if (npages >= readahead::MAX_PAGES && load_folio(pageidx))
+    return;
+
+  npages = std::min(npages, (u32)readahead::MAX_PAGES);
+  for (n = 0; n < npages; n++) {
+    u64 pos = (pageidx + n) * PGSIZE;
+    if (pos >= size)
+      break;
+    auto it = pages_.find(pageidx + n);
+    if (!it.is_set() || (n && it->get_page_info() != nullptr))
+      break;
+
+    pgs[n] = zalloc("file page");
+    assert(pgs[n]);
+  }
+
+  if (!n)
+    return;
+
+  size_t pos = pageidx * PGSIZE;
+  size_t nbytes = std::min(size - pos, (u64)n * PGSIZE);
+  size_t bytes_read = rootfs_interface->load_file_pages(mnum_, pgs, pos, nbytes);
+  assert(nbytes == bytes_read);
+  install_pages(pageidx, pgs, n, nbytes);
+}
+
+// Return the page at pageidx, reading it in from the disk if necessary. On a
+// miss, up to nfill pages starting at pageidx are read in together.
 mfile::page_state
-mfile::get_page(u64 pageidx)
+mfile::get_page(u64 pageidx, u32 nfill)
 {
   auto it = pages_.find(pageidx);
   if (!it.is_set())
@@ -226,27 +366,24 @@ mfile::get_page(u64 pageidx)
       // Currently this is used by pagefault and may need to be
       // generalized to be used in other situations.
       if (check_critical(critical_mask::NO_SCHED))
-        throw blocking_io(sref<mfile>::newref(this), pageidx);
-
-      // Read page from disk
-      char *p = zalloc("file page");
-      assert(p);
+        throw blocking_io(sref<mfile>::newref(this), pageidx, nfill);
 
-      auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
-      size_t pos = pageidx * PGSIZE;
-      size_t nbytes = size_ - pos;
-      if (nbytes > PGSIZE)
-        nbytes = PGSIZE;
-
-      size_t bytes_read = rootfs_interface->load_file_page(mnum_, p, pos, nbytes);
-      assert(nbytes == bytes_read);
-      auto lock = pages_.acquire(it);
-      page_state ps(pi);
-      if (PGOFFSET(nbytes))
-        ps.set_partial_page(true);
-      pages_.fill(it, ps);
+      load_pages(pageidx, nfill);
   }
 
+  it->mark_referenced();
+  return it->copy_consistent();
+}
+
+// Like get_page(), but never reads from the disk: the returned page_state has
+// no page if it isn't in the page-cache.
+mfile::page_state
+mfile::get_cached_page(u64 pageidx)
+{
+  auto it = pages_.find(pageidx);
+  if (!it.is_set())
+    return mfile::page_state();
+  it->mark_referenced();
   return it->copy_consistent();
 }
 
@@ -276,6 +413,65 @@ mfile::put_page(u64 pageidx)
   }
 }
 
+// Called by the page reclaimer's CLOCK hand for pi, which it found cached at
+// pageidx when it started tracking it.  Pages that were looked up or accessed
+// through a mapping since the hand last came by, dirty ones, and ones mapped
+// shared and writable, are kept; otherwise the page is evicted
+// and unmapped from any vmaps that have it mapped.
+mfile::reclaim_result
+mfile::reclaim_page(u64 pageidx, page_info *pi)
+{
+  auto it = pages_.find(pageidx);
+  sref<page_info> page;
+  std::vector<page_info::rmap_entry> mapped;
+  {
+    auto lock = pages_.acquire(it);
+    if (!it.is_set())
+      return reclaim_result::gone;
+    page = it->get_page_info();
+    if (page.get() != pi)
+      return reclaim_result::gone;
+    if (pi->test_and_clear_referenced() || it->is_dirty_page())
+      return reclaim_result::kept;
+    // Nothing collects the dirty bits of the PTEs, so stores through a
+    // writable shared mapping never show up in the dirty state.  Such a
+    // page may hold the only copy of the data.
+    pi->peek_rmap_vector(mapped);
+    for (auto &m : mapped)
+      if (m.first->maps_shared_writable(m.second))
+        return reclaim_result::kept;
+  }
+
+  // Accesses through a mapping don't mark the page referenced; collect
+  // them from the PTEs.  This may interrupt other cores, so don't hold
+  // the page lock.  Clear every mapping's bit, not just the first set.
+  bool accessed = false;
+  for (auto &m : mapped)
+    if (m.first->test_and_clear_accessed(m.second))
+      accessed = true;
+  if (accessed)
+    return reclaim_result::kept;
+
+  {
+    // A fault that mapped the page meanwhile marked it referenced.
+    auto lock = pages_.acquire(it);
+    if (!it.is_set() || it->get_page_info().get() != pi)
+      return reclaim_result::gone;
+    if (pi->test_and_clear_referenced() || it->is_dirty_page())
+      return reclaim_result::kept;
+    it->reset_page_info();
+  }
+
+  std::vector<page_info::rmap_entry> rmap_vec;
+  pi->get_rmap_vector(rmap_vec);
+  for (auto rmap_it = rmap_vec.begin(); rmap_it != rmap_vec.end(); rmap_it++)
+    rmap_it->first->clear_mapping(rmap_it->second);
+
+  // Drop the page-cache's reference.
+  pi->dec();
+  return reclaim_result::evicted;
+}
+
 // This function gets called when a file is truncated. Page table mappings for
 // any pages that are no longer a part of the file need to be cleared from vmaps
 // that have the file mmapped. Each page_info object keeps track of these vmaps
@@ -347,6 +543,36 @@ mfile::sync_file(int cpu)
 
   sref<inode> ip = rootfs_interface->prepare_sync_file_pages(mnum_, trans);
 
+  // Dirty pages are flushed in runs of consecutive page indices, so that each
+  // run gets contiguous disk blocks and goes out as few large writes.
+  enum { SYNC_MAX_PAGES = 256 };
+  char **run = (char**)kmalloc(SYNC_MAX_PAGES * sizeof(char*), "syncrun");
+  page_state **run_ps = (page_state**)kmalloc(
+    SYNC_MAX_PAGES * sizeof(page_state*), "syncrun");
+  u64 run_start = 0;
+  u32 run_len = 0;
+
+  auto flush_run = [&]() {
+    if (!run_len)
+      return;
+    // The actual number of bytes to be written for the last page is
+    // mlen - pos, but we write whole pages in order to avoid expensive
+    // Read-Modify-Writes [because synchronous reads kill the performance
+    // benefits of asynchronous writes]. Since the rest of the bytes in the
+    // page are zero anyway, this is harmless; we won't leak any random bytes
+    // into the file.
+    int len = run_len * PGSIZE;
+    assert(len == rootfs_interface->sync_file_pages(ip, run,
+                    run_start * PGSIZE, len, trans));
+    for (u32 i = 0; i < run_len; i++) {
+      // Once clean, the page may be evicted before the transaction gets
+      // written out, so the transaction holds on to it.
+      trans->hold_page(run_ps[i]->get_page_info());
+      run_ps[i]->set_dirty_bit(false);
+    }
+    run_len = 0;
+  };
+
   auto page_end = pages_.find(PGROUNDUP(mlen) / PGSIZE);
   for (auto it = pages_.begin(); it != page_end; ) {
     // Skip unset spans
@@ -365,19 +591,19 @@ mfile::sync_file(int cpu)
       continue;
     }
 
-    size_t pos = it.index() * PGSIZE;
-
-    // The actual number of bytes to be written is mlen - pos, but we use
-    // PGSIZE as the size argument in order to avoid expensive Read-Modify-Writes
-    // in writei() [because synchronous reads kill the performance benefits of
-    // asynchronous writes]. Since the rest of the bytes in the page are
-    // zero anyway, this is harmless; we won't leak any random bytes into the
-    // file.
-    assert(PGSIZE == rootfs_interface->sync_file_page(ip,
-                    (char*)it->get_page_info()->va(), pos, PGSIZE, trans));
-    it->set_dirty_bit(false);
+    if (run_len && (run_len == SYNC_MAX_PAGES ||
+                    run_start + run_len != it.index()))
+      flush_run();
+    if (!run_len)
+      run_start = it.index();
+    run[run_len] = (char*)it->get_page_info()->va();
+    run_ps[run_len] = &*it;
+    run_len++;
     ++it;
   }
+  flush_run();
+  kmfree(run, SYNC_MAX_PAGES * sizeof(char*));
+  kmfree(run_ps, SYNC_MAX_PAGES * sizeof(page_state*));
 
   rootfs_interface->finish_sync_file_pages(ip, trans);
 
@@ -44,6 +44,10 @@ public:
 
   void mask_pc(bool mask) { }
 
+  void timer_periodic() { }
+
+  void timer_oneshot(u64 msec) { }
+
   void start_ap(struct cpu *c, u32 addr)
   {
     panic("no LAPIC; cannot start AP");
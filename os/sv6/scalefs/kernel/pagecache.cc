@@ -0,0 +1,195 @@
+#include "types.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "proc.hh"
+#include "cpu.hh"
+#include "spercpu.hh"
+#include "mnode.hh"
+#include "kstats.hh"
+
+// Memory-pressure driven page-cache reclaim, using one CLOCK per core.
+//
+// Every page that enters the page-cache is appended to the clock of the core
+// that put it there, which is also the core whose local memory it was most
+// likely allocated from.  Each core runs a reclaimer thread that watches the
+// free memory of its local buddy allocators.  When that drops below the low
+// watermark, the thread sweeps its clock: pages that were looked up since the
+// hand last passed them get a second chance, and clean, unreferenced ones are
+// evicted (and unmapped through their rmap) until enough memory has been
+// freed to get back above the high watermark.
+//
+// A clock is a FIFO of page-sized chunks of entries; the hand takes entries
+// off the head and appends the ones that survive at the tail.  Entries name a
+// page by (mnode number, page index) and only keep a raw page_info pointer,
+// which is checked against what the file caches there before the page is
+// touched, so entries for truncated or deleted files simply fall out.
+
+namespace {
+  struct clock_entry {
+    u64 mnum;
+    u64 pageidx;
+    page_info *pi;
+  };
+
+  struct clock_chunk {
+    enum { NENTRIES = (PGSIZE - sizeof(void*)) / sizeof(clock_entry) };
+    clock_chunk *next;
+    clock_entry e[NENTRIES];
+  };
+  static_assert(sizeof(clock_chunk) <= PGSIZE, "clock_chunk too big");
+
+  struct page_clock {
+    struct spinlock lock;
+    struct condvar cv;
+    clock_chunk *head, *tail;
+    u32 head_pos;               // Next entry to take from head
+    u32 tail_pos;               // Next free entry in tail
+    u64 npages;
+    u32 added;                  // Pages added since the last pressure check
+
+    page_clock() : lock("page_clock"), cv(condvar("page_clock_cv")),
+                   head(nullptr), tail(nullptr), head_pos(0), tail_pos(0),
+                   npages(0), added(0) {}
+
+    // Caller must hold lock.  Returns false if the entry had to be dropped
+    // for lack of memory; the page is then simply not reclaimed.
+    bool put(const clock_entry &e)
+    {
+      if (!tail || tail_pos == clock_chunk::NENTRIES) {
+        clock_chunk *c = (clock_chunk*)kalloc("page clock");
+        if (!c)
+          return false;
+        c->next = nullptr;
+        if (tail)
+          tail->next = c;
+        else
+          head = c;
+        tail = c;
+        tail_pos = 0;
+      }
+      tail->e[tail_pos++] = e;
+      npages++;
+      return true;
+    }
+
+    // Caller must hold lock.
+    bool take(clock_entry *e)
+    {
+      if (!npages)
+        return false;
+      *e = head->e[head_pos++];
+      npages--;
+      if (head_pos == clock_chunk::NENTRIES) {
+        clock_chunk *c = head;
+        head = c->next;
+        head_pos = 0;
+        if (!head)
+          tail = nullptr;
+        kfree(c);
+      }
+      return true;
+    }
+  };
+}
+
+DEFINE_PERCPU(page_clock, clocks);
+
+// Start tracking page pi, cached at pageidx of file mnum, on this core's
+// clock.
+void
+pagecache_track(u64 mnum, u64 pageidx, page_info *pi)
+{
+  page_clock &c = clocks[myid()];
+  auto l = c.lock.guard();
+  c.put(clock_entry{mnum, pageidx, pi});
+  // Let the reclaimer re-check the memory pressure every so often while
+  // the cache grows, instead of waiting for its timeout.
+  if (++c.added == PAGE_RECLAIM_BATCH)
+    c.cv.wake_all();
+}
+
+// Offer the page of entry e to its file for eviction.
+static mfile::reclaim_result
+reclaim_entry(const clock_entry &e)
+{
+  sref<mnode> m = root_fs->mget(e.mnum);
+  if (!m)
+    return mfile::reclaim_result::gone;
+  return m->as_file()->reclaim_page(e.pageidx, e.pi);
+}
+
+// Sweep cpu's clock if its local memory is running low.
+static void
+reclaim(int cpu)
+{
+  page_clock &c = clocks[cpu];
+  size_t free, limit;
+
+  kmemlocal(cpu, &free, &limit);
+  if (free >= limit / PAGE_RECLAIM_LOW)
+    return;
+
+  // Evicted pages are freed once refcache gets to them, so the free memory
+  // won't go up while we sweep.  Evict as many pages as it takes instead.
+  u64 want = (limit / PAGE_RECLAIM_HIGH - free) / PGSIZE;
+  u64 budget;
+  {
+    auto l = c.lock.guard();
+    // Two times around the clock: the first pass may only clear marks.
+    budget = 2 * c.npages;
+  }
+
+  while (want && budget--) {
+    clock_entry e;
+    {
+      auto l = c.lock.guard();
+      if (!c.take(&e))
+        break;
+    }
+
+    kstats::inc(&kstats::pagecache_scan_count);
+    switch (reclaim_entry(e)) {
+    case mfile::reclaim_result::gone:
+      break;
+    case mfile::reclaim_result::kept:
+      kstats::inc(&kstats::pagecache_referenced_count);
+      {
+        auto l = c.lock.guard();
+        c.put(e);
+      }
+      break;
+    case mfile::reclaim_result::evicted:
+      kstats::inc(&kstats::pagecache_evict_count);
+      want--;
+      break;
+    }
+  }
+}
+
+static void
+pagecache_reclaimer(void *x)
+{
+  int cpu = (uptr)x;
+  page_clock &c = clocks[cpu];
+
+  for (;;) {
+    acquire(&c.lock);
+    c.cv.sleep_to(&c.lock,
+                  nsectime() + ((u64)PAGE_RECLAIM_INTERVAL)*1000000ull);
+    c.added = 0;
+    release(&c.lock);
+
+    reclaim(cpu);
+  }
+}
+
+void
+initpagecache(void)
+{
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "pgreclaim_%u", c);
+    threadpin(pagecache_reclaimer, (void*)(uptr)c, namebuf, c);
+  }
+}
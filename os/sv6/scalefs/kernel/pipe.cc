@@ -10,118 +10,411 @@
 #include "uk/unistd.h"
 #include "uk/fcntl.h"
 
-#define PIPESIZE (16*4096)
+#define PIPESIZE (16*4096)      // Initial ring size
+#define PIPEMAXSIZE (256*4096)  // Largest a ring can grow to
 
 struct pipe {
   virtual ~pipe() { };
   virtual int write(const char *addr, int n) = 0;
   virtual int read(char *addr, int n) = 0;
   virtual int close(int writable) = 0;
+  virtual ssize_t splice_from(sref<mnode> m, u64 off, size_t n) = 0;
+  virtual ssize_t splice_to(file *out, off_t *off, size_t n) = 0;
+  virtual int push_page(sref<page_info> pi, u32 off, u32 len) = 0;
   NEW_DELETE_OPS(pipe);
 };
 
+// One segment of pipe data: part of a page that is either the pipe's
+// own or was spliced in from the page cache.  Only the writer changes
+// len, by appending to the last buffer, and only to pages of its own.
+struct pipe_buf {
+  sref<page_info> ref;          // Spliced page; null if page is ours
+  char *page;
+  u32 off;                      // Where the data starts in page
+  std::atomic<u32> len;
+
+  pipe_buf() : page(nullptr), off(0), len(0) {}
+  NEW_DELETE_OPS(pipe_buf);
+
+  bool appendable() const {
+    return page && !ref && off + len < PGSIZE;
+  }
+
+  void clear() {
+    if (page && !ref)
+      kfree(page);
+    ref.reset();
+    page = nullptr;
+    off = len = 0;
+  }
+};
+
+// A ring of page buffers with one lock per end, so a reader and a writer
+// copy in and out concurrently without sharing a lock.  The byte
+// counters hand off data between the ends; lock is only taken to sleep
+// and to wake the other end, and only when it is (or may be) asleep.  A
+// writer that finds the ring full doubles it, up to PIPEMAXSIZE, before
+// it resorts to sleeping.
+//
+// The end locks are sleeplocks because splicing holds them across page
+// cache fills and writes to the destination file.  The reader never
+// frees the last published buffer, which the writer may still append to.
 struct ordered : pipe {
-  struct spinlock lock;
-  struct spinlock lock_close;
+  sleeplock rlock;              // Serializes readers
+  sleeplock wlock;              // Serializes writers
+  struct spinlock lock;         // Protects sleeping, waking and closing
   struct condvar  empty;
   struct condvar  full;
   std::atomic<bool> readopen;   // read fd is still open
-  int writeopen;  // write fd is still open
+  std::atomic<bool> writeopen;  // write fd is still open
   std::atomic<size_t> nread;  // number of bytes read
   std::atomic<size_t> nwrite; // number of bytes written
+  std::atomic<u64> head;        // First buffer not yet consumed
+  std::atomic<u64> tail;        // Number of buffers published
+  u32 rpos;                     // Bytes consumed of buffer head; rlock
+  std::atomic<int> rsleep;      // Readers that are (about to be) asleep
+  std::atomic<int> wsleep;      // Writers that are (about to be) asleep
   bool nonblock;
-  char data[PIPESIZE];
+  pipe_buf *bufs;
+  u32 nbufs;                    // Changes only with rlock and wlock held
 
   ordered(int flags)
-    : readopen(true), writeopen(1), nread(0), nwrite(0),
-      nonblock(flags & O_NONBLOCK)
+    : readopen(true), writeopen(true), nread(0), nwrite(0), head(0),
+      tail(0), rpos(0), rsleep(0), wsleep(0),
+      nonblock(flags & O_NONBLOCK), nbufs(PIPESIZE / PGSIZE)
   {
     lock = spinlock("pipe", LOCKSTAT_PIPE);
-    lock_close = spinlock("pipe:close", LOCKSTAT_PIPE);
     empty = condvar("pipe:empty");
     full = condvar("pipe:full");
+    bufs = alloc_bufs(nbufs);
+    if (!bufs)
+      throw_bad_alloc();
   };
   ~ordered() override {
+    for (u64 i = head; i < tail; i++)
+      bufs[i % nbufs].clear();
+    free_bufs(bufs, nbufs);
   };
   NEW_DELETE_OPS(ordered);
 
-  virtual int write(const char *addr, int n) override {
-    if (nonblock) {
-      for (;;) {
-        size_t nr = nread;
-        size_t nw = nwrite;
-        if (nr == nread) {
-          // use nread sort-of like a seqlock
-          if (nw == nr + PIPESIZE)
-            return -1;
-          break;
-        }
+  static pipe_buf *alloc_bufs(u32 n) {
+    pipe_buf *b = (pipe_buf*)kmalloc(n * sizeof(pipe_buf), "pipe_buf");
+    if (b)
+      for (u32 i = 0; i < n; i++)
+        new (&b[i]) pipe_buf();
+    return b;
+  }
+
+  static void free_bufs(pipe_buf *b, u32 n) {
+    for (u32 i = 0; i < n; i++)
+      b[i].~pipe_buf();
+    kmfree(b, n * sizeof(pipe_buf));
+  }
+
+  // Double the ring.  Caller must hold wlock.  Returns false if it is
+  // already as large as it gets, there is no memory, or a reader is
+  // busy (we mustn't wait for it: it may be splicing into our pipe).
+  bool grow() {
+    if (nbufs * PGSIZE >= PIPEMAXSIZE)
+      return false;
+    auto rl = rlock.try_guard();
+    if (!rl)
+      return false;
+    u32 nn = nbufs * 2;
+    pipe_buf *nb = alloc_bufs(nn);
+    if (!nb)
+      return false;
+
+    // Buffer numbers stay the same; only where they land in the ring
+    // moves.
+    for (u64 i = head; i < tail; i++) {
+      pipe_buf &o = bufs[i % nbufs], &n = nb[i % nn];
+      n.ref = std::move(o.ref);
+      n.page = o.page;
+      n.off = o.off;
+      n.len = o.len.load();
+      o.page = nullptr;
+    }
+    free_bufs(bufs, nbufs);
+    bufs = nb;
+    nbufs = nn;
+    return true;
+  }
+
+  // Wake one sleeper on cv if count says there may be one.  The caller
+  // has just published a new nread or nwrite; count is incremented
+  // before a sleeper re-checks them, so one of the two sees the other.
+  void wake(condvar *cv, std::atomic<int> &count) {
+    if (count.load() == 0)
+      return;
+    scoped_acquire l(&lock);
+    cv->wake_one();
+  }
+
+  // A woken writer may use only part of the room there is.  Pass the
+  // wakeup on to the next writer if any is left, so writers never sleep
+  // on a ring that has free buffers.  Caller must hold wlock.
+  void pass_slot() {
+    if (tail - head < nbufs)
+      wake(&full, wsleep);
+  }
+
+  // Wait until there is a free buffer.  Caller must hold wlock, which
+  // may be dropped and re-acquired.  Returns false if the write should
+  // fail instead.
+  bool wait_slot(lock_guard<sleeplock> *wl) {
+    while (tail - head == nbufs) {
+      if (grow())
+        continue;
+      if (nonblock || myproc()->killed)
+        return false;
+
+      // Never sleep holding wlock; other writers queue up on full.
+      wl->release();
+      {
+        scoped_acquire l(&lock);
+        ++wsleep;
+        auto unsleep = scoped_cleanup([this](){ --wsleep; });
+        while (tail - head == nbufs && readopen)
+          full.sleep(&lock);
       }
+      *wl = wlock.guard();
+      if (!readopen)
+        return false;
     }
+    return true;
+  }
 
+  // Publish the next buffer, which the caller has filled in.  Caller
+  // must hold wlock.
+  void publish(u32 len) {
+    tail.store(tail + 1);
+    nwrite += len;
+    wake(&empty, rsleep);
+  }
+
+  virtual int write(const char *addr, int n) override {
     if (!readopen)
       return -1;
 
-    scoped_acquire l(&lock);
-    for(int i = 0; i < n; i++){
-      while(nwrite == nread + PIPESIZE){ 
-        if (nonblock || myproc()->killed)
-          return -1;
-        scoped_acquire lclose(&lock_close);
-        if (!readopen)
-          return -1;
-        full.sleep(&lock, &lock_close);
+    auto wl = wlock.guard();
+    auto pass = scoped_cleanup([this](){ pass_slot(); });
+    for (int done = 0; done < n; ) {
+      u64 t = tail;
+      if (t != head) {
+        pipe_buf &b = bufs[(t - 1) % nbufs];
+        if (b.appendable()) {
+          u32 len = b.len;
+          u32 k = std::min(PGSIZE - b.off - len, (u32)(n - done));
+          memmove(b.page + b.off + len, addr + done, k);
+          b.len.store(len + k);
+          nwrite += k;
+          done += k;
+          wake(&empty, rsleep);
+          continue;
+        }
       }
-      data[nwrite++ % PIPESIZE] = addr[i];
+
+      if (!wait_slot(&wl))
+        return -1;
+      char *page = kalloc("pipe");
+      if (!page)
+        return done ? done : -1;
+      pipe_buf &b = bufs[tail % nbufs];
+      u32 k = std::min((u32)PGSIZE, (u32)(n - done));
+      memmove(page, addr + done, k);
+      b.page = page;
+      b.off = 0;
+      b.len = k;
+      publish(k);
+      done += k;
     }
-    if (n > 0)
-      empty.wake_all();
     return n;
   }
 
-  virtual int read(char *addr, int n) override {
-    if (nonblock) {
-      for (;;) {
-        size_t nr = nread;
-        size_t nw = nwrite;
-        if (nr == nread) {
-          // use nread sort-of like a seqlock
-          if (nw == nr)
-            return -1;
+  virtual int push_page(sref<page_info> pi, u32 off, u32 len) override {
+    if (!readopen)
+      return -1;
+    auto wl = wlock.guard();
+    auto pass = scoped_cleanup([this](){ pass_slot(); });
+    if (!wait_slot(&wl))
+      return -1;
+    pipe_buf &b = bufs[tail % nbufs];
+    b.page = (char*)pi->va();
+    b.ref = std::move(pi);
+    b.off = off;
+    b.len = len;
+    publish(len);
+    return len;
+  }
+
+  // Add references to the page cache pages holding up to n bytes of m at
+  // off, without copying them.  Returns the number of bytes spliced, 0
+  // at the end of the file.
+  virtual ssize_t splice_from(sref<mnode> m, u64 off, size_t n) override {
+    if (!readopen)
+      return -1;
+
+    auto wl = wlock.guard();
+    auto pass = scoped_cleanup([this](){ pass_slot(); });
+    mfile *mf = m->as_file();
+    u64 end = off + n;
+    size_t done = 0;
+    // Read the range in with a single clustered read.
+    mf->get_page(off / PGSIZE, (PGROUNDUP(end) - PGROUNDDOWN(off)) / PGSIZE);
+    while (off + done < end) {
+      u64 pos = off + done;
+      u64 pgbase = PGROUNDDOWN(pos);
+      mfile::page_state ps = mf->get_page(pgbase / PGSIZE);
+      sref<page_info> pi = ps.get_page_info();
+      if (!pi)
+        break;
+      if (ps.is_partial_page()) {
+        u64 msize = *mf->read_size();
+        if (end > msize)
+          end = msize;
+        if (pos >= end)
           break;
-        }
       }
+      u32 pgoff = pos - pgbase;
+      u32 k = std::min(end - pgbase, (u64)PGSIZE) - pgoff;
+
+      if (!wait_slot(&wl))
+        return done ? done : -1;
+      pipe_buf &b = bufs[tail % nbufs];
+      b.page = (char*)pi->va();
+      b.ref = std::move(pi);
+      b.off = pgoff;
+      b.len = k;
+      publish(k);
+      done += k;
     }
+    return done;
+  }
 
-    scoped_acquire l(&lock);
-    while(nread == nwrite) {
+  // Wait until there is data to read.  Caller must hold rlock, which
+  // may be dropped and re-acquired.  Returns 1 if there is data, 0 at
+  // end of file, and -1 on error.
+  int wait_data(lock_guard<sleeplock> *rl) {
+    for (;;) {
+      size_t nr = nread.load(std::memory_order_relaxed);
+      if (nwrite.load(std::memory_order_acquire) != nr)
+        return 1;
       if (nonblock || myproc()->killed)
         return -1;
-      scoped_acquire lclose(&lock_close);
-      if (writeopen == 0)
+      // The writer may have written its last bytes before closing.
+      if (!writeopen && nwrite == nr)
         return 0;
-      empty.sleep(&lock, &lock_close);
+
+      rl->release();
+      {
+        scoped_acquire l(&lock);
+        ++rsleep;
+        auto unsleep = scoped_cleanup([this](){ --rsleep; });
+        while (nwrite == nread && writeopen)
+          empty.sleep(&lock);
+      }
+      *rl = rlock.guard();
     }
-    int i;
-    for(i = 0; i < n; i++) { 
-      if(nread == nwrite)
+  }
+
+  // Hand up to n available bytes to consume(buf, pos, len), a segment at
+  // a time, until it takes less than it is offered.  consume returns
+  // the number of bytes it took, or -1 on error.  Caller must hold
+  // rlock and have waited for data.  Returns the number of bytes
+  // consumed, or -1 if consume failed before it took any.
+  template<class F>
+  ssize_t drain(size_t n, F consume) {
+    size_t want = std::min(nwrite.load(std::memory_order_acquire) - nread, n);
+    size_t done = 0;
+    bool freed = false, failed = false;
+    while (done < want) {
+      u64 h = head;
+      pipe_buf &b = bufs[h % nbufs];
+      u32 len = b.len.load(std::memory_order_acquire);
+      if (rpos == len) {
+        // The rest of the data must be in later buffers, so the writer
+        // has moved past this one.
+        b.clear();
+        rpos = 0;
+        head.store(h + 1);
+        freed = true;
+        continue;
+      }
+      u32 k = std::min((size_t)(len - rpos), want - done);
+      ssize_t r = consume(b, rpos, k);
+      if (r <= 0) {
+        failed = r < 0 && done == 0;
+        break;
+      }
+      rpos += r;
+      done += r;
+      if (r < k)
         break;
-      addr[i] = data[nread++ % PIPESIZE];
     }
-    if (i > 0)
-      full.wake_all();
-    return i;
+    // Free the buffer we finished if the writer won't append to it.
+    u64 h = head;
+    if (h + 1 < tail && rpos == bufs[h % nbufs].len) {
+      bufs[h % nbufs].clear();
+      rpos = 0;
+      head.store(h + 1);
+      freed = true;
+    }
+    nread += done;
+    if (freed || done)
+      wake(&full, wsleep);
+    // We may have been woken and taken only part of the data; pass the
+    // wakeup on so the next reader doesn't sleep until the next write.
+    if (nwrite.load(std::memory_order_acquire) != nread)
+      wake(&empty, rsleep);
+    return failed ? -1 : done;
+  }
+
+  virtual int read(char *addr, int n) override {
+    auto rl = rlock.guard();
+    int r = wait_data(&rl);
+    if (r <= 0)
+      return r;
+    return drain(n, [&](pipe_buf &b, u32 pos, u32 k) -> ssize_t {
+        memmove(addr, b.page + b.off + pos, k);
+        addr += k;
+        return k;
+      });
+  }
+
+  // Move up to n bytes to out: by reference to page cache pages if out is
+  // a pipe, and with a single copy otherwise.
+  virtual ssize_t splice_to(file *out, off_t *off, size_t n) override {
+    auto rl = rlock.guard();
+    int r = wait_data(&rl);
+    if (r <= 0)
+      return r;
+    struct pipe *po = out->splice_pipe();
+    if (po == this)
+      return -1;
+    return drain(n, [&](pipe_buf &b, u32 pos, u32 k) -> ssize_t {
+        if (po && b.ref)
+          return po->push_page(b.ref, b.off + pos, k);
+        const char *p = b.page + b.off + pos;
+        if (!off)
+          return out->write(p, k);
+        ssize_t w = out->pwrite(p, k, *off);
+        if (w > 0)
+          *off += w;
+        return w;
+      });
   }
 
   virtual int close(int writable) override {
-    scoped_acquire l(&lock_close);
+    scoped_acquire l(&lock);
     if(writable){
-      writeopen = 0;
+      writeopen = false;
     } else {
-      readopen = 0;
+      readopen = false;
     }
     empty.wake_all();
-    if(readopen == 0 && writeopen == 0){
+    full.wake_all();
+    if(readopen == false && writeopen == false){
       return 1;
     }
     return 0;
@@ -163,3 +456,15 @@ piperead(struct pipe *p, char *addr, int n)
 {
   return p->read(addr, n);
 }
+
+ssize_t
+pipesplicein(struct pipe *p, sref<mnode> m, u64 off, size_t n)
+{
+  return p->splice_from(m, off, n);
+}
+
+ssize_t
+pipespliceout(struct pipe *p, file *out, off_t *off, size_t n)
+{
+  return p->splice_to(out, off, n);
+}
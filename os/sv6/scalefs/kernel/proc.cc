@@ -34,9 +34,8 @@ enum { sched_debug = 0 };
 
 proc::proc(int npid) :
   kstack(0), pid(npid), parent(0), tf(0), context(0), killed(0),
-  tsc(0), curcycles(0), cpuid(0), fpu_state(nullptr),
-  cpu_pin(0), oncv(0), cv_wakeup(0),
-  futex_lock("proc::futex_lock", LOCKSTAT_PROC),
+  tsc(0), curcycles(0), runqtsc(0), cpuid(0), fpu_state(nullptr),
+  cpu_pin(0), sched_class(SCHED_CLASS_NORMAL), oncv(0), cv_wakeup(0),
   user_fs_(0), unmap_tlbreq_(0), data_cpuid(-1), in_exec_(0), 
   uaccess_(0), yield_(false),
   upath(nullptr), uargv(nullptr),
@@ -108,6 +107,25 @@ proc::set_cpu_pin(int cpu)
   return 0;
 }
 
+// Move the current proc to scheduler class cls and return its old class.
+int
+proc::set_sched_class(int cls)
+{
+  if (cls < 0 || cls >= SCHED_NCLASS)
+    return -1;
+
+  scoped_acquire x(&lock);
+  if (myproc() != this)
+    panic("set_sched_class not implemented for non-current proc");
+  // We're the current proc, so we're not on a runq.
+  int old = sched_class;
+  sched_class = cls;
+  // Let more important threads that are waiting run now.
+  if (cls > old)
+    yield_ = true;
+  return old;
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
@@ -407,6 +425,7 @@ doclone(clone_flags flags)
   np->parent = myproc();
   *np->tf = *myproc()->tf;
   np->cpu_pin = myproc()->cpu_pin;
+  np->sched_class = myproc()->sched_class;
   np->data_cpuid = myproc()->data_cpuid;
   np->run_cpuid_ = myproc()->run_cpuid_;
   np->user_fs_ = myproc()->user_fs_;
@@ -124,14 +124,14 @@ mfs_interface::initialize_file(sref<mnode> m)
   resizer.initialize_from_disk(i->size);
 }
 
-// Reads in a file page from the disk.
+// Reads in a run of consecutive file pages from the disk.
 int
-mfs_interface::load_file_page(u64 mfile_mnum, char *p, size_t pos,
-		              size_t nbytes)
+mfs_interface::load_file_pages(u64 mfile_mnum, char **pages, size_t pos,
+                               size_t nbytes)
 {
   scoped_gc_epoch e;
-  sref<inode> i = get_inode(mfile_mnum, "load_file_page");
-  return readi(i, p, pos, nbytes);
+  sref<inode> i = get_inode(mfile_mnum, "load_file_pages");
+  return readi_pages(i, pages, pos, nbytes);
 }
 
 // Reads the on-disk file size.
@@ -169,14 +169,14 @@ mfs_interface::prepare_sync_file_pages(u64 mfile_mnum, transaction *tr)
   return ip;
 }
 
-// Flushes out the contents of an in-memory file page to the disk.
+// Flushes out the contents of a run of consecutive in-memory file pages to the
+// disk.
 int
-mfs_interface::sync_file_page(sref<inode> ip, char *p, size_t pos,
-                              size_t nbytes, transaction *tr)
+mfs_interface::sync_file_pages(sref<inode> ip, char **pages, size_t pos,
+                               size_t nbytes, transaction *tr)
 {
   scoped_gc_epoch e;
-  // writeback = true, lazy_trans_update = true, dont_cache = true.
-  return writei(ip, p, pos, nbytes, tr, true, true, true);
+  return writei_pages(ip, pages, pos, nbytes, tr);
 }
 
 void
@@ -841,6 +841,12 @@ mfs_interface::add_op_to_transaction_queue(mfs_operation *op, int cpu,
 // is aborted if renames are encountered (i.e., operations are not cancelled
 // across renames).
 //
+// The link operations seen so far are indexed by name, so every unlink finds
+// the link it cancels in O(1) time, and the absorbed operations are removed
+// from the operation_vec in a single pass at the end. This keeps the cost
+// linear in the number of operations up to the first rename, even when the
+// log is full of short-lived files.
+//
 // TODO: Perform absorption across file renames that don't cross directory
 // boundaries.
 //
@@ -849,13 +855,41 @@ void
 mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
                                        std::vector<u64> &absorb_mnum_list)
 {
-  std::vector<unsigned long> erase_indices;
-  u64 htable_size = mfs_log->operation_vec.size() * 5;
+  auto &ops = mfs_log->operation_vec;
+  auto last = ops.begin();
+  u64 nlinks = 0;
+  bool absorbed = false;
+
+  // Size the index by the number of link operations that we could possibly
+  // absorb.
+  for (; last != ops.end(); last++) {
+    switch ((*last)->operation_type) {
+
+    case MFS_OP_LINK_FILE:
+      nlinks++;
+      continue;
+
+    case MFS_OP_RENAME_LINK_FILE:
+    case MFS_OP_RENAME_LINK_DIR:
+    case MFS_OP_RENAME_UNLINK_FILE:
+    case MFS_OP_RENAME_UNLINK_DIR:
+    case MFS_OP_RENAME_BARRIER:
+      // Don't absorb operations across a rename boundary.
+      break;
+
+    default:
+      continue;
+    }
+    break;
+  }
+
+  if (!nlinks)
+    return;
+
   auto linkname_to_index =
-                   new chainhash<strbuf<DIRSIZ>, unsigned long>(htable_size);
+                   new chainhash<strbuf<DIRSIZ>, unsigned long>(nlinks * 2);
 
-  for (auto it = mfs_log->operation_vec.begin();
-       it != mfs_log->operation_vec.end(); it++) {
+  for (auto it = ops.begin(); it != last; it++) {
 
     switch ((*it)->operation_type) {
 
@@ -863,7 +897,7 @@ mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
       {
         auto link_op = dynamic_cast<mfs_operation_link*>(*it);
         strbuf<DIRSIZ> name(link_op->name);
-        linkname_to_index->insert(name, it - mfs_log->operation_vec.begin());
+        linkname_to_index->insert(name, it - ops.begin());
       }
       break;
 
@@ -873,9 +907,9 @@ mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
         auto unlink_op = dynamic_cast<mfs_operation_unlink*>(*it);
         strbuf<DIRSIZ> name(unlink_op->name);
         if (linkname_to_index->lookup(name, &index)) {
-          // Mark these link and unlink ops for absorption.
-          erase_indices.push_back(it - mfs_log->operation_vec.begin());
-          erase_indices.push_back(index);
+          // The name may be linked again later on, and that link must not be
+          // cancelled against this unlink.
+          linkname_to_index->remove(name);
 
           dec_mfslog_linkcount(unlink_op->mnode_mnum);
           if (!get_mfslog_linkcount(unlink_op->mnode_mnum)) {
@@ -888,37 +922,36 @@ mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
 	    // otherwise.
             absorb_mnum_list.push_back(unlink_op->mnode_mnum);
           }
+
+          // Absorb this link and unlink pair.
+          delete ops[index];
+          ops[index] = nullptr;
+          delete *it;
+          *it = nullptr;
+          absorbed = true;
         }
       }
       break;
 
-    case MFS_OP_RENAME_LINK_FILE:
-    case MFS_OP_RENAME_LINK_DIR:
-    case MFS_OP_RENAME_UNLINK_FILE:
-    case MFS_OP_RENAME_UNLINK_DIR:
-    case MFS_OP_RENAME_BARRIER:
-      // Don't absorb operations across a rename boundary.
-      goto out;
-
     default:
       continue;
     }
   }
 
-out:
-  std::sort(erase_indices.begin(), erase_indices.end(),
-            std::greater<unsigned long>());
+  delete linkname_to_index;
 
-  for (auto &idx : erase_indices) {
-    mfs_operation *op = mfs_log->operation_vec.at(idx);
-    delete op;
-    mfs_log->operation_vec.erase(mfs_log->operation_vec.begin() + idx);
-  }
+  if (!absorbed)
+    return;
 
-  delete linkname_to_index;
+  // Squeeze out the absorbed operations.
+  auto dst = ops.begin();
+  for (auto it = ops.begin(); it != ops.end(); it++) {
+    if (*it)
+      *dst++ = *it;
+  }
+  ops.erase(dst, ops.end());
 }
 
-
 // Given an mnode whose last link-unlink pair was absorbed, absorb its 'create'
 // operation if it has not yet been flushed, and delete the inode from the disk
 // otherwise.
@@ -1017,6 +1050,14 @@ mfs_interface::process_ops_from_oplog(
   // Synchronize the oplog loggers.
   auto guard = mfs_log->synchronize_upto_tsc(max_tsc);
 
+  // Operations that have been picked up (or dropped) are removed from the
+  // front of the operation_vec in bulk, by erase_consumed(), instead of
+  // one at a time.
+  auto it = mfs_log->operation_vec.begin();
+  auto erase_consumed = [&]() {
+    it = mfs_log->operation_vec.erase(mfs_log->operation_vec.begin(), it);
+  };
+
   if (mfs_log->operation_vec.empty()) {
     retval = RET_DONE;
     goto out;
@@ -1026,21 +1067,21 @@ mfs_interface::process_ops_from_oplog(
   // operation of the mnode. In all other cases, we process all the operations
   // in the mfs_log (upto and including max_tsc).
   if (count == 1) {
-    auto it = mfs_log->operation_vec.begin();
     auto create_op = dynamic_cast<mfs_operation_create*>(*it);
     if (create_op) {
       op_vec.push_back({*it, false});
-      mfs_log->operation_vec.erase(it);
+      it++;
     }
     retval = RET_DONE;
     goto out;
   }
 
-  if (mfs_log->operation_vec.size() > 1)
+  if (mfs_log->operation_vec.size() > 1) {
     absorb_file_link_unlink(mfs_log, absorb_mnum_list);
+    it = mfs_log->operation_vec.begin();
+  }
 
-  for (auto it = mfs_log->operation_vec.begin();
-       it != mfs_log->operation_vec.end() && (*it)->timestamp <= max_tsc; ) {
+  while (it != mfs_log->operation_vec.end() && (*it)->timestamp <= max_tsc) {
 
     switch ((*it)->operation_type) {
 
@@ -1074,7 +1115,7 @@ mfs_interface::process_ops_from_oplog(
             if (m && m->is_dirty())
               m->dirty(false);
             op_vec.push_back({*it, false});
-            it = mfs_log->operation_vec.erase(it);
+            it++;
             continue;
           }
 
@@ -1093,7 +1134,8 @@ mfs_interface::process_ops_from_oplog(
         auto rename_barrier_op = dynamic_cast<mfs_operation_rename_barrier*>(*it);
         if (rename_barrier_op->mnode_mnum == root_mnum) {
           // Nothing to be done.
-          it = mfs_log->operation_vec.erase(it);
+          it++;
+          erase_consumed();
 
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
@@ -1113,7 +1155,8 @@ mfs_interface::process_ops_from_oplog(
             timestamp == rename_barrier_stack.back().timestamp) {
           // Already processed.
           rename_barrier_stack.pop_back();
-          it = mfs_log->operation_vec.erase(it);
+          it++;
+          erase_consumed();
 
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
@@ -1160,7 +1203,7 @@ mfs_interface::process_ops_from_oplog(
 #else
           op_vec.push_back({rename_link_op, true});
 #endif
-          it = mfs_log->operation_vec.erase(it);
+          it++;
 
           // The very next operation in this oplog *has* to be the corresponding
           // rename_unlink_op.
@@ -1173,7 +1216,8 @@ mfs_interface::process_ops_from_oplog(
 #else
           op_vec.push_back({r_unlink_op, true});
 #endif
-          it = mfs_log->operation_vec.erase(it);
+          it++;
+          erase_consumed();
 
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
@@ -1208,8 +1252,8 @@ mfs_interface::process_ops_from_oplog(
           op_vec.push_back({rename_unlink_op, true});
 #endif
 
-          it = mfs_log->operation_vec.erase(it);
-          it = mfs_log->operation_vec.erase(it);
+          it += 2;
+          erase_consumed();
 
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
@@ -1267,13 +1311,16 @@ mfs_interface::process_ops_from_oplog(
     }
 
     op_vec.push_back({*it, false});
-    it = mfs_log->operation_vec.erase(it);
+    it++;
   }
 
+  erase_consumed();
   assert(mfs_log->operation_vec.empty() ||
          mfs_log->operation_vec.front()->timestamp > max_tsc);
 
 out:
+  erase_consumed();
+
   if (retval == RET_INVALID)
     retval = RET_DONE;
 
@@ -1590,9 +1637,14 @@ mfs_interface::post_process_transaction(transaction *tr)
   tr->deduplicate_freeinum_list();
 
   // Now that the transaction has been committed, mark the freed blocks as
-  // free in the in-memory free-bit-vector.
-  for (auto &f : tr->free_block_list)
-    free_block(f);
+  // free in the in-memory free-bit-vector. The free_block_list is sorted by
+  // now, so hand them over a contiguous run at a time.
+  for (auto f = tr->free_block_list.begin(); f != tr->free_block_list.end(); ) {
+    u32 bno = *f, n = 1;
+    for (++f; f != tr->free_block_list.end() && *f == bno + n; ++f)
+      n++;
+    free_blocks(bno, n);
+  }
 
   // Make the freed inode numbers available again for reuse.
   for (auto &inum : tr->free_inum_list)
@@ -1618,7 +1670,7 @@ mfs_interface::apply_trans_on_disk(transaction *tr)
 void
 mfs_interface::commit_transaction_to_disk(int cpu, transaction *trans)
 {
-  ilock(sv6_journal[cpu], WRITELOCK);
+  fs_journal[cpu]->write_lock.acquire();
 
   // Write the transaction's start block and the data blocks to the on-disk
   // journal.
@@ -1627,7 +1679,7 @@ mfs_interface::commit_transaction_to_disk(int cpu, transaction *trans)
 
   // Commit the transaction to the on-disk journal with the given timestamp.
   write_journal_commit_block(trans->commit_tsc, cpu);
-  iunlock(sv6_journal[cpu]);
+  fs_journal[cpu]->write_lock.release();
 
   post_process_transaction(trans);
 
@@ -1693,8 +1745,8 @@ mfs_interface::commit_all_transactions(int cpu)
 
       if (!fits_in_journal(blocks_size, cpu)) {
         cprintf("fits_in_journal failed, blocks-size %lu cpu %d "
-                "journal offset %d limit %lu\n", blocks_size, cpu,
-                fs_journal[cpu]->current_offset(), PHYS_JOURNAL_SIZE);
+                "journal offset %d limit %u\n", blocks_size, cpu,
+                fs_journal[cpu]->current_offset(), fs_journal[cpu]->size());
       }
       assert(fits_in_journal(blocks_size, cpu));
     }
@@ -1740,8 +1792,8 @@ mfs_interface::commit_all_transactions(int cpu)
 
         if (!fits_in_journal(trans->blocks.size(), cpu)) {
           cprintf("fits_in_journal failed, blocks-size %lu cpu %d "
-                  "journal offset %d limit %lu\n", trans->blocks.size(), cpu,
-                  fs_journal[cpu]->current_offset(), PHYS_JOURNAL_SIZE);
+                  "journal offset %d limit %u\n", trans->blocks.size(), cpu,
+                  fs_journal[cpu]->current_offset(), fs_journal[cpu]->size());
         }
         assert(fits_in_journal(trans->blocks.size(), cpu));
 
@@ -1868,14 +1920,14 @@ mfs_interface::apply_all_transactions(int cpu)
     if (group_apply)
       tr->deduplicate_blocks();
 
-    ilock(sv6_journal[dep_cpu], WRITELOCK);
+    fs_journal[dep_cpu]->write_lock.acquire();
 
     apply_transaction_to_disk(dep_cpu, tr);
 
     assert(tr->commit_tsc > fs_journal[dep_cpu]->last_applied_commit_tsc);
     fs_journal[dep_cpu]->last_applied_commit_tsc = tr->commit_tsc;
 
-    iunlock(sv6_journal[dep_cpu]);
+    fs_journal[dep_cpu]->write_lock.release();
 
     if (fs_journal[dep_cpu]->get_applied_tsc() >= dep_tsc)
       dependent_txq.pop_back();
@@ -1887,9 +1939,9 @@ mfs_interface::apply_all_transactions(int cpu)
         continue;
     }
 
-    ilock(sv6_journal[dep_cpu], WRITELOCK);
+    fs_journal[dep_cpu]->write_lock.acquire();
     reset_journal(dep_cpu);
-    iunlock(sv6_journal[dep_cpu]);
+    fs_journal[dep_cpu]->write_lock.release();
   }
 }
 
@@ -1976,45 +2028,75 @@ print_all_txq_stats()
   rootfs_interface->print_txq_stats();
 }
 
+// Number of address blocks needed to hold the block numbers of a transaction
+// with ndatablocks data blocks, after filling up the start block.
+static u32
+num_addr_blocks(size_t ndatablocks)
+{
+  u32 nslots_startblk = sizeof(((mfs_interface::journal_header *)0)->blocknums)
+                        / sizeof(u32);
+  u32 nslots_addrblk = sizeof(mfs_interface::journal_addr_block) / sizeof(u32);
+
+  if (ndatablocks <= nslots_startblk)
+    return 0;
+  return (ndatablocks - nslots_startblk + nslots_addrblk - 1) / nslots_addrblk;
+}
+
 bool
 mfs_interface::fits_in_journal(size_t num_trans_blocks, int cpu)
 {
   // Estimate the space requirements of this transaction in the journal.
 
   // Check if we can fit num_trans_blocks disk blocks of the transaction
-  // as well as the start and commit blocks in the journal. (And also an
-  // additional address block if necessary).
+  // as well as the start and commit blocks in the journal. (And also the
+  // address blocks, if necessary).
 
   u64 trans_size = num_trans_blocks * BSIZE + 2 * sizeof(journal_header_block)
-                   + sizeof(journal_addr_block);
+                   + num_addr_blocks(num_trans_blocks) * sizeof(journal_addr_block);
 
-  if (trans_size > PHYS_JOURNAL_SIZE)
+  if (trans_size > fs_journal[cpu]->size())
     return false;
 
-  if (fs_journal[cpu]->current_offset() + trans_size > PHYS_JOURNAL_SIZE)
+  if (fs_journal[cpu]->current_offset() + trans_size > fs_journal[cpu]->size())
     return false;
 
   return true;
 }
 
+// Append a block to the journal, as part of transaction tr.
 void
 mfs_interface::write_journal(char *buf, size_t size, transaction *tr, int cpu)
 {
   u32 offset = fs_journal[cpu]->current_offset();
 
-  // Make sure we are writing BSIZE bytes at BSIZE-aligned offsets, so that
-  // we can skip reading the disk within writei().
   assert(offset % BSIZE == 0 && size == BSIZE);
-  assert(writei(sv6_journal[cpu], buf, offset, size, tr) == size);
+  tr->add_block(fs_journal[cpu]->offset_to_blknum(offset), buf);
 
   offset += size;
   fs_journal[cpu]->update_offset(offset);
 }
 
+// Read the next block from the journal. Uses synchronous disk I/O, since this
+// is only called during crash-recovery at early boot.
+bool
+mfs_interface::read_journal(char *buf, size_t size, int cpu)
+{
+  u32 offset = fs_journal[cpu]->current_offset();
+
+  assert(offset % BSIZE == 0 && size == BSIZE);
+  if (offset + size > fs_journal[cpu]->size())
+    return false;
+
+  disk_read(1, buf, size, (u64)fs_journal[cpu]->offset_to_blknum(offset) * BSIZE);
+
+  fs_journal[cpu]->update_offset(offset + size);
+  return true;
+}
+
 // Write a transaction's disk blocks to the on-disk journal. The only thing
 // remaining to write to the journal on the disk after this function returns,
 // would be the commit block.
-// Caller must hold ilock for write on sv6_journal.
+// Caller must hold the journal's write_lock.
 void
 mfs_interface::write_journal_transaction_blocks(
     const std::vector<transaction_diskblock*> &datablocks,
@@ -2023,7 +2105,6 @@ mfs_interface::write_journal_transaction_blocks(
   journal_header_block hdr_start;
   journal_addr_block hdr_addr;
   memset(&hdr_start, 0, sizeof(hdr_start));
-  memset(&hdr_addr, 0, sizeof(hdr_addr));
   hdr_start.timestamp = timestamp;
   hdr_start.header_type = JOURNAL_TXN_START;
 
@@ -2031,33 +2112,24 @@ mfs_interface::write_journal_transaction_blocks(
   u32 nslots_startblk = sizeof(hdr_start.blocknums) / sizeof(u32);
   u32 nslots_addrblk = sizeof(hdr_addr.blocknums) / sizeof(u32);
 
-  assert(datablocks.size() <= nslots_startblk + nslots_addrblk);
+  // Fill the addresses in the start block itself, as far as possible, and use
+  // as many dedicated address blocks as it takes for the rest.
+  hdr_start.num_addr_blocks = num_addr_blocks(datablocks.size());
+  for (u32 i = 0; i < datablocks.size() && i < nslots_startblk; i++)
+    hdr_start.blocknums[i] = datablocks[i]->blocknum;
 
-  int count = 0;
-  for (auto it = datablocks.begin(); it != datablocks.end(); it++, count++) {
-
-    // Fill the addresses in the start block itself, as far as possible, and use
-    // the dedicated address block if it spills over. We won't need more than 1
-    // address block, because our journal size is about 4 MB, which limits the
-    // number of data blocks for any transaction to about 1024 or so (roughly).
-    if (count < nslots_startblk)
-      hdr_start.blocknums[count] = (*it)->blocknum;
-    else
-      hdr_addr.blocknums[count - nslots_startblk] = (*it)->blocknum;
-  }
-
-  if (datablocks.size() > nslots_startblk)
-    hdr_start.num_addr_blocks = 1;
-
-  // Write out the start block, (the addr block) and the data blocks.
+  // Write out the start block, the address blocks and the data blocks.
 
   transaction *jrnl_trans = new transaction();
 
   write_journal((char *)&hdr_start, sizeof(hdr_start), jrnl_trans, cpu);
 
-  // Write out the address block(s), if we have any.
-  if (hdr_start.num_addr_blocks)
+  for (u32 i = nslots_startblk; i < datablocks.size(); i += nslots_addrblk) {
+    memset(&hdr_addr, 0, sizeof(hdr_addr));
+    for (u32 j = 0; j < nslots_addrblk && i + j < datablocks.size(); j++)
+      hdr_addr.blocknums[j] = datablocks[i + j]->blocknum;
     write_journal((char *)&hdr_addr, sizeof(hdr_addr), jrnl_trans, cpu);
+  }
 
   // Write out the data blocks themselves to the in-memory journal.
   for (auto &b : datablocks)
@@ -2074,7 +2146,7 @@ mfs_interface::write_journal_transaction_blocks(
   delete jrnl_trans;
 }
 
-// Caller must hold ilock for write on sv6_journal.
+// Caller must hold the journal's write_lock.
 void
 mfs_interface::write_journal_commit_block(u64 timestamp, int cpu)
 {
@@ -2087,7 +2159,7 @@ mfs_interface::write_journal_commit_block(u64 timestamp, int cpu)
   delete jrnl_trans;
 }
 
-// Caller must hold ilock for write on sv6_journal.
+// Caller must hold the journal's write_lock.
 void
 mfs_interface::write_journal_skip_block(u64 timestamp, int cpu,
                                         bool use_async_io)
@@ -2112,13 +2184,10 @@ mfs_interface::get_txn_skip_block(int cpu, u64 *skip_upto_tsc)
 {
   static char skipbuf[BSIZE], zerobuf[BSIZE];
   size_t hdr_size = sizeof(journal_header_block);
-  u32 offset = fs_journal[cpu]->current_offset();
 
-  if (readi(sv6_journal[cpu], skipbuf, offset, hdr_size) != hdr_size)
+  if (!read_journal(skipbuf, hdr_size, cpu))
     return false;
 
-  fs_journal[cpu]->update_offset(offset + hdr_size);
-
   if (!memcmp((void *)skipbuf, zerobuf, hdr_size))
     return false;
 
@@ -2136,13 +2205,10 @@ mfs_interface::get_txn_start_block(int cpu)
 {
   static char startbuf[BSIZE];
   size_t hdr_size = sizeof(journal_header_block);
-  u32 offset = fs_journal[cpu]->current_offset();
 
-  if (readi(sv6_journal[cpu], startbuf, offset, hdr_size) != hdr_size)
+  if (!read_journal(startbuf, hdr_size, cpu))
     return nullptr;
 
-  fs_journal[cpu]->update_offset(offset + hdr_size);
-
   journal_header *hdstartptr = (journal_header *)startbuf;
 
   if (hdstartptr->header_type != JOURNAL_TXN_START)
@@ -2156,24 +2222,34 @@ mfs_interface::get_txn_data_blocks(int cpu, journal_header *hdstartptr,
                                    transaction *trans)
 {
   static char databuf[BSIZE];
-  u32 offset = fs_journal[cpu]->current_offset();
-  int num_blks = sizeof(hdstartptr->blocknums) / sizeof(u32);
-  u32 datablock_offset = hdstartptr->num_addr_blocks ?
-                         offset + sizeof(journal_addr_block) : offset;
+  static journal_addr_block addrbuf;
+  std::vector<u32> blocknums;
+  u32 nslots_startblk = sizeof(hdstartptr->blocknums) / sizeof(u32);
+  u32 nslots_addrblk = sizeof(addrbuf.blocknums) / sizeof(u32);
 
-  for (int i = 0; i < num_blks && hdstartptr->blocknums[i]; i++) {
+  // Gather the block numbers from the start block and the address blocks.
+  for (u32 i = 0; i < nslots_startblk && hdstartptr->blocknums[i]; i++)
+    blocknums.push_back(hdstartptr->blocknums[i]);
+
+  for (u32 a = 0; a < hdstartptr->num_addr_blocks; a++) {
+    if (!read_journal((char *)&addrbuf, sizeof(addrbuf), cpu)) {
+      delete trans;
+      return false;
+    }
+
+    for (u32 i = 0; i < nslots_addrblk && addrbuf.blocknums[i]; i++)
+      blocknums.push_back(addrbuf.blocknums[i]);
+  }
 
-    if (readi(sv6_journal[cpu], databuf, datablock_offset, BSIZE) != BSIZE) {
+  for (auto &bno : blocknums) {
+    if (!read_journal(databuf, BSIZE, cpu)) {
       delete trans;
       return false;
     }
 
-    datablock_offset += BSIZE;
-    trans->add_block(hdstartptr->blocknums[i], databuf);
+    trans->add_block(bno, databuf);
   }
 
-  assert(!hdstartptr->num_addr_blocks); // TODO: Handle this case later.
-  fs_journal[cpu]->update_offset(datablock_offset);
   return true;
 }
 
@@ -2182,15 +2258,12 @@ mfs_interface::get_txn_commit_block(int cpu, transaction *trans)
 {
   static char commitbuf[BSIZE];
   size_t hdr_size = sizeof(journal_header_block);
-  u32 offset = fs_journal[cpu]->current_offset();
 
-  if (readi(sv6_journal[cpu], commitbuf, offset, hdr_size) != hdr_size) {
+  if (!read_journal(commitbuf, hdr_size, cpu)) {
     delete trans;
     return false;
   }
 
-  fs_journal[cpu]->update_offset(offset + hdr_size);
-
   journal_header *hdcommitptr = (journal_header *)commitbuf;
 
   if (hdcommitptr->header_type != JOURNAL_TXN_COMMIT ||
@@ -2208,20 +2281,20 @@ mfs_interface::get_txn_commit_block(int cpu, transaction *trans)
 void
 mfs_interface::recover_journal(int cpu, std::vector<transaction*> &trans_vec)
 {
-  char jrnl_name[32];
-  snprintf(jrnl_name, sizeof(jrnl_name), "/sv6journal%d", cpu);
-  sv6_journal[cpu] = namei(sref<inode>(), jrnl_name);
-  assert(sv6_journal[cpu]);
+  superblock sb;
+  get_superblock(&sb);
+  fs_journal[cpu]->set_location(sb.journal_blknums[cpu].start_blknum,
+                                sb.journal_blknums[cpu].end_blknum);
 
   bool dont_apply;
   u64 last_tsc = 0, skip_upto_tsc = 0;
 
-  ilock(sv6_journal[cpu], WRITELOCK);
+  auto write_guard = fs_journal[cpu]->write_lock.guard();
 
   if (!get_txn_skip_block(cpu, &skip_upto_tsc))
     goto out;
 
-  while (fs_journal[cpu]->current_offset() < PHYS_JOURNAL_SIZE) {
+  while (fs_journal[cpu]->current_offset() < fs_journal[cpu]->size()) {
     dont_apply = false;
 
     journal_header *hdstartptr = get_txn_start_block(cpu);
@@ -2254,29 +2327,149 @@ mfs_interface::recover_journal(int cpu, std::vector<transaction*> &trans_vec)
   }
 
 out:
-  iunlock(sv6_journal[cpu]);
+  return;
+}
+
+// Applies the transactions recovered from all the journals to the disk, where
+// trans_vecs[cpu] holds the transactions recovered from journal 'cpu' in
+// increasing timestamp order. The transactions are merged in timestamp order,
+// but rather than writing out each one in turn, we only write the final
+// contents of every block (i.e., the one from the latest transaction that
+// touched it), in increasing block order and in batches of contiguous blocks.
+// The bufcache is updated along the way.
+//
+// Called during early boot, so this uses synchronous disk I/O only.
+void
+mfs_interface::apply_recovered_transactions(std::vector<transaction*> *trans_vecs)
+{
+  struct recovered_block {
+    u32 blocknum;
+    u32 seq; // Position of the transaction in timestamp order.
+    transaction_diskblock *db;
+  };
+
+  std::vector<transaction*> merged;
+  std::vector<recovered_block> rblocks;
+  size_t next[NCPU];
+
+  // k-way merge of the per-journal transaction lists, each of which is
+  // already sorted by timestamp.
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    next[cpu] = 0;
+
+  for (;;) {
+    int min_cpu = -1;
+
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+      if (next[cpu] == trans_vecs[cpu].size())
+        continue;
+      if (min_cpu < 0 || journal::compare_txn_tsc(trans_vecs[cpu][next[cpu]],
+                                      trans_vecs[min_cpu][next[min_cpu]]))
+        min_cpu = cpu;
+    }
+
+    if (min_cpu < 0)
+      break;
+
+    transaction *tr = trans_vecs[min_cpu][next[min_cpu]++];
+    cprintf("recover_scalefs: applying transaction with commit timestamp %lu\n",
+            tr->commit_tsc);
+
+    tr->deduplicate_blocks();
+    for (auto &db : tr->blocks)
+      rblocks.push_back(recovered_block { db->blocknum, (u32)merged.size(), db });
+    merged.push_back(tr);
+  }
+
+  // Order the blocks by (blocknum, seq), so that the last one in every run of
+  // the same blocknum is the version that must end up on the disk.
+  std::sort(rblocks.begin(), rblocks.end(),
+            [](const recovered_block &a, const recovered_block &b) {
+              if (a.blocknum == b.blocknum)
+                return a.seq < b.seq;
+              return a.blocknum < b.blocknum;
+            });
+
+  std::vector<kiovec> iov;
+  u32 batch_start = 0, nwritten = 0;
+  iov.reserve(SG_IO_SIZE/BSIZE);
+
+  auto flush_batch = [&]() {
+    if (iov.empty())
+      return;
+    disk_writev(1, &iov[0], iov.size(), (u64)batch_start * BSIZE);
+    nwritten += iov.size();
+    iov.clear();
+  };
+
+  for (auto rb = rblocks.begin(); rb != rblocks.end(); rb++) {
+    if ((rb+1) != rblocks.end() && (rb+1)->blocknum == rb->blocknum)
+      continue; // Overwritten by a later transaction.
+
+    sref<buf> bp = buf::get(1, rb->blocknum, true);
+    {
+      auto locked = bp->write();
+      memmove(locked->data, rb->db->blockdata, BSIZE);
+    }
+
+    // Batches never straddle an SG_IO_SIZE-aligned boundary, so they also
+    // stay within a single disk stripe when using multiple disks.
+    if (!iov.empty() &&
+        (rb->blocknum != batch_start + iov.size() ||
+         rb->blocknum % (SG_IO_SIZE/BSIZE) == 0))
+      flush_batch();
+
+    if (iov.empty())
+      batch_start = rb->blocknum;
+    iov.push_back(kiovec { rb->db->blockdata, BSIZE });
+  }
+  flush_batch();
+
+  // Make sure the blocks are durable before the journals get reset.
+  if (nwritten) {
+    for (u32 d = 0; d < num_disks(); d++)
+      disk_flush(d);
+  }
+
+  if (!merged.empty())
+    cprintf("recover_scalefs: applied %lu transactions, wrote %u of %lu "
+            "logged blocks\n", merged.size(), nwritten, rblocks.size());
+
+  for (auto &tr : merged)
+    delete tr;
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    trans_vecs[cpu].clear();
 }
 
 void
 mfs_interface::init_journal(int cpu)
 {
+  static char zerobuf[BSIZE];
+  kiovec iov[SG_IO_SIZE/BSIZE];
+
   fs_journal[cpu]->update_offset(0);
   write_journal_skip_block(0, cpu, false); // Use synchronous I/O.
 
-  journal_header_block hdr_zero;
+  // Zero out the rest of the journal, a stripe (SG_IO_SIZE) at a time.  All
+  // of it has to go: timestamps come from the TSC, which restarts at every
+  // boot, so a stale transaction left past the write frontier would look
+  // newer than the ones this boot commits and get replayed after a crash.
+  for (u32 i = 0; i < SG_IO_SIZE/BSIZE; i++)
+    iov[i] = kiovec { zerobuf, BSIZE };
 
-  memset((char *)&hdr_zero, 0, sizeof(hdr_zero));
+  for (u32 off = BSIZE; off < fs_journal[cpu]->size(); ) {
+    u32 bno = fs_journal[cpu]->offset_to_blknum(off);
+    u32 n = std::min((fs_journal[cpu]->size() - off) / BSIZE,
+                     SG_IO_SIZE/BSIZE - bno % (SG_IO_SIZE/BSIZE));
 
-  while (fs_journal[cpu]->current_offset() < PHYS_JOURNAL_SIZE) {
-
-    transaction *jrnl_trans = new transaction();
-    write_journal((char *)&hdr_zero, sizeof(hdr_zero), jrnl_trans, cpu);
-
-    jrnl_trans->write_to_disk_and_flush_raw();
-    delete jrnl_trans;
+    disk_writev(1, iov, n, (u64)bno * BSIZE);
+    off += n * BSIZE;
   }
 
-  fs_journal[cpu]->update_offset(sizeof(hdr_zero));
+  for (u32 d = 0; d < num_disks(); d++)
+    disk_flush(d);
+
+  fs_journal[cpu]->update_offset(sizeof(journal_header_block));
 }
 
 // Reset the journal so that we can start writing to it again, from the
@@ -2289,7 +2482,7 @@ mfs_interface::init_journal(int cpu)
 // have a higher timestamp than the one recorded in the skip block, and hence
 // those transactions will get applied during crash-recovery.
 //
-// Caller must hold the journal lock and also ilock for write on sv6_journal.
+// Caller must hold the journal lock and also the journal's write_lock.
 void
 mfs_interface::reset_journal(int cpu)
 {
@@ -2385,49 +2578,48 @@ mfs_interface::load_root()
   return m;
 }
 
+// Boot-time thread that builds the freelists of the freeblock_bitmap stripes
+// assigned to its CPU.
+static void
+freeblock_bitmap_worker(void *arg)
+{
+  int worker = (int)(uptr)arg;
+
+  // Stripe NCPU denotes the global reserve pool.
+  for (int stripe = worker; stripe <= NCPU; stripe += ncpu)
+    rootfs_interface->init_freeblock_stripe(stripe);
+}
+
 // Initialize the freeblock_bitmap from the disk when the system boots.
+//
+// Walking the whole bitmap bit by bit on the boot CPU makes mount time grow
+// linearly with the disk size. So here we only work out how the bitmap is
+// split into per-CPU stripes (of whole bitmap blocks), and leave the scanning
+// to one thread per CPU, each of which builds the freelists of its own
+// stripes directly (see init_freeblock_stripe()).
 void
 mfs_interface::initialize_freeblock_bitmap()
 {
-  sref<buf> bp;
-  int b, bi, nbits;
   superblock sb;
-  u32 blocknum, first_free_bblock_bit = 0;
+  u32 first_free_bblock_bit = 0;
 
   get_superblock(&sb);
 
-  // Allocate the memory for the bit_vector in one shot, instead of doing it
-  // piecemeal using .push_back() in a loop.
-  freeblock_bitmap.bit_vector.reserve(sb.size);
-
-  for (b = 0; b < sb.size; b += BPB) {
-    blocknum = BBLOCK(b, sb.ninodes);
-    bp = buf::get(1, blocknum);
+  // Make note of the first bitmap block (bit) that starts with a free bit
+  // (which is an approximation that, that entire bitmap block (and all
+  // the subsequent ones) contains only free bits). That's where we'll
+  // start allocating per-CPU resources from, in order to avoid initializing
+  // CPU0 with nearly no free bits.
+  for (u32 b = 0; b < sb.size; b += BPB) {
+    sref<buf> bp = buf::get(1, BBLOCK(b, sb.ninodes));
     auto copy = bp->read();
-
-    nbits = std::min((u32)BPB, sb.size - b);
-
-    for (bi = 0; bi < nbits; bi++) {
-      int m = 1 << (bi % 8);
-      bool f = ((copy->data[bi/8] & m) == 0) ? true : false;
-
-      // Maintain a vector as well as a linked-list representation of the
-      // free-bits, to speed up freeing and allocation of blocks, respectively.
-      free_bit *bit = new free_bit(b + bi, f);
-      freeblock_bitmap.bit_vector.push_back(bit);
-
-      // Make note of the first bitmap block (bit) that starts with a free bit
-      // (which is an approximation that, that entire bitmap block (and all
-      // the subsequent ones) contains only free bits). That's where we'll
-      // start allocating per-CPU resources from (further down in the code),
-      // in order to avoid initializing CPU0 with nearly no free bits.
-      if (!first_free_bblock_bit && f && bi == 0)
-        first_free_bblock_bit = b;
+    if ((copy->data[0] & 1) == 0) {
+      first_free_bblock_bit = b;
+      break;
     }
   }
 
-  // Distribute the blocks among the CPUs and add the free blocks to the per-CPU
-  // freelists.
+  // Distribute the blocks among the CPUs.
 
   // TODO: Remove this assert and handle cases where multiple CPUs have to share
   // the same bitmap blocks.
@@ -2436,101 +2628,362 @@ mfs_interface::initialize_freeblock_bitmap()
 
   u32 nbitblocks = sb.size/BPB - first_free_bblock_bit/BPB;
   u32 bitblocks_per_cpu = nbitblocks/NCPU;
-  u32 bits_per_cpu = bitblocks_per_cpu * BPB;
 
-  for (int cpu = 0; cpu < NCPU; cpu++) {
-    auto list_lock = freeblock_bitmap.freelists[cpu].list_lock.guard();
+  freeblock_bitmap.first_free_bit = first_free_bblock_bit;
+  freeblock_bitmap.bits_per_cpu = bitblocks_per_cpu * BPB;
+
+  freeblock_bitmap.stripes_pending.store(NCPU + 1);
+
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "fbinit_%u", c);
+    threadpin(freeblock_bitmap_worker, (void*)(uptr)c, namebuf, c);
+  }
+}
+
+// Scan one stripe of the on-disk free bitmap and build its freelist. Stripes
+// 0 to NCPU-1 belong to the corresponding CPUs. Stripe NCPU is the global
+// reserve pool: it gets whatever is left over at the end of the disk, to be
+// used when a per-CPU freelist runs out (before stealing free blocks from
+// other CPUs' freelists), as well as the leftover blocks in
+// [0, first_free_bit).
+void
+mfs_interface::init_freeblock_stripe(int stripe)
+{
+  superblock sb;
+  get_superblock(&sb);
+
+  u32 first_free_bit = freeblock_bitmap.first_free_bit;
+  u32 bits_per_cpu = freeblock_bitmap.bits_per_cpu;
+  auto &fl = freeblock_bitmap.freelist_of(stripe);
+
+  auto scan = [&](u32 lo, u32 hi) {
+    for (u32 b = lo - lo % BPB; b < hi; b += BPB) {
+      sref<buf> bp = buf::get(1, BBLOCK(b, sb.ninodes));
+      auto copy = bp->read();
+      const u64 *words = (const u64 *)copy->data;
+      u32 end = std::min(hi, b + BPB);
+
+      auto list_lock = fl.list_lock.guard();
+
+      // Walk the bitmap block one 64-bit word at a time, adding runs of free
+      // bits to the freelist. put() merges them with the preceding extent.
+      for (u32 bno = std::max(lo, b); bno < end; ) {
+        u32 bi = bno - b;
+        u32 nbits = std::min(64 - bi % 64, end - bno);
+        u64 freemask = ~(words[bi / 64] >> (bi % 64));
+
+        if (nbits == 64 && (freemask == 0 || freemask == ~0ull)) {
+          if (freemask)
+            fl.put(bno, 64);
+          bno += 64;
+          continue;
+        }
+
+        for (u32 i = 0; i < nbits; i++, bno++, freemask >>= 1) {
+          if (freemask & 1)
+            fl.put(bno, 1);
+        }
+      }
+    }
+  };
+
+  if (stripe < NCPU) {
+    u32 start = first_free_bit + stripe * bits_per_cpu;
 
     if (VERBOSE)
       cprintf("Per-CPU block allocator: CPU %d   blocks [%u - %u]\n",
-              cpu, first_free_bblock_bit + cpu * bits_per_cpu,
-              first_free_bblock_bit + ((cpu+1) * bits_per_cpu) - 1);
-
-    for (u32 bno = cpu * bits_per_cpu; bno < (cpu+1) * bits_per_cpu; bno++) {
-      auto bit = freeblock_bitmap.bit_vector.at(bno + first_free_bblock_bit);
-      bit->cpu = cpu;
-      if (bit->is_free)
-        freeblock_bitmap.freelists[cpu].bit_freelist.push_back(bit);
-    }
+              stripe, start, start + bits_per_cpu - 1);
+
+    scan(start, start + bits_per_cpu);
+  } else {
+    scan(0, first_free_bit);
+    scan(first_free_bit + NCPU * bits_per_cpu, sb.size);
+  }
+
+  if (--freeblock_bitmap.stripes_pending == 0) {
+    scoped_acquire a(&freeblock_bitmap.init_lock);
+    freeblock_bitmap.init_cv.wake_all();
+  }
+}
+
+// Treap helpers for the freelists.
+typedef mfs_interface::free_extent free_extent;
+
+static u32
+extent_maxrun(free_extent *e)
+{
+  return e ? e->maxrun : 0;
+}
+
+static void
+extent_update(free_extent *e)
+{
+  e->maxrun = std::max(e->nblocks,
+                       std::max(extent_maxrun(e->left), extent_maxrun(e->right)));
+}
+
+// Split t into the extents that start before key (*l) and the rest (*r).
+static void
+extent_split(free_extent *t, u32 key, free_extent **l, free_extent **r)
+{
+  if (!t) {
+    *l = *r = nullptr;
+  } else if (t->start < key) {
+    extent_split(t->right, key, &t->right, r);
+    extent_update(t);
+    *l = t;
+  } else {
+    extent_split(t->left, key, l, &t->left);
+    extent_update(t);
+    *r = t;
   }
+}
 
-  // Build a global reserve pool of free blocks using whatever is remaining,
-  // to be used when a per-CPU freelist runs out, before stealing free blocks
-  // from other CPUs' freelists.
-  if (NCPU * bitblocks_per_cpu < nbitblocks) {
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 bno = NCPU * bits_per_cpu; bno + first_free_bblock_bit < sb.size;
-         bno++) {
-      auto bit = freeblock_bitmap.bit_vector.at(bno + first_free_bblock_bit);
-      bit->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (bit->is_free)
-        freeblock_bitmap.reserve_freelist.bit_freelist.push_back(bit);
+// Join l and r, all of whose extents start after those of l.
+static free_extent*
+extent_merge(free_extent *l, free_extent *r)
+{
+  if (!l || !r)
+    return l ? l : r;
+  if (l->prio > r->prio) {
+    l->right = extent_merge(l->right, r);
+    extent_update(l);
+    return l;
+  }
+  r->left = extent_merge(l, r->left);
+  extent_update(r);
+  return r;
+}
+
+// Return the last extent in t that starts at or before bno.
+static free_extent*
+extent_floor(free_extent *t, u32 bno)
+{
+  free_extent *best = nullptr;
+  while (t) {
+    if (t->start <= bno) {
+      best = t;
+      t = t->right;
+    } else {
+      t = t->left;
     }
   }
+  return best;
+}
 
-  // Any other leftover free bits from [0 to first_free_bblock_bit) also go
-  // to the reserve pool. Also make sure to set the CPU number for those bits
-  // irrespective of whether they are free.
-  {
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 bno = 0; bno < first_free_bblock_bit; bno++) {
-      auto bit = freeblock_bitmap.bit_vector.at(bno);
-      bit->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (bit->is_free)
-        freeblock_bitmap.reserve_freelist.bit_freelist.push_back(bit);
+// Return the first extent in t that starts after bno.
+static free_extent*
+extent_above(free_extent *t, u32 bno)
+{
+  free_extent *best = nullptr;
+  while (t) {
+    if (t->start > bno) {
+      best = t;
+      t = t->left;
+    } else {
+      t = t->right;
     }
   }
+  return best;
 }
 
-// Allocate a block from the freeblock_bitmap.
+// Return the last extent in t of at least n blocks, or null.
+static free_extent*
+extent_fit(free_extent *t, u32 n)
+{
+  while (t) {
+    if (extent_maxrun(t->right) >= n)
+      t = t->right;
+    else if (t->nblocks >= n)
+      return t;
+    else if (extent_maxrun(t->left) >= n)
+      t = t->left;
+    else
+      return nullptr;
+  }
+  return nullptr;
+}
+
+void
+mfs_interface::freeblock_bitmap::freelist::insert(u32 start, u32 nblocks)
+{
+  seed = seed * 1103515245 + 12345;
+  free_extent *e = new free_extent(start, nblocks, seed);
+  free_extent *l, *r;
+
+  extent_split(root, start, &l, &r);
+  root = extent_merge(extent_merge(l, e), r);
+  nextents++;
+}
+
+void
+mfs_interface::freeblock_bitmap::freelist::erase(free_extent *e)
+{
+  free_extent *l, *m, *r;
+
+  extent_split(root, e->start, &l, &r);
+  extent_split(r, e->start + 1, &m, &r);
+  assert(m == e && !e->left && !e->right);
+  root = extent_merge(l, r);
+  nextents--;
+  delete e;
+}
+
+// Remove the n blocks starting at bno from the extent e that contains them,
+// splitting e in two if they come from its middle.
+void
+mfs_interface::freeblock_bitmap::freelist::carve(free_extent *e, u32 bno, u32 n)
+{
+  u32 head = bno - e->start;
+  u32 tail = e->end() - (bno + n);
+  u32 start = e->start;
+
+  // Changing e in place would leave maxrun stale on the path to it, so
+  // take it out and put back what is left.
+  erase(e);
+  if (head)
+    insert(start, head);
+  if (tail)
+    insert(bno + n, tail);
+
+  nfree -= n;
+}
+
+// Allocate a run of up to 'want' contiguous blocks from this freelist and
+// return the first block of the run, with its length in *got. We pick the
+// highest extent that is large enough to hold the whole run (so that running
+// an extent dry is cheap to handle), or else the largest one. Returns 0 if the
+// freelist is empty.
 u32
-mfs_interface::alloc_block()
+mfs_interface::freeblock_bitmap::freelist::take(u32 want, u32 *got)
 {
-  u32 bno;
+  *got = 0;
+  if (!root)
+    return 0;
+
+  free_extent *best = extent_fit(root, std::min(want, root->maxrun));
+  u32 bno = best->start;
+  *got = std::min(want, best->nblocks);
+  carve(best, bno, *got);
+  return bno;
+}
+
+// Like take(), except that the run must start at block bno. Returns 0 if bno
+// is not in this freelist.
+u32
+mfs_interface::freeblock_bitmap::freelist::take_at(u32 bno, u32 want, u32 *got)
+{
+  *got = 0;
+
+  free_extent *e = extent_floor(root, bno);
+  if (!e || e->end() <= bno)
+    return 0;
+
+  *got = std::min(want, e->end() - bno);
+  carve(e, bno, *got);
+  return bno;
+}
+
+// Add the blocks [bno, bno + nblocks) to this freelist, coalescing them with
+// the neighboring extents.
+void
+mfs_interface::freeblock_bitmap::freelist::put(u32 bno, u32 nblocks)
+{
+  free_extent *prev = extent_floor(root, bno);
+  free_extent *next = extent_above(root, bno);
+
+  if ((prev && prev->end() > bno) || (next && next->start < bno + nblocks))
+    panic("freeblock_bitmap: blocks [%u - %u] are already free\n",
+          bno, bno + nblocks - 1);
+
+  u32 start = bno, end = bno + nblocks;
+  if (prev && prev->end() == bno) {
+    start = prev->start;
+    erase(prev);
+  }
+  if (next && next->start == end) {
+    end = next->end();
+    erase(next);
+  }
+  insert(start, end - start);
+
+  nfree += nblocks;
+}
+
+// Wait until all the stripes of the freeblock_bitmap have been initialized.
+void
+mfs_interface::wait_freeblock_bitmap()
+{
+  if (freeblock_bitmap.stripes_pending.load() == 0)
+    return;
+
+  scoped_acquire a(&freeblock_bitmap.init_lock);
+  while (freeblock_bitmap.stripes_pending.load() != 0)
+    freeblock_bitmap.init_cv.sleep(&freeblock_bitmap.init_lock);
+}
+
+// Allocate a run of up to 'nblocks' contiguous blocks from the freeblock_bitmap
+// and return the first block of the run, with its length in *nalloc (which is
+// at least 1). If 'goal' is non-zero and free, the run starts there; callers
+// extending a file pass the block that follows its last one, to keep the file
+// contiguous on the disk.
+u32
+mfs_interface::alloc_blocks(u32 nblocks, u32 *nalloc, u32 goal)
+{
+  u32 bno, end;
   superblock sb;
   int cpu = myid();
   static bool warned_once = false;
 
-  // Use the linked-list representation of the free-bits to perform block
-  // allocation in O(1) time. This list only contains the blocks that are
-  // actually free, so we can allocate any one of them.
+  assert(nblocks > 0);
+  wait_freeblock_bitmap();
+
+  // The goal block may well be in some other CPU's freelist, but the file
+  // that wants it is being written by us right now anyway.
+  if (goal) {
+    auto &fl = freeblock_bitmap.freelist_of(freeblock_bitmap.stripe_of(goal, &end));
+    auto list_lock = fl.list_lock.guard();
+
+    if ((bno = fl.take_at(goal, nblocks, nalloc)))
+      return bno;
+  }
 
   {
-    auto list_lock = freeblock_bitmap.freelists[cpu].list_lock.guard();
-
-    if (!freeblock_bitmap.freelists[cpu].bit_freelist.empty()) {
-      auto it = freeblock_bitmap.freelists[cpu].bit_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      bno = it->bno_;
-      freeblock_bitmap.freelists[cpu].bit_freelist.erase(it);
+    auto &fl = freeblock_bitmap.freelists[cpu];
+    auto list_lock = fl.list_lock.guard();
+
+    if ((bno = fl.take(nblocks, nalloc)))
       return bno;
-    }
   }
 
   // If we run out of blocks in our local CPU's freelist, tap into the global
   // reserve pool first.
   if (VERBOSE && !warned_once) {
     cprintf("WARNING: alloc_block(): CPU %d allocating blocks from the global "
-             "reserve pool.\nThis could be a sign that blocks are getting "
-             "leaked!\n", cpu);
+            "reserve pool.\nThis could be a sign that blocks are getting "
+            "leaked!\n", cpu);
     warned_once = true;
   }
 
-  // TODO: Allocate from the reserve pool in bulk in order to reduce the
-  // chances of contention even further.
-  {
-    if (freeblock_bitmap.reserve_freelist.bit_freelist.empty())
-      goto try_neighbor;
+  // Take a whole batch of blocks from the reserve pool, and keep what we
+  // don't need right now in our local freelist, so that we don't come back
+  // to (and contend on) the reserve pool for every allocation.
+  if (freeblock_bitmap.reserve_freelist.nfree) {
+    u32 want = std::max(nblocks, (u32)RESERVE_REFILL_BLOCKS), got;
 
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
+    {
+      auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
+      bno = freeblock_bitmap.reserve_freelist.take(want, &got);
+    }
 
-    if (!freeblock_bitmap.reserve_freelist.bit_freelist.empty()) {
-      auto it = freeblock_bitmap.reserve_freelist.bit_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      bno = it->bno_;
-      freeblock_bitmap.reserve_freelist.bit_freelist.erase(it);
+    if (bno) {
+      *nalloc = std::min(nblocks, got);
+      if (got > *nalloc) {
+        auto &fl = freeblock_bitmap.freelists[cpu];
+        auto list_lock = fl.list_lock.guard();
+        fl.put(bno + *nalloc, got - *nalloc);
+      }
       return bno;
     }
   }
@@ -2540,23 +2993,16 @@ mfs_interface::alloc_block()
   // point, in order to avoid hotspots. Note that these blocks are only
   // borrowed temporarily and are prompty returned to the original CPU's
   // freelists upon being freed.
-try_neighbor:
   for (int fallback_cpu = cpu + 1; fallback_cpu % NCPU != cpu; fallback_cpu++) {
-    int fcpu = fallback_cpu % NCPU;
+    auto &fl = freeblock_bitmap.freelists[fallback_cpu % NCPU];
 
-    if (freeblock_bitmap.freelists[fcpu].bit_freelist.empty())
+    if (!fl.nfree)
       continue;
 
-    auto list_lock = freeblock_bitmap.freelists[fcpu].list_lock.guard();
+    auto list_lock = fl.list_lock.guard();
 
-    if (!freeblock_bitmap.freelists[fcpu].bit_freelist.empty()) {
-      auto it = freeblock_bitmap.freelists[fcpu].bit_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      bno = it->bno_;
-      freeblock_bitmap.freelists[fcpu].bit_freelist.erase(it);
+    if ((bno = fl.take(nblocks, nalloc)))
       return bno;
-    }
   }
 
   panic("alloc_block(): Out of blocks on CPU %d\n", cpu);
@@ -2565,65 +3011,77 @@ try_neighbor:
   return sb.size; // out of blocks
 }
 
-// Mark a block as free in the freeblock_bitmap.
+// Allocate a block from the freeblock_bitmap.
+u32
+mfs_interface::alloc_block(u32 goal)
+{
+  u32 nalloc;
+  return alloc_blocks(1, &nalloc, goal);
+}
+
+// Mark the blocks [bno, bno + nblocks) as free in the freeblock_bitmap. Each
+// block goes back to the freelist of the stripe it belongs to, regardless of
+// which freelist it was allocated from.
 void
-mfs_interface::free_block(u32 bno)
+mfs_interface::free_blocks(u32 bno, u32 nblocks)
 {
-  // Use the vector representation of the free-bits to free the block in
-  // O(1) time (by optimizing the blocknumber-to-free_bit lookup).
-  free_bit *bit = freeblock_bitmap.bit_vector.at(bno);
+  wait_freeblock_bitmap();
 
-  int cpu = bit->cpu;
-  if (cpu < NCPU) {
-    auto list_lock = freeblock_bitmap.freelists[cpu].list_lock.guard();
-    assert(!bit->is_free);
-    bit->is_free = true;
-    freeblock_bitmap.freelists[cpu].bit_freelist.push_back(bit);
-  } else {
-    // This block belongs to the global reserve pool.
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
-    assert(!bit->is_free);
-    bit->is_free = true;
-    freeblock_bitmap.reserve_freelist.bit_freelist.push_back(bit);
+  while (nblocks) {
+    u32 end;
+    auto &fl = freeblock_bitmap.freelist_of(freeblock_bitmap.stripe_of(bno, &end));
+    u32 n = std::min(nblocks, end - bno);
+
+    {
+      auto list_lock = fl.list_lock.guard();
+      fl.put(bno, n);
+    }
+
+    bno += n;
+    nblocks -= n;
   }
 }
 
+// Mark a block as free in the freeblock_bitmap.
+void
+mfs_interface::free_block(u32 bno)
+{
+  free_blocks(bno, 1);
+}
+
 void
 mfs_interface::print_free_blocks(print_stream *s)
 {
-  percpu<u32> count;
-  u32 total_count = 0, reserve_pool_count = 0;
+  superblock sb;
+  u32 count[NCPU+1], nextents[NCPU+1];
+  u32 total_count = 0, total_extents = 0;
 
-  for (int cpu = 0; cpu < NCPU; cpu++)
-    count[cpu] = 0;
-
-  // Traversing the bit_freelist would be faster because they contain only blocks
-  // that are actually free. However, to do that we would have to acquire the
-  // list_lock, which would prevent concurrent allocations and frees. So go through
-  // the bit_vector instead.
-
-  for (auto &b : freeblock_bitmap.bit_vector) {
-    if (b->is_free) {
-      // No need to re-confirm that it is free with the lock held, since this
-      // count is approximate (like a snapshot) anyway.
-      if (b->cpu < NCPU)
-        count[b->cpu]++;
-      else
-        reserve_pool_count++;
-      total_count++;
-    }
+  get_superblock(&sb);
+  wait_freeblock_bitmap();
+
+  // No need to acquire the list_locks, since these counts are approximate
+  // (like a snapshot) anyway.
+  for (int stripe = 0; stripe <= NCPU; stripe++) {
+    auto &fl = freeblock_bitmap.freelist_of(stripe);
+    count[stripe] = fl.nfree;
+    nextents[stripe] = fl.nextents;
+    total_count += count[stripe];
+    total_extents += nextents[stripe];
   }
 
   s->println();
   s->print("Total num free blocks: ", total_count);
-  s->print(" / ", freeblock_bitmap.bit_vector.size());
+  s->print(" / ", sb.size);
+  s->print(" (", total_extents, " extents)");
   s->println();
   for (int cpu = 0; cpu < NCPU; cpu++) {
     s->print("Num free blocks (CPU ", cpu, "): ", count[cpu]);
+    s->print(" (", nextents[cpu], " extents)");
     s->println();
   }
   s->println();
-  s->print("Num free blocks (Reserve Pool): ", reserve_pool_count);
+  s->print("Num free blocks (Reserve Pool): ", count[NCPU]);
+  s->print(" (", nextents[NCPU], " extents)");
   s->println();
 }
 
@@ -2798,23 +3256,11 @@ recover_scalefs()
   rootfs_interface = new mfs_interface();
 
   // Check all the journals and reapply committed transactions
-  std::vector<transaction*> txns_to_apply;
+  std::vector<transaction*> txns_to_apply[NCPU];
   for (int cpu = 0; cpu < NCPU; cpu++)
-    rootfs_interface->recover_journal(cpu, txns_to_apply);
+    rootfs_interface->recover_journal(cpu, txns_to_apply[cpu]);
 
-  if (!txns_to_apply.empty()) {
-    std::sort(txns_to_apply.begin(), txns_to_apply.end(),
-              journal::compare_txn_tsc);
-
-    for (auto &tr : txns_to_apply) {
-      cprintf("recover_scalefs: applying transaction with commit timestamp %lu\n",
-              tr->commit_tsc);
-      tr->write_to_disk_update_bufcache();
-      delete tr;
-    }
-
-    txns_to_apply.clear();
-  }
+  rootfs_interface->apply_recovered_transactions(txns_to_apply);
 
   for (int cpu = 0; cpu < NCPU; cpu++)
     rootfs_interface->init_journal(cpu);
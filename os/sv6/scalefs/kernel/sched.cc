@@ -16,10 +16,18 @@
 #include "ilist.hh"
 #include "kstream.hh"
 #include "file.hh"
+#include "cpuid.hh"
+#include "apic.hh"
+#include "ipi.hh"
 
 enum { sched_debug = 0 };
 
-struct schedule : public balance_pool<schedule> {
+// Each CPU has one FIFO runqueue per scheduler class (SCHED_CLASS_*).  The
+// scheduler always picks from the most important non-empty class, and keeps
+// running the current proc rather than switching to a less important one.
+// To keep less important classes from starving, a class that has been
+// passed over SCHED_STARVE_TURNS times in a row gets the next turn.
+struct schedule {
 public:
   schedule(int id);
   ~schedule() {};
@@ -28,123 +36,183 @@ public:
   int id_;    // XXX false sharing on this var???
 
   void enq(proc* entry);
-  proc* deq();
+  proc* deq(int prio);
   void dump(print_stream *);
 
   void enq_dwork(dwork *w);
   void try_dwork();
 
-  void balance_move_to(schedule *other);
-  u64 balance_count() const;
+  int move_to(schedule *target, int n);
+  void tick(bool busy);
+  void set_busy(bool busy) { busy_ = busy; }
+  bool nohz(bool expired = false);
+  void kick();
+
+  // Number of procs this CPU has to run (queued, plus the running one
+  // if busy) right now, and averaged over recent ticks, in 1/LOAD_ONE.
+  enum { LOAD_ONE = 256 };
+  u32 load() const { return nrunnable_ + busy_; }
+  u32 loadavg() const { return loadavg_; }
+  u32 nsteal() const { return cansteal_ ? ncansteal_ : 0; }
 
   sched_stat stats_;
   u64 ncansteal_;
+  u64 ticks_;
 private:
   void sanity(void);
 
+  bool empty() const;
+
   struct spinlock lock_ __mpalign__;
-  ilist<proc, &proc::sched_link> proc_;
+  ilist<proc, &proc::sched_link> proc_[SCHED_NCLASS];
+  u32 passed_[SCHED_NCLASS];  // Turns each class was passed over in a row
   isqueue<dwork, &dwork::link_> work_;
+  // Read by other CPUs looking for work to steal.
   volatile bool cansteal_ __mpalign__;
+  volatile u32 nrunnable_;
+  volatile u32 busy_;
+  volatile u32 loadavg_;
+  // The timer only fires every NOHZ_MAX_TICKS quanta; see nohz().
+  volatile bool stretched_;
   __padout__;
 };
 
 schedule::schedule(int id)
-  : balance_pool(1), id_(id), lock_("schedule::lock_", LOCKSTAT_SCHED)
+  : id_(id), lock_("schedule::lock_", LOCKSTAT_SCHED),
+    cansteal_(false), nrunnable_(0), busy_(0), loadavg_(0), stretched_(false)
 {
   ncansteal_ = 0;
-  stats_.enqs = 0;
-  stats_.deqs = 0;
-  stats_.steals = 0;
-  stats_.misses = 0;
-  stats_.idle = 0;
-  stats_.busy = 0;
-  stats_.schedstart = 0;
+  ticks_ = 0;
+  memset(&stats_, 0, sizeof(stats_));
+  for (int c = 0; c < SCHED_NCLASS; c++)
+    passed_[c] = 0;
+}
+
+bool
+schedule::empty() const
+{
+  for (int c = 0; c < SCHED_NCLASS; c++)
+    if (!proc_[c].empty())
+      return false;
+  return true;
 }
 
-u64 
-schedule::balance_count() const {
-  // 1 if the number of processes that in runnable state and have
-  // run long enough that they could be stolen is bigger than 1?
-  // XXX length of queue?
-  //
-  // XXX reading ncansteal could be expensive, but local core updates
-  // it and remote core reads it, experiencing a cache-line transfer
-  return cansteal_ > 0 ? 1 : 0;
+// Called on every timer tick of this CPU; busy is whether it is running
+// something other than its idle proc.
+void
+schedule::tick(bool busy)
+{
+  // Exponentially decaying average with a weight of 1/8 per tick.
+  busy_ = busy;
+  s64 cur = (s64)load() * LOAD_ONE;
+  loadavg_ = loadavg_ + (cur - (s64)loadavg_) / 8;
 }
 
-void 
-schedule::balance_move_to(schedule* target)
+// Move up to n stealable procs from this CPU's runqueues to target's, and
+// return how many were moved.
+int
+schedule::move_to(schedule* target, int n)
 {
-  proc *victim = nullptr;
+  proc *victims[SCHED_STEAL_MAX];
+  int nvictims = 0;
 
+  if (n > SCHED_STEAL_MAX)
+    n = SCHED_STEAL_MAX;
   if (!cansteal_ || !tryacquire(&lock_))
-    return;
-
-  for (auto it = proc_.begin(); it != proc_.end(); ++it) {
-    if ((*it).cansteal(true)) {
-      proc_.erase(it);
+    return 0;
+
+  // Most important classes first: they gain the most from an idle CPU.
+  for (int c = 0; c < SCHED_NCLASS && nvictims < n; c++) {
+    for (auto it = proc_[c].begin(); it != proc_[c].end() && nvictims < n; ) {
+      if (!it->cansteal(true)) {
+        ++it;
+        continue;
+      }
+      victims[nvictims++] = &*it;
+      it = proc_[c].erase(it);
+      nrunnable_--;
       if (--ncansteal_ == 0)
         cansteal_ = false;
-      sanity();
-      victim = &(*it);
     }
   }
+  sanity();
   release(&lock_);
-  if (!victim) {
+  if (!nvictims) {
     ++stats_.misses;
-    return;
+    return 0;
   }
 
-  acquire(&victim->lock);
-  if (victim->get_state() == RUNNABLE && !victim->cpu_pin &&
-      victim->curcycles != 0 && victim->curcycles > VICTIMAGE)
-  {
-    victim->curcycles = 0;
-    victim->cpuid = mycpu()->id;
-    target->enq(victim);
+  int moved = 0;
+  for (int i = 0; i < nvictims; i++) {
+    proc *victim = victims[i];
+    acquire(&victim->lock);
+    if (victim->get_state() == RUNNABLE && !victim->cpu_pin &&
+        victim->curcycles != 0 && victim->curcycles > VICTIMAGE)
+    {
+      victim->curcycles = 0;
+      victim->cpuid = target->id_;
+      target->enq(victim);
+      ++stats_.steals;
+      ++target->stats_.migrations;
+      moved++;
+    } else {
+      // Changed its mind (e.g., got pinned) while off the runqueue.
+      ++stats_.misses;
+      enq(victim);
+    }
     release(&victim->lock);
-    //cprintf("%d: stole %s from %d\n", mycpu()->id, victim->name, id_);
-    ++stats_.steals;
-    return;
-  }
-  ++stats_.misses;
-  cprintf("%d: don't steal %s---hasn't run long enough\n", 
-          mycpu()->id, victim->name);
-#if 0
-  // XXX why is this code here?  you should only steal a runnable process
-  // it has run for a while on the cpu, or not all.
-  if (victim->get_state() == RUNNABLE) {
-    target->enq(victim);
   }
-#endif
-  release(&victim->lock);
+  return moved;
 }
 
 void
 schedule::enq(proc* p)
 {
   scoped_acquire x(&lock_);
-  proc_.push_back(p);
+  proc_[p->sched_class].push_back(p);
+  p->runqtsc = rdtsc();
+  nrunnable_++;
   if (p->cansteal(true))
     if (ncansteal_++ == 0) {
       cansteal_ = true;
     }
   sanity();
   stats_.enqs++;
+  x.release();
+  kick();
 }
 
+// Dequeue the next proc to run instead of a proc of class prio (which is
+// SCHED_NCLASS - 1 if there's nothing worth continuing to run), or return
+// nullptr if it should keep running.
 proc*
-schedule::deq(void)
+schedule::deq(int prio)
 {   
-  if (proc_.empty())
+  if (empty())
     return nullptr;
-  // Remove from head
   scoped_acquire x(&lock_);
-  if (proc_.empty()) 
+  int pick = -1;
+  for (int c = 0; c < SCHED_NCLASS; c++) {
+    if (proc_[c].empty())
+      continue;
+    if (pick < 0 && c <= prio) {
+      pick = c;
+      continue;
+    }
+    // Class c is being passed over for a more important one.
+    if (++passed_[c] >= SCHED_STARVE_TURNS) {
+      pick = c;
+      break;
+    }
+  }
+  if (pick < 0)
     return nullptr;
-  proc &p = proc_.front();
-  proc_.pop_front();
+  passed_[pick] = 0;
+
+  // Remove from head
+  proc &p = proc_[pick].front();
+  proc_[pick].pop_front();
+  nrunnable_--;
   if (p.cansteal(true))
     if (--ncansteal_ == 0)
       cansteal_ = false;
@@ -157,6 +225,17 @@ void
 schedule::dump(print_stream *s)
 {
   s->print(" enq ", stats_.enqs, " deqs ", stats_.deqs, " steals ", stats_.steals, " misses ", stats_.misses);
+  s->print(" switches ", stats_.switches, " migrations ", stats_.migrations);
+}
+
+// Count a sample of cyc cycles in log2 histogram hist.
+static void
+hist_add(u64 *hist, u64 cyc)
+{
+  int b = cyc ? 63 - __builtin_clzll(cyc) : 0;
+  if (b >= SCHED_HIST_BUCKETS)
+    b = SCHED_HIST_BUCKETS - 1;
+  hist[b]++;
 }
 
 void
@@ -165,9 +244,10 @@ schedule::sanity(void)
 #if DEBUG
   u64 n = 0;
 
-  for (auto &p : proc_) 
-    if (p.cansteal(true))
-      n++;
+  for (int c = 0; c < SCHED_NCLASS; c++)
+    for (auto &p : proc_[c])
+      if (p.cansteal(true))
+        n++;
   
   if (n != ncansteal_)
     panic("schedule::sanity: %lu != %lu", n, ncansteal_);
@@ -179,6 +259,65 @@ schedule::enq_dwork(dwork *w)
 {
   scoped_acquire x(&lock_);
   work_.push_back(w);
+  x.release();
+  kick();
+}
+
+// Stretch this CPU's timer tick while it has nothing queued to run: the
+// running proc (or the idle loop) has the CPU to itself, so there's
+// nothing to preempt it for.  The tick still fires every NOHZ_MAX_TICKS
+// quanta so that refcache epochs, the load average and balancing keep
+// making (slower) progress.  CPU 0 keeps ticking because it keeps time
+// and wakes timed sleepers for everybody.  expired says the timer just
+// fired.  Returns whether there is work queued.
+//
+// Must be called on this schedule's CPU with interrupts disabled.
+bool
+schedule::nohz(bool expired)
+{
+  if (!NOHZ || id_ == 0)
+    return nrunnable_ != 0 || !work_.empty();
+
+  // Pairs with the fence in kick(): either we see the new work, or the
+  // CPU that queued it sees stretched_ and restores our tick.
+  bool was = stretched_;
+  stretched_ = true;
+  __sync_synchronize();
+  if (nrunnable_ == 0 && work_.empty()) {
+    // Arm the one-shot only when we start stretching and when it has
+    // fired.  We also get here on every idle wakeup and IPI, and
+    // re-arming then would keep pushing the tick back: a CPU that's
+    // interrupted often enough would never tick, and refcache epochs
+    // would stall for everybody.
+    if (!was || expired)
+      lapic->timer_oneshot(NOHZ_MAX_TICKS * QUANTUM);
+    return false;
+  }
+  stretched_ = false;
+  // This runs on every tick, so only touch the LAPIC when the tick
+  // actually goes back to normal.
+  if (was)
+    lapic->timer_periodic();
+  return true;
+}
+
+// Work was queued on this schedule; restore its regular tick if it has
+// been stretched.
+void
+schedule::kick()
+{
+  __sync_synchronize();
+  if (!stretched_)
+    return;
+  pushcli();
+  if (id_ == myid()) {
+    stretched_ = false;
+    lapic->timer_periodic();
+  } else {
+    // The IPI handler calls schednohz() on the target.
+    poke_cpu(id_);
+  }
+  popcli();
 }
 
 void
@@ -196,10 +335,19 @@ schedule::try_dwork(void)
 
 struct sched_dir {
 private:
-  balancer<sched_dir, schedule> b_;
   percpu<schedule*> schedule_;
+
+  // The other CPUs, in the order a CPU looks for work to steal: first its
+  // SMT siblings, then the rest of its socket, then everybody else.
+  enum { STEAL_SMT, STEAL_SOCKET, STEAL_REMOTE, STEAL_NLEVEL };
+  struct steal_domains {
+    u16 cpu[NCPU];
+    u16 end[STEAL_NLEVEL];      // Level l is cpu[end[l-1]..end[l])
+  };
+  steal_domains domains_[NCPU];
+
 public:
-  sched_dir() : b_(this) {
+  sched_dir() {
     for (int i = 0; i < NCPU; i++) {
       schedule_[i] = new schedule(i);
     }
@@ -207,19 +355,74 @@ public:
   ~sched_dir() {};
   NEW_DELETE_OPS(sched_dir);
 
-  schedule* balance_get(int id) const {
-    return schedule_[id];
-  }
+  void init_topology();
 
-  void steal() {
+  // Look for a CPU to take work from, nearest domains first, and move half
+  // of its surplus over.  An idle CPU takes any stealable work; a busy one
+  // only evens out a lasting imbalance of at least two procs.  Returns the
+  // number of procs stolen.
+  int steal(bool idle) {
     if (!SCHED_LOAD_BALANCE)
-      return;
+      return 0;
     pushcli();
-    b_.balance();
+    u64 start = rdtsc();
+    int me = mycpu()->id;
+    schedule *thief = schedule_[me];
+    const steal_domains &d = domains_[me];
+    int moved = 0;
+
+    for (int l = 0, i = 0; l < STEAL_NLEVEL && !moved; l++) {
+      schedule *victim = nullptr;
+      u32 vload = 0;
+      for (; i < d.end[l]; i++) {
+        schedule *s = schedule_[d.cpu[i]];
+        if (s->nsteal() && s->load() > vload) {
+          victim = s;
+          vload = s->load();
+        }
+      }
+      if (!victim)
+        continue;
+
+      u32 myload = idle ? 0 : thief->load();
+      if (!idle && (vload < myload + 2 ||
+                    victim->loadavg() < thief->loadavg() + schedule::LOAD_ONE))
+        continue;
+      moved = victim->move_to(thief, std::max(1u, (vload - myload) / 2));
+    }
+    u64 cyc = rdtsc() - start;
+    thief->stats_.steal_tries++;
+    thief->stats_.steal_cycles += cyc;
+    hist_add(thief->stats_.steal_hist, cyc);
     popcli();
+    return moved;
+  }
+
+  bool nohz() {
+    return schedule_[mycpu()->id]->nohz();
+  }
+
+  void tick() {
+    schedule *s = schedule_[mycpu()->id];
+    s->tick(myproc() != idleproc());
+    if (++s->ticks_ % SCHED_BALANCE_TICKS == 0 && myproc() != idleproc())
+      steal(false);
+    s->nohz(true);
   }
 
   void addrun(struct proc* p) {
+    requeue(p);
+    // If p is more important than what this CPU is running, get the
+    // current proc off the CPU at the next trap or syscall return
+    // instead of waiting for a timer tick.
+    proc *cur = myproc();
+    if (p->cpuid == mycpu()->id && cur && cur != idleproc() &&
+        p->sched_class < cur->sched_class)
+      cur->yield_ = true;
+  }
+
+  // Put a proc that was just switched away from back on its runq.
+  void requeue(struct proc* p) {
     p->set_state(RUNNABLE);
     schedule_[p->cpuid]->enq(p);
   }
@@ -232,8 +435,8 @@ public:
     schedule_[mycpu()->id]->try_dwork();
   }
 
-  proc* next() {
-    return schedule_[mycpu()->id]->deq();
+  proc* next(int prio) {
+    return schedule_[mycpu()->id]->deq(prio);
   }
 
   void
@@ -261,10 +464,18 @@ public:
     intena = mycpu()->intena;
     myproc()->curcycles += rdtsc() - myproc()->tsc;
 
-    // Interrupts are disabled
-    next = this->next();
+    // Interrupts are disabled.  Only switch to a proc of a less important
+    // class than the current one if the current one can't keep running.
+    int prio = SCHED_NCLASS - 1;
+    if (myproc() != idleproc() && myproc()->get_state() == RUNNABLE &&
+        myproc()->cpuid == mycpu()->id)
+      prio = myproc()->sched_class;
+    next = this->next(prio);
 
     u64 t = rdtsc();
+    schedule_[mycpu()->id]->set_busy(next != nullptr ||
+                                     (myproc() != idleproc() &&
+                                      myproc()->get_state() == RUNNABLE));
     if (myproc() == idleproc())
       schedule_[mycpu()->id]->stats_.idle += t - schedule_[mycpu()->id]->stats_.schedstart;
     else
@@ -287,6 +498,11 @@ public:
     if (next->get_state() != RUNNABLE)
       panic("non-RUNNABLE next %s %u", next->name, next->get_state());
 
+    sched_stat &st = schedule_[mycpu()->id]->stats_;
+    st.switches++;
+    if (next != idleproc())
+      hist_add(st.wait_hist, t - next->runqtsc);
+
     prev = myproc();
     mycpu()->proc = next;
     mycpu()->prev = prev;
@@ -319,6 +535,23 @@ public:
     post_swtch();
   }
 
+  // Copy out the raw sched_stat of every CPU, as an array of NCPU.
+  int
+  statsread(char *dst, u32 off, u32 n)
+  {
+    u32 done = 0;
+    for (int i = 0; i < NCPU && done < n; i++) {
+      u32 start = i * sizeof(sched_stat), end = start + sizeof(sched_stat);
+      if (off + done >= end)
+        continue;
+      u32 o = off + done - start;
+      u32 cnt = std::min(end - (off + done), n - done);
+      memmove(dst + done, (char*)&schedule_[i]->stats_ + o, cnt);
+      done += cnt;
+    }
+    return done;
+  }
+
   void
   scheddump(print_stream *s)
   {
@@ -338,7 +571,7 @@ post_swtch(void)
 {
   if (mycpu()->prev->get_state() == RUNNABLE && 
       mycpu()->prev != idleproc())
-    addrun(mycpu()->prev);
+    thesched_dir.requeue(mycpu()->prev);
   release(&mycpu()->prev->lock);
   thesched_dir.trywork();
 }
@@ -370,15 +603,82 @@ statread(mdev* m, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
+static int
+schedstatsread(mdev* m, char *dst, u32 off, u32 n)
+{
+  return thesched_dir.statsread(dst, off, n);
+}
+
+void
+sched_dir::init_topology()
+{
+  // Bits of the APIC ID below the core ID and below the package ID, from
+  // the topology leaf (assumed to be the same on all CPUs).
+  u32 smt_shift = 0, pkg_shift = 0;
+  bool have_pkg = false;
+  for (u32 level = 0; level < 8; level++) {
+    auto l = cpuid::get_leaf(cpuid::leafid::topology, level);
+    u32 type = (l.c >> 8) & 0xff;
+    if (!l.valid || type == 0)
+      break;
+    if (type == 1) {
+      smt_shift = l.a & 0x1f;
+    } else if (type == 2) {
+      pkg_shift = l.a & 0x1f;
+      have_pkg = true;
+    }
+  }
+
+  auto level = [&](int a, int b) {
+    u32 ha = cpus[a].hwid.num, hb = cpus[b].hwid.num;
+    if (smt_shift && (ha >> smt_shift) == (hb >> smt_shift))
+      return STEAL_SMT;
+    if (cpus[a].node && cpus[b].node) {
+      if (cpus[a].node == cpus[b].node)
+        return STEAL_SOCKET;
+    } else if (have_pkg) {
+      if ((ha >> pkg_shift) == (hb >> pkg_shift))
+        return STEAL_SOCKET;
+    } else if (a / NCPU_PER_SOCKET == b / NCPU_PER_SOCKET) {
+      return STEAL_SOCKET;
+    }
+    return STEAL_REMOTE;
+  };
+
+  for (int c = 0; c < ncpu; c++) {
+    steal_domains &d = domains_[c];
+    int n = 0;
+    for (int l = 0; l < STEAL_NLEVEL; l++) {
+      for (int o = 0; o < ncpu; o++)
+        if (o != c && level(c, o) == l)
+          d.cpu[n++] = o;
+      d.end[l] = n;
+    }
+  }
+}
+
 int
 steal(void)
 {
-  thesched_dir.steal();
-  return 0;
+  return thesched_dir.steal(true);
+}
+
+void
+schedtick(void)
+{
+  thesched_dir.tick();
+}
+
+bool
+schednohz(void)
+{
+  return thesched_dir.nohz();
 }
 
 void
 initsched(void)
 {
+  thesched_dir.init_topology();
   devsw[MAJ_STAT].pread = statread;
+  devsw[MAJ_SCHEDSTATS].pread = schedstatsread;
 }
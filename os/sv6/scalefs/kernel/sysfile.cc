@@ -943,6 +943,38 @@ sys_pipe(userptr<int> fd)
   return sys_pipe2(fd, 0);
 }
 
+//SYSCALL
+ssize_t
+sys_splice(int fd_in, userptr<off_t> off_in, int fd_out,
+           userptr<off_t> off_out, size_t len, int flags)
+{
+  sref<file> in = getfile(fd_in);
+  sref<file> out = getfile(fd_out);
+  if (!in || !out)
+    return -1;
+
+  off_t inoff, outoff;
+  if (off_in && !off_in.load(&inoff))
+    return -1;
+  if (off_out && !off_out.load(&outoff))
+    return -1;
+  if ((off_in && inoff < 0) || (off_out && outoff < 0))
+    return -1;
+
+  if (len > 4*1024*1024)
+    len = 4*1024*1024;
+
+  ssize_t r = in->splice(out.get(), len, off_in ? &inoff : nullptr,
+                         off_out ? &outoff : nullptr);
+  if (r > 0) {
+    if (off_in && !off_in.store(&inoff))
+      return -1;
+    if (off_out && !off_out.store(&outoff))
+      return -1;
+  }
+  return r;
+}
+
 //SYSCALL
 int
 sys_readdir(int dirfd, const userptr<char> prevptr, userptr<char> nameptr)
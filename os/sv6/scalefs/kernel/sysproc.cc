@@ -201,6 +201,17 @@ sys_madvise(userptr<void> addr, size_t len, int advice)
       return -1;
     return 0;
 
+  case MADV_HUGEPAGE:
+    if (myproc()->vmap->hugepage(align_addr, align_len, vmdesc::FLAG_HUGE) < 0)
+      return -1;
+    return 0;
+
+  case MADV_NOHUGEPAGE:
+    if (myproc()->vmap->hugepage(align_addr, align_len,
+                                 vmdesc::FLAG_NOHUGE) < 0)
+      return -1;
+    return 0;
+
   default:
     return -1;
   }
@@ -268,6 +279,13 @@ sys_setaffinity(int cpu)
   return myproc()->set_cpu_pin(cpu);
 }
 
+//SYSCALL
+int
+sys_setschedclass(int cls)
+{
+  return myproc()->set_sched_class(cls);
+}
+
 //SYSCALL
 long
 sys_futex(const u64* addr, int op, u64 val, u64 timer)
@@ -289,6 +307,25 @@ sys_futex(const u64* addr, int op, u64 val, u64 timer)
   }
 }
 
+// If *addr is still val, wake up to nwake threads waiting on addr and
+// make up to nrequeue of the rest wait on addr2 instead.
+//SYSCALL
+long
+sys_futex_requeue(const u64* addr, u64 nwake, const u64* addr_requeue, u64 nrequeue,
+                  u64 val)
+{
+  futexkey_t key, key2;
+
+  if (futexkey(addr, myproc()->vmap.get(), &key) < 0 ||
+      futexkey(addr_requeue, myproc()->vmap.get(), &key2) < 0)
+    return -1;
+
+  mt_ascope ascope("%s(%p,%lu,%p,%lu,%lu)", __func__, addr, nwake, addr_requeue,
+                   nrequeue, val);
+
+  return futexrequeue(key, nwake, key2, nrequeue, val);
+}
+
 //SYSCALL
 long
 sys_yield(void)
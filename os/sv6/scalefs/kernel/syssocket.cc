@@ -159,6 +159,54 @@ sys_sendto(int sockfd, const userptr<void> buf, size_t len, int flags,
                    addrlen);
 }
 
+//SYSCALL
+int
+sys_sendmmsg(int sockfd, userptr<struct msgvec> vec, unsigned int vlen,
+             int flags, const userptr<struct sockaddr> dest_addr,
+             uint32_t addrlen)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  struct sockaddr_storage ss;
+  if (dest_addr) {
+    int r = sockaddr_from_user(&ss, dest_addr, addrlen);
+    if (r < 0)
+      return r;
+  }
+
+  return f->sendmmsg(vec, vlen, flags,
+                     dest_addr ? (struct sockaddr*)&ss : nullptr,
+                     addrlen);
+}
+
+//SYSCALL
+int
+sys_recvmmsg(int sockfd, userptr<struct msgvec> vec, unsigned int vlen,
+             int flags)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+  return f->recvmmsg(vec, vlen, flags);
+}
+
+//SYSCALL
+int
+sys_setsockopt(int sockfd, int level, int optname,
+               const userptr<void> optval, uint32_t optlen)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  char buf[64];
+  if (optlen > sizeof buf || !optval.load_bytes(buf, optlen))
+    return -1;
+  return f->setsockopt(level, optname, buf, optlen);
+}
+
 //SYSCALL
 int
 sys_connect(int sockfd, const userptr<struct sockaddr> addr, u32 addrlen)
@@ -199,6 +199,7 @@ trap(struct trapframe *tf)
     if (mycpu()->id == 0)
       timerintr();
     refcache::mycache->tick();
+    schedtick();
     lapiceoi();
     if (mycpu()->no_sched_count) {
       kstats::inc(&kstats::sched_blocked_tick_count);
@@ -253,6 +254,7 @@ trap(struct trapframe *tf)
     extern void on_ipicall();
     lapiceoi();
     on_ipicall();
+    schednohz();
     break;
   }
   case T_DEVICE: {
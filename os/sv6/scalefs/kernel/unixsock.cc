@@ -3,15 +3,15 @@
 #include "types.h"
 #include "ilist.hh"
 #include "kstats.hh"
-#include "lb.hh"
 #include "atomic_util.hh"
 #include "proc.hh"
 #include "file.hh"
 #include <uk/socket.h>
 #include <uk/un.h>
 
-#define QUEUELEN 10   // Number of message per queue of a local socket
-#define LB 0          // Run with load balancer?
+#define QUEUELEN 64         // Default messages per queue of a local socket
+#define QUEUELEN_MAX 4096   // Largest queue LOCAL_QUEUELEN can ask for
+#define MSG_CACHE_MAX 64    // Free messages kept per CPU
 
 struct msghdr {
   u32 len;
@@ -20,70 +20,200 @@ struct msghdr {
   islink<msghdr> link;
   typedef isqueue<msghdr, &msghdr::link> list_t;
 
-  msghdr() {}
+  msghdr() : data(nullptr) {}
   ~msghdr() {}
 
   NEW_DELETE_OPS(msghdr);
 };
 
-struct coresocket : public balance_pool<coresocket> {
-  int len;
-  struct spinlock lock;
-  msghdr::list_t messages;
+// Per-CPU cache of free messages, each with its data page, so a send
+// doesn't go to the allocators for either.
+struct msg_cache {
+  msghdr::list_t free;
+  u32 n;
+};
 
-  coresocket() : balance_pool(QUEUELEN), len(0),
-                 lock("coresocket", LOCKSTAT_LOCALSOCK) {}
-  ~coresocket() {}
-  NEW_DELETE_OPS(coresocket);
+DEFINE_PERCPU(msg_cache, msg_caches);
 
-  u64 balance_count() const {
-    return len;
+static msghdr *
+msg_alloc(void)
+{
+  {
+    scoped_cli cli;
+    msg_cache &c = *msg_caches;
+    if (c.n) {
+      msghdr &m = c.free.front();
+      c.free.pop_front();
+      c.n--;
+      return &m;
+    }
   }
 
-  void balance_move_to(coresocket* target) {
-    // XXX might be useful to enforce lock order, but it's alright
-    // because of try_acquire.
+  char *b = kalloc("msgbuf");
+  if (!b)
+    return nullptr;
+  msghdr *m = new (std::nothrow) msghdr();
+  if (!m) {
+    kfree(b);
+    return nullptr;
+  }
+  m->data = b;
+  return m;
+}
 
-    assert(this != target);
-    if (!lock.try_acquire())
-      return;
-    if (!target->lock.try_acquire()) {
-      lock.release();
+static void
+msg_free(msghdr *m)
+{
+  {
+    scoped_cli cli;
+    msg_cache &c = *msg_caches;
+    if (c.n < MSG_CACHE_MAX) {
+      c.free.push_back(m);
+      c.n++;
       return;
     }
+  }
+  kfree(m->data);
+  delete m;
+}
 
-    int n = 0;
-    while (target->len < len) {
-      n++;
-      target->len++;
-      len--;
-      msghdr& m = messages.front();
-      messages.pop_front();
-      target->messages.push_back(&m);
+// A bounded, lock-free queue of messages (Vyukov's bounded queue).  Each
+// slot's sequence number says whether it is free for the producer at
+// position pos (seq == pos) or holds a message for the consumer at pos
+// (seq == pos + 1).  Any number of senders and receivers can use it;
+// lock only serializes sleeping and waking, and is only taken when
+// someone is (or is about to be) asleep.
+struct coresocket {
+  struct slot {
+    std::atomic<u64> seq;
+    msghdr *m;
+  };
+
+  slot *slots_;
+  u32 size_;
+  std::atomic<u64> head_ __mpalign__;   // Next position to receive from
+  std::atomic<u64> tail_ __mpalign__;   // Next position to send to
+  struct spinlock lock __mpalign__;
+  struct condvar nonempty;
+  struct condvar nonfull;
+  std::atomic<int> rsleep;
+  std::atomic<int> wsleep;
+
+  coresocket(u32 size) : size_(size), head_(0), tail_(0),
+                         lock("coresocket", LOCKSTAT_LOCALSOCK),
+                         nonempty("coresocket:nonempty"),
+                         nonfull("coresocket:nonfull"),
+                         rsleep(0), wsleep(0)
+  {
+    assert((size & (size - 1)) == 0);
+    slots_ = (slot*)kmalloc(size * sizeof(slot), "coresocket");
+    if (!slots_)
+      throw_bad_alloc();
+    for (u32 i = 0; i < size; i++) {
+      new (&slots_[i].seq) std::atomic<u64>(i);
+      slots_[i].m = nullptr;
     }
+  }
 
-    if (n > 0) {
-      kstats::inc(&kstats::socket_load_balance);
+  ~coresocket() {
+    while (msghdr *m = pop())
+      msg_free(m);
+    kmfree(slots_, size_ * sizeof(slot));
+  }
+  NEW_DELETE_OPS(coresocket);
+
+  bool push(msghdr *m) {
+    u64 pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      slot &s = slots_[pos & (size_ - 1)];
+      s64 d = (s64)(s.seq.load(std::memory_order_acquire) - pos);
+      if (d == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          s.m = m;
+          s.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (d < 0) {
+        return false;           // Full
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  msghdr *pop() {
+    u64 pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      slot &s = slots_[pos & (size_ - 1)];
+      s64 d = (s64)(s.seq.load(std::memory_order_acquire) - (pos + 1));
+      if (d == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          msghdr *m = s.m;
+          s.seq.store(pos + size_, std::memory_order_release);
+          return m;
+        }
+      } else if (d < 0) {
+        return nullptr;         // Empty
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
     }
+  }
 
-    lock.release();
-    target->lock.release();
+  // Wake one sleeper on cv if count says there may be one.  The caller
+  // just pushed or popped; sleepers bump count before they re-check the
+  // queue, so one of the two sees the other.
+  void wake(condvar *cv, std::atomic<int> &count) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (count.load() == 0)
+      return;
+    scoped_acquire l(&lock);
+    cv->wake_one();
+  }
+
+  // Send m, waiting for room if the queue is full.
+  int send(msghdr *m) {
+    if (!push(m)) {
+      if (myproc()->killed)
+        return -1;
+      scoped_acquire l(&lock);
+      ++wsleep;
+      auto unsleep = scoped_cleanup([this](){ --wsleep; });
+      while (!push(m))
+        nonfull.sleep(&lock);
+    }
+    wake(&nonempty, rsleep);
+    return 0;
+  }
+
+  // Receive a message, waiting for one if block is set.
+  msghdr *recv(bool block) {
+    msghdr *m = pop();
+    if (!m) {
+      if (!block || myproc()->killed)
+        return nullptr;
+      scoped_acquire l(&lock);
+      ++rsleep;
+      auto unsleep = scoped_cleanup([this](){ --rsleep; });
+      while (!(m = pop()))
+        nonempty.sleep(&lock);
+    }
+    kstats::inc(&kstats::socket_local_read);
+    wake(&nonfull, wsleep);
+    return m;
   }
 };
 
 struct localsock {
   bool ordered_;
+  std::atomic<u32> queuelen_;
   atomic<coresocket*> pipes[NCPU];
-  spinlock rw_cv_lock[NCPU];
-  condvar rw_cv[NCPU];
-  balancer<localsock, coresocket> b;
-  atomic<int> nreader;
 
-  localsock(bool ordered) : ordered_(ordered), b(this), nreader(0) {
+  localsock(bool ordered) : ordered_(ordered), queuelen_(QUEUELEN) {
     for (int i = 0; i < NCPU; i++)
       pipes[i] = 0;
-    if (ordered)
-      pipes[0] = new coresocket;
   }
 
   ~localsock() {
@@ -96,134 +226,46 @@ struct localsock {
 
   NEW_DELETE_OPS(localsock);
 
-  coresocket* reader() {
-    for (int i = 0; i < NCPU; i++) {
-      if (pipes[i] != NULL)
-        return pipes[i];
-    }
-    return NULL;
+  // Queues are created on first use, with the length set at that time.
+  // Returns false if it is too late to change it.
+  bool set_queuelen(u32 n) {
+    if (n == 0 || n > QUEUELEN_MAX)
+      return false;
+    // The queues are sized when they are created.
+    for (int i = 0; i < NCPU; i++)
+      if (pipes[i])
+        return false;
+    u32 len = 1;
+    while (len < n)
+      len *= 2;
+    queuelen_ = len;
+    return true;
   }
 
   coresocket* mycoresocket() {
-    if (ordered_)
-      return pipes[0];
-
+    // An ordered socket has a single queue; an unordered one has one per
+    // core, and messages are delivered on the sender's core.
     // XXX not right; if we have a single reader that is rescheduled
     // to another core, we get two readers ...
-    int id = myid();
+    int id = ordered_ ? 0 : myid();
     for (;;) {
       coresocket* c = pipes[id];
       if (c)
         return c;
 
-      c = new coresocket;
-      if (cmpxch(&pipes[id], (coresocket*) 0, c)) {
-        nreader++;
+      c = new coresocket(queuelen_);
+      if (cmpxch(&pipes[id], (coresocket*) 0, c))
         return c;
-      }
       delete c;
     }
   }
 
-  coresocket* balance_get(int id) const {
-    return pipes[id];
-  }
-
-  void balance() {
-#if LB
-    b.balance();
-#endif
-  }
-
   int write(msghdr *m) {
-    bool toyield = true;
-    for (;;) {
-      if (myproc()->killed)
-        return -1;
-
-      coresocket *cp;
-#if 0
-      // if there is only reader, deliver message to reader
-      // perhaps useful if sender and receiver are not on the same core
-      if (nreader > 1) {
-        cp = mycoresocket();
-        if (cp->len >= QUEUELEN)
-          balance();
-      } else {
-        cp = reader();
-      }
-      if (cp == NULL)
-        continue;
-#else
-      cp = mycoresocket();
-      if (cp->len >= QUEUELEN && toyield) {
-        yield();
-        toyield = false;
-        continue;
-      }
-
-      if (cp->len >= QUEUELEN)
-        balance();
-#endif
-
-      int cpu = myid();
-      scoped_acquire a(&rw_cv_lock[cpu]);
-
-      scoped_acquire l(&cp->lock);
-      if (cp->len < QUEUELEN) {
-        // cprintf("w %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
-        cp->messages.push_back(m);
-        cp->len++;
-        // Wake up the sleeping reader
-        rw_cv[cpu].wake_all();
-        return 0;
-      }
-    }
+    return mycoresocket()->send(m);
   }
 
-  msghdr* read() {
-    //bool toyield = true;
-    for (;;) {
-      if (myproc()->killed)
-        return NULL;
-
-      coresocket* cp = mycoresocket();
-
-#if 0 // We would like to avoid spinning...
-
-      if (cp->len <= 0 && toyield) {
-        // in case another proc is running on hopefully this processor,
-        // let's give them a chance to send a message
-        // cprintf("yield %d (id %d)\n", myproc()->pid, id);
-        yield();   // yields to another process on this core, if there is one
-        toyield = false;
-        continue;
-      }
-
-      if (cp->len <= 0)
-        balance();
-      else
-        kstats::inc(&kstats::socket_local_read);
-
-#else // So sleep on a condition variable instead
-
-      int cpu = myid();
-      scoped_acquire a(&rw_cv_lock[cpu]);
-      while (cp->len <= 0)
-        rw_cv[cpu].sleep(&rw_cv_lock[cpu]);
-
-#endif
-
-      scoped_acquire l(&cp->lock);
-      if (cp->len > 0) {
-        // cprintf("r %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
-        msghdr &m = cp->messages.front();
-        cp->messages.pop_front();
-        cp->len--;
-        return &m;
-      }
-      // toyield = true;   // iterate between yielding and balancing
-    }
+  msghdr* read(bool block = true) {
+    return mycoresocket()->recv(block);
   }
 };
 
@@ -279,76 +321,152 @@ public:
     return 0;
   }
 
-  ssize_t
-  sendto(userptr<void> buf, size_t len, int flags,
-         const struct sockaddr *dest_addr, size_t addrlen) override
+private:
+  // Resolve the socket bound at dest_addr.
+  static localsock *
+  lookup(const struct sockaddr *dest_addr, size_t addrlen, sref<mnode> *ip)
   {
-    kstats::timer timer_fill(&kstats::socket_local_sendto_cycles);
-    kstats::inc(&kstats::socket_local_sendto_cnt);
-
     auto uaddr = check_sockaddr(dest_addr, addrlen);
     if (!uaddr)
-      return -1;
-
-    sref<mnode> ip = namei(myproc()->cwd_m, uaddr->sun_path);
-    if (!ip)
-      return -1;
+      return nullptr;
 
-    if (ip->type() != mnode::types::sock)
-      return -1;
+    *ip = namei(myproc()->cwd_m, uaddr->sun_path);
+    if (!*ip || (*ip)->type() != mnode::types::sock)
+      return nullptr;
+    return (*ip)->as_sock()->get_sock();
+  }
 
-    char *b = kalloc("writebuf");
-    if (!b)
+  // Send len bytes at buf to dest.  Returns the number of bytes sent.
+  ssize_t
+  send_one(localsock *dest, userptr<void> buf, size_t len)
+  {
+    msghdr *m = msg_alloc();
+    if (!m)
       return -1;
 
     if (len > PGSIZE)
       len = PGSIZE;
-    if (!buf.load_bytes(b, len)) {
-      kfree(b);
+    if (!buf.load_bytes(m->data, len)) {
+      msg_free(m);
       return -1;
     }
-
-    msghdr *m = new msghdr();
-    m->data = b;
     m->len = len;
     m->uaddr.sun_family = AF_UNIX;
     strncpy(m->uaddr.sun_path, socketpath_, UNIX_PATH_MAX);
 
-    int r = ip->as_sock()->get_sock()->write(m);
-    if (r < 0) {
-      kfree(b);
-      delete m;
+    if (dest->write(m) < 0) {
+      msg_free(m);
       return -1;
     }
     return len;
   }
 
+  // Receive a message into buf, which holds len bytes.  Returns the
+  // message length, 0 if block is false and there is none, or -1.
   ssize_t
-  recvfrom(userptr<void> buf, size_t len, int flags,
-           struct sockaddr_storage *src_addr, size_t *addrlen) override
+  recv_one(userptr<void> buf, size_t len, bool block,
+           struct sockaddr_storage *src_addr, size_t *addrlen)
   {
-    kstats::timer timer_fill(&kstats::socket_local_recvfrom_cycles);
-    kstats::inc(&kstats::socket_local_recvfrom_cnt);
+    msghdr *m = localsock_->read(block);
+    if (!m)
+      return block ? -1 : 0;
 
     ssize_t r = -1;
-
-    msghdr *m = localsock_->read();
     if (src_addr) {
       *(struct sockaddr_un*)src_addr = m->uaddr;
       *addrlen = sizeof(m->uaddr);
     }
-    if (m->len > len)
-      goto done;
+    if (m->len <= len && buf.store_bytes(m->data, m->len))
+      r = m->len;
+    msg_free(m);
+    return r;
+  }
 
-    if (!buf.store_bytes(m->data, m->len))
-      goto done;
+public:
+  int
+  setsockopt(int level, int optname, const void *optval,
+             size_t optlen) override
+  {
+    if (level != SOL_LOCAL || optname != LOCAL_QUEUELEN ||
+        optlen != sizeof(int))
+      return -1;
+    int n = *(const int*)optval;
+    if (n <= 0 || !localsock_->set_queuelen(n))
+      return -1;
+    return 0;
+  }
+
+  ssize_t
+  sendto(userptr<void> buf, size_t len, int flags,
+         const struct sockaddr *dest_addr, size_t addrlen) override
+  {
+    kstats::timer timer_fill(&kstats::socket_local_sendto_cycles);
+    kstats::inc(&kstats::socket_local_sendto_cnt);
 
-    r = m->len;
+    sref<mnode> ip;
+    localsock *dest = lookup(dest_addr, addrlen, &ip);
+    if (!dest)
+      return -1;
+    return send_one(dest, buf, len);
+  }
 
-  done:
-    kfree(m->data);
-    delete m;
-    return r;
+  // Send a batch of messages to the same destination, which is looked up
+  // only once.  Returns the number of messages sent.
+  int
+  sendmmsg(userptr<struct msgvec> vec, unsigned int vlen, int flags,
+           const struct sockaddr *dest_addr, size_t addrlen) override
+  {
+    sref<mnode> ip;
+    localsock *dest = lookup(dest_addr, addrlen, &ip);
+    if (!dest)
+      return -1;
+
+    unsigned int i;
+    for (i = 0; i < vlen; i++) {
+      kstats::timer timer_fill(&kstats::socket_local_sendto_cycles);
+      kstats::inc(&kstats::socket_local_sendto_cnt);
+      struct msgvec v;
+      if (!(vec + (ptrdiff_t)i).load(&v))
+        break;
+      if (send_one(dest, userptr<void>(v.msg_base), v.msg_len) < 0)
+        break;
+    }
+    return i ? i : -1;
+  }
+
+  ssize_t
+  recvfrom(userptr<void> buf, size_t len, int flags,
+           struct sockaddr_storage *src_addr, size_t *addrlen) override
+  {
+    kstats::timer timer_fill(&kstats::socket_local_recvfrom_cycles);
+    kstats::inc(&kstats::socket_local_recvfrom_cnt);
+
+    return recv_one(buf, len, true, src_addr, addrlen);
+  }
+
+  // Receive up to vlen messages, waiting only for the first.  Returns
+  // the number of messages received.
+  int
+  recvmmsg(userptr<struct msgvec> vec, unsigned int vlen, int flags) override
+  {
+    unsigned int i;
+    for (i = 0; i < vlen; i++) {
+      kstats::timer timer_fill(&kstats::socket_local_recvfrom_cycles);
+      struct msgvec v;
+      if (!(vec + (ptrdiff_t)i).load(&v))
+        break;
+      ssize_t r = recv_one(userptr<void>(v.msg_base), v.msg_len, i == 0,
+                           nullptr, nullptr);
+      if (r <= 0)
+        break;
+      kstats::inc(&kstats::socket_local_recvfrom_cnt);
+      v.msg_len = r;
+      // Like Linux, report the messages already received; this one is
+      // lost.
+      if (!(vec + (ptrdiff_t)i).store(&v))
+        break;
+    }
+    return i ? i : -1;
   }
 
   void
@@ -39,6 +39,8 @@ void to_stream(class print_stream *s, const vmdesc &vmd)
         {"ANON", vmdesc::FLAG_ANON},
         {"WRITE", vmdesc::FLAG_WRITE},
         {"SHARED", vmdesc::FLAG_SHARED},
+        {"HUGE", vmdesc::FLAG_HUGE},
+        {"NOHUGE", vmdesc::FLAG_NOHUGE},
       }), " ");
   if (vmd.page)
     s->print((void*)vmd.page->pa(), "}");
@@ -337,6 +339,29 @@ vmap::clear_mapping(uptr addr)
   shootdown.perform();
 }
 
+bool
+vmap::maps_shared_writable(uptr addr)
+{
+  // This is called with the file's page lock held, which must not nest
+  // outside the vpfs_ lock, so peek without locking.  A racing munmap or
+  // mprotect can only make the answer conservative.
+  auto vpf = vpfs_.find(addr/PGSIZE);
+  if (!vpf.is_set())
+    return false;
+  u64 flags = vpf->flags;
+  return (flags & vmdesc::FLAG_SHARED) && (flags & vmdesc::FLAG_WRITE);
+}
+
+bool
+vmap::test_and_clear_accessed(uptr addr)
+{
+  auto vpf = vpfs_.find(addr/PGSIZE);
+  auto lock = vpfs_.acquire(vpf);
+  if (!vpf.is_set() || !vpf->page)
+    return false;
+  return cache.test_and_clear_accessed(addr, vpf);
+}
+
 int
 vmap::willneed(uptr start, uptr len)
 {
@@ -414,6 +439,17 @@ vmap::mprotect(uptr start, uptr len, uint64_t flags)
 
   mmu::shootdown shootdown;
 
+  // A large page mapping that straddles either end of the range no
+  // longer has uniform permissions, so split it: drop it and let the
+  // pages fault back in individually.
+  if (start % LGPGSIZE && begin.is_set())
+    cache.invalidate(start, PGSIZE, begin, &shootdown);
+  if ((start + len) % LGPGSIZE) {
+    auto last = vpfs_.find((start + len) / PGSIZE - 1);
+    if (last.is_set())
+      cache.invalidate(start + len - PGSIZE, PGSIZE, last, &shootdown);
+  }
+
   for (auto it = begin; it < end; it += it.span()) {
     if (!it.is_set())
       return -1;                // ENOMEM
@@ -442,6 +478,23 @@ vmap::mprotect(uptr start, uptr len, uint64_t flags)
   return 0;
 }
 
+int
+vmap::hugepage(uptr start, uptr len, uint64_t flag)
+{
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find((start + len) / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+
+  // Large pages that are already mapped stay until something splits
+  // them; the hint only affects future faults.
+  for (auto it = begin; it < end; it += it.span()) {
+    if (!it.is_set())
+      return -1;                // ENOMEM
+    it->flags = (it->flags & ~(vmdesc::FLAG_HUGE | vmdesc::FLAG_NOHUGE)) | flag;
+  }
+  return 0;
+}
+
 int
 vmap::dup_page(uptr dest, uptr src)
 {
@@ -476,6 +529,173 @@ vmap::dup_page(uptr dest, uptr src)
  * pagefault handling code on vmap
  */
 
+bool
+vmap::map_folio(uptr va, access_type type)
+{
+  uptr base = va & ~(uptr)(LGPGSIZE - 1);
+  if (base + LGPGSIZE > USERTOP)
+    return false;
+
+  // Cheap, unlocked check first, so that anonymous and COW faults don't
+  // pay for the range lock below.
+  auto it = vpfs_.find(va / PGSIZE);
+  if (!it.is_set() ||
+      (it->flags & (vmdesc::FLAG_ANON | vmdesc::FLAG_COW)))
+    return false;
+
+  auto begin = vpfs_.find(base / PGSIZE),
+    end = vpfs_.find((base + LGPGSIZE) / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+
+  // The whole region must map one file, at a folio-aligned offset, with
+  // uniform permissions.
+  const vmdesc &desc = *it;
+  if (!it.is_set() || !desc.inode || (desc.flags & vmdesc::FLAG_COW) ||
+      ((base - desc.start) % LGPGSIZE) != 0)
+    return false;
+  if (type == access_type::WRITE && !(desc.flags & vmdesc::FLAG_WRITE))
+    return false;
+  for (auto i = begin; i < end; i += i.span()) {
+    if (!i.is_set() || i->inode != desc.inode || i->start != desc.start ||
+        ((i->flags ^ desc.flags) & ~vmdesc::FLAG_LOCK))
+      return false;
+  }
+
+  mfile *mf = desc.inode->as_file();
+  u64 pgbase = (base - desc.start) / PGSIZE;
+  if (*mf->read_size() < (pgbase + mfile::FOLIO_PAGES) * PGSIZE)
+    return false;
+
+  // Populate the region's page frames, reading the file in as a folio if
+  // it isn't cached yet.  The pages must turn out to be one large page.
+  paddr pa = 0;
+  for (u64 i = 0; i < mfile::FOLIO_PAGES; i++) {
+    page_info *page = ensure_page(vpfs_.find(base / PGSIZE + i), type, nullptr,
+                                  mfile::FOLIO_PAGES);
+    if (!page)
+      return false;
+    if (i == 0)
+      pa = page->pa();
+    if ((pa % LGPGSIZE) != 0 || page->pa() != pa + i * PGSIZE)
+      return false;
+  }
+
+  pme_t pte = pa | PTE_P | PTE_U;
+  if (desc.flags & vmdesc::FLAG_WRITE)
+    pte |= PTE_W;
+  if (!cache.insert_large(base, begin, pte))
+    return false;
+
+  kstats::inc(&kstats::page_fault_large_count);
+  return true;
+}
+
+// Whether anonymous memory with these flags may be mapped with large
+// pages.
+static bool
+anon_large_ok(u64 flags)
+{
+  if (!(flags & vmdesc::FLAG_ANON) || (flags & vmdesc::FLAG_COW))
+    return false;
+  if (VM_THP == 2)
+    return !(flags & vmdesc::FLAG_NOHUGE);
+  return VM_THP == 1 && (flags & vmdesc::FLAG_HUGE);
+}
+
+bool
+vmap::map_anon_large(uptr va, access_type type)
+{
+  uptr base = va & ~(uptr)(LGPGSIZE - 1);
+  if (base + LGPGSIZE > USERTOP)
+    return false;
+
+  auto it = vpfs_.find(va / PGSIZE);
+  if (!it.is_set() || !anon_large_ok(it->flags))
+    return false;
+
+  auto begin = vpfs_.find(base / PGSIZE),
+    end = vpfs_.find((base + LGPGSIZE) / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+
+  // The whole region must be mapped with uniform permissions and be
+  // either entirely unpopulated or entirely populated.  A partially
+  // populated region (say, after a munmap split a large page) stays
+  // with small pages.  Populating the region splits up its
+  // descriptors, so work from a copy of the flags.
+  if (!it.is_set())
+    return false;
+  u64 flags = it->flags & ~vmdesc::FLAG_LOCK;
+  if (!anon_large_ok(flags))
+    return false;
+  if (type == access_type::WRITE && !(flags & vmdesc::FLAG_WRITE))
+    return false;
+  bool populated = false, empty = false;
+  for (auto i = begin; i < end; i += i.span()) {
+    if (!i.is_set() || (i->flags & ~vmdesc::FLAG_LOCK) != flags)
+      return false;
+    if (i->page)
+      populated = true;
+    else
+      empty = true;
+    if (populated && empty)
+      return false;
+  }
+
+  paddr pa;
+  if (empty) {
+    // Don't commit and zero a large page that can't be mapped as one.
+    if (!cache.can_insert_large(base)) {
+      kstats::inc(&kstats::page_fault_large_fallback_count);
+      return false;
+    }
+    char *p = kalloc("(vmap::map_anon_large)", LGPGSIZE);
+    if (!p) {
+      kstats::inc(&kstats::page_fault_large_fallback_count);
+      return false;
+    }
+    pa = v2p(p);
+    if (pa % LGPGSIZE) {
+      kfree(p, LGPGSIZE);
+      kstats::inc(&kstats::page_fault_large_fallback_count);
+      return false;
+    }
+    memset(p, 0, LGPGSIZE);
+    // Like a file folio, the pages are reference counted and freed one
+    // by one, so the region can be split later.
+    ksplit(p, LGPGSIZE);
+    for (uptr i = 0; i < LGPGSIZE / PGSIZE; i++) {
+      char *pg = p + i * PGSIZE;
+      set_page(vpfs_.find(base / PGSIZE + i),
+               sref<page_info>::transfer(new(page_info::of(pg)) page_info()),
+               false);
+    }
+  } else {
+    // Re-map a region that still holds one large page after a split.
+    pa = begin->page->pa();
+    if (pa % LGPGSIZE)
+      return false;
+    for (uptr i = 1; i < LGPGSIZE / PGSIZE; i++)
+      if (vpfs_.find(base / PGSIZE + i)->page->pa() != pa + i * PGSIZE)
+        return false;
+  }
+
+  pme_t pte = pa | PTE_P | PTE_U;
+  if (flags & vmdesc::FLAG_WRITE)
+    pte |= PTE_W;
+  if (!cache.insert_large(base, begin, pte)) {
+    // We may have moved to a core whose page table has small pages here.
+    // The pages stay; they will be mapped one by one.
+    if (empty)
+      kstats::inc(&kstats::page_fault_large_fallback_count);
+    return false;
+  }
+
+  if (empty)
+    kstats::inc(&kstats::page_fault_large_anon_count);
+  kstats::inc(&kstats::page_fault_large_count);
+  return true;
+}
+
 int
 vmap::pagefault(uptr va, u32 err)
 {
@@ -499,8 +719,20 @@ vmap::pagefault(uptr va, u32 err)
 
  retry:
   try {
+    if (map_folio(va, type) || map_anon_large(va, type))
+      return 1;
+
+    // On a read fault, map the resident neighbours of the faulting page
+    // in the same aligned window too, under the same lock.
+    bool around = (VM_FAULT_AROUND > 1 && type == access_type::READ);
+    uptr wstart = va & ~((uptr)VM_FAULT_AROUND * PGSIZE - 1);
+    size_t wpages = std::min<uptr>(VM_FAULT_AROUND, (USERTOP - wstart) / PGSIZE);
+
     auto it = vpfs_.find(va / PGSIZE);
-    auto lock = vpfs_.acquire(it);
+    auto lock = around ?
+      vpfs_.acquire(vpfs_.find(wstart / PGSIZE),
+                    vpfs_.find(wstart / PGSIZE + wpages)) :
+      vpfs_.acquire(it);
     if (!it.is_set())
       return -1;
     if (SDEBUG)
@@ -540,13 +772,21 @@ vmap::pagefault(uptr va, u32 err)
 
     // If this is a read COW fault, we can reuse the COW page, but
     // don't mark it writable!
-    if (desc.flags & vmdesc::FLAG_COW)
-      cache.insert(va, &*it, page->pa() | PTE_P | PTE_U);
-    else {
-      if (desc.flags & vmdesc::FLAG_WRITE)
-        cache.insert(va, &*it, page->pa() | PTE_P | PTE_U | PTE_W);
-      else
-        cache.insert(va, &*it, page->pa() | PTE_P | PTE_U);
+    pme_t pte = page->pa() | PTE_P | PTE_U;
+    if ((desc.flags & vmdesc::FLAG_WRITE) && !(desc.flags & vmdesc::FLAG_COW))
+      pte |= PTE_W;
+
+    if (around) {
+      pme_t ptes[VM_FAULT_AROUND];
+      size_t n = fault_around(*vpfs_.find(va / PGSIZE), va, wstart, wpages,
+                              ptes);
+      kstats::inc(&kstats::page_fault_around_mapped, n);
+      ptes[(va - wstart) / PGSIZE] = pte;
+      // Filling in neighbours may have moved the descriptors around, so
+      // look up the trackers afresh.
+      cache.insert_range(wstart, vpfs_.find(wstart / PGSIZE), ptes, wpages);
+    } else {
+      cache.insert(va, &*it, pte);
     }
 
     shootdown.perform();
@@ -758,14 +998,19 @@ vmap::sbrk(ssize_t n, uptr *addr)
 uptr
 vmap::unmapped_area(size_t npages)
 {
+  // Place regions of a large page or more on a large page boundary, so
+  // that anonymous memory can be mapped with large pages.
+  uptr align = (VM_THP && npages >= LGPGSIZE / PGSIZE) ? LGPGSIZE / PGSIZE : 1;
   uptr start = std::max(myproc()->unmapped_hint, 16UL * 1024 * 1024 / PGSIZE);
+  start = (start + align - 1) & ~(align - 1);
   auto it = vpfs_.find(start), end = vpfs_.find(USERTOP / PGSIZE);
 
   for (; it < end; it += it.span()) {
     if (it.is_set()) {
       // Skip by at least 4GB -- might want to round up, too.
       start = it.index() + std::max(it.span(), 1UL * 1024 * 1024);
-    } else if (it.index() + it.span() - start >= npages) {
+      start = (start + align - 1) & ~(align - 1);
+    } else if (it.index() + it.span() >= start + npages) {
       myproc()->unmapped_hint = start + npages;
       return start * PGSIZE;
     }
@@ -775,7 +1020,7 @@ vmap::unmapped_area(size_t npages)
 
 page_info *
 vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
-                  bool *allocated)
+                  bool *allocated, u32 nfill)
 {
   if (allocated)
     *allocated = false;
@@ -798,7 +1043,7 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
       page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
     } else {
       u64 page_idx = (it.index() * PGSIZE - desc.start) / PGSIZE;
-      page = desc.inode->as_file()->get_page(page_idx).get_page_info();
+      page = desc.inode->as_file()->get_page(page_idx, nfill).get_page_info();
       if (!page)
         return nullptr;
     }
@@ -819,16 +1064,26 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
   }
 
+  set_page(it, page, need_copy);
+  return page.get();
+}
+
+void
+vmap::set_page(const vmap::vpf_array::iterator &it,
+               const sref<page_info> &page, bool copied)
+{
+  auto &desc = *it;
+
   // Install the page in the canonical page table
   if (it.base_span() == 1) {
     // Safe to update in place
     desc.page = page;
-    if (need_copy)
+    if (copied)
       desc.flags &= ~vmdesc::FLAG_COW;
   } else {
     vmdesc n(desc);
     n.page = page;
-    if (need_copy)
+    if (copied)
       n.flags &= ~vmdesc::FLAG_COW;
     // XXX(austin) Fill could do a move in this case, which would
     // save extraneous reference counting
@@ -838,7 +1093,46 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
     it->page->add_pte(rmap);
   }
-  return page.get();
+}
+
+size_t
+vmap::fault_around(const vmdesc &desc, uptr va, uptr start, size_t n,
+                   pme_t *ptes)
+{
+  u64 flags = desc.flags & ~vmdesc::FLAG_LOCK;
+  sref<mnode> inode = desc.inode;
+  intptr_t fstart = desc.start;
+  size_t mapped = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    uptr pva = start + i * PGSIZE;
+    ptes[i] = 0;
+    if (pva == va)
+      continue;
+
+    auto it = vpfs_.find(pva / PGSIZE);
+    if (!it.is_set() || (it->flags & ~vmdesc::FLAG_LOCK) != flags ||
+        it->inode != inode || it->start != fstart)
+      continue;
+
+    // Only map what is already resident; never allocate or do IO.
+    sref<page_info> page = it->page;
+    if (!page && inode) {
+      page = inode->as_file()->get_cached_page((pva - fstart) / PGSIZE)
+        .get_page_info();
+      if (!page)
+        continue;
+      set_page(it, page, false);
+    }
+    if (!page)
+      continue;
+
+    ptes[i] = page->pa() | PTE_P | PTE_U | PTE_AROUND;
+    if ((flags & vmdesc::FLAG_WRITE) && !(flags & vmdesc::FLAG_COW))
+      ptes[i] |= PTE_W;
+    mapped++;
+  }
+  return mapped;
 }
 
 void
@@ -60,6 +60,8 @@ public:
   void eoi() override;
   void send_ipi(struct cpu *c, int ino) override;
   void mask_pc(bool mask) override;
+  void timer_periodic() override;
+  void timer_oneshot(u64 msec) override;
   void start_ap(struct cpu *c, u32 addr) override;
   bool is_x2apic() override;
   void dump() override;
@@ -148,6 +150,35 @@ x2apic_lapic::mask_pc(bool mask)
   writemsr(PCINT, mask ? MASKED : MT_NMI);
 }
 
+void
+x2apic_lapic::timer_periodic()
+{
+  u64 count = (QUANTUM*x2apichz) / 1000;
+  if (count > 0xffffffff)
+    panic("x2apic: QUANTUM too large");
+
+  // The timer repeatedly counts down at bus frequency
+  // from xapic[TICR] and then issues an interrupt.  
+  writemsr(TDCR, X1);
+  writemsr(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+  writemsr(TICR, count); 
+}
+
+void
+x2apic_lapic::timer_oneshot(u64 msec)
+{
+  u64 count = (msec*x2apichz) / 1000;
+  if (count > 0xffffffff)
+    count = 0xffffffff;
+  else if (count == 0)
+    count = 1;
+
+  // Writing TICR restarts the count down.
+  writemsr(TDCR, X1);
+  writemsr(TIMER, T_IRQ0 + IRQ_TIMER);
+  writemsr(TICR, count);
+}
+
 void
 x2apic_lapic::send_ipi(struct cpu *c, int ino)
 {
@@ -209,7 +240,6 @@ x2apic_lapic::clearintr()
 void
 x2apic_lapic::cpu_init()
 {
-  u64 count;
   u32 value;
   int maxlvt;
 
@@ -264,15 +294,7 @@ x2apic_lapic::cpu_init()
     x2apichz = 100 * (ccr0 - ccr1);
   }
 
-  count = (QUANTUM*x2apichz) / 1000;
-  if (count > 0xffffffff)
-    panic("initx2apic: QUANTUM too large");
-
-  // The timer repeatedly counts down at bus frequency
-  // from xapic[TICR] and then issues an interrupt.  
-  writemsr(TDCR, X1);
-  writemsr(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  writemsr(TICR, count); 
+  timer_periodic();
 
   // Clear error status register (requires back-to-back writes).
   writemsr(ESR, 0);
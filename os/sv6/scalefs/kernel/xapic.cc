@@ -69,6 +69,8 @@ public:
   void eoi() override;
   void send_ipi(struct cpu *c, int ino) override;
   void mask_pc(bool mask) override;
+  void timer_periodic() override;
+  void timer_oneshot(u64 msec) override;
   void start_ap(struct cpu *c, u32 addr) override;
   void dump() override;
 private:
@@ -116,10 +118,37 @@ xapic_lapic::init()
 }
 
 void
-xapic_lapic::cpu_init()
+xapic_lapic::timer_periodic()
 {
-  u64 count;
+  u64 count = (QUANTUM*xapichz) / 1000;
+  if (count > 0xffffffff)
+    panic("xapic: QUANTUM too large");
+
+  // The timer repeatedly counts down at bus frequency
+  // from xapic[TICR] and then issues an interrupt.  
+  xapicw(TDCR, X1);
+  xapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+  xapicw(TICR, count); 
+}
+
+void
+xapic_lapic::timer_oneshot(u64 msec)
+{
+  u64 count = (msec*xapichz) / 1000;
+  if (count > 0xffffffff)
+    count = 0xffffffff;
+  else if (count == 0)
+    count = 1;
 
+  // Writing TICR restarts the count down.
+  xapicw(TDCR, X1);
+  xapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+  xapicw(TICR, count);
+}
+
+void
+xapic_lapic::cpu_init()
+{
   verbose.println("xapic: Initializing LAPIC (CPU ", myid(), ")");
 
   // Enable local APIC, do not suppress EOI broadcast, set spurious
@@ -136,15 +165,7 @@ xapic_lapic::cpu_init()
     xapichz = 100 * (ccr0 - ccr1);
   }
 
-  count = (QUANTUM*xapichz) / 1000;
-  if (count > 0xffffffff)
-    panic("initxapic: QUANTUM too large");
-
-  // The timer repeatedly counts down at bus frequency
-  // from xapic[TICR] and then issues an interrupt.  
-  xapicw(TDCR, X1);
-  xapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  xapicw(TICR, count); 
+  timer_periodic();
 
   // Disable logical interrupt lines.
   xapicw(LINT0, MASKED);
@@ -5,13 +5,26 @@
 #include "cpputil.hh"
 #include "ilist.hh"
 #include "mtrace.h"
-#include "work.hh"
+#include "condvar.hh"
+#include "kstats.hh"
+
+#include <algorithm>
 
 extern "C" void zpage(void*);
 extern "C" void zpage_nc(void*);
 
 static const bool prezero = true;
 
+// Each CPU keeps a pool of pre-zeroed pages, which its idle loop tops up
+// ZALLOC_BATCH pages at a time with non-temporal stores, so zeroing
+// neither takes time from real work nor evicts the cache.  The pool's
+// target size follows the CPU's zalloc rate, measured over windows of
+// ZALLOC_WINDOW nsec: it is twice the recent rate, so a burst as big as
+// the last ones can be served without zeroing on the spot, and it is
+// kept between ZALLOC_MIN and ZALLOC_MAX pages.  When the rate drops, the
+// idle loop hands the pages above the target back to kalloc, where the
+// page reclaimer can see them again.
+
 struct free_page
 {
   ilink<free_page> link;
@@ -19,51 +32,92 @@ struct free_page
 };
 
 struct zallocator {
-  // pages and nPages must only be accessed by the local CPU and must
-  // be accessed with interrupts disabled.
+  // Everything here must only be accessed by the local CPU and must be
+  // accessed with interrupts disabled.
   free_page::list_t pages;
   unsigned nPages;
-  dwframe frame;
+  unsigned target;              // pages the idle loop zeroes up to
+  unsigned rate;                // EWMA of zallocs per window
+  unsigned nalloc;              // zallocs in the current window
+  u64 window;                   // nsectime() the current window started
 };
 DEFINE_PERCPU(zallocator, z_);
 
-struct zwork : public dwork {
-  zwork(dwframe* frame)
-    : frame_(frame)
+// Close the current window if it is over, and size the pool from it.
+// Caller must have interrupts disabled.
+static void
+update_target(zallocator *z)
+{
+  u64 now = nsectime();
+  u64 elapsed = now - z->window;
+  if (elapsed < ZALLOC_WINDOW)
+    return;
+  // Windows stretch while the CPU is busy, so scale to a nominal one.
+  unsigned n = (u64)z->nalloc * ZALLOC_WINDOW / elapsed;
+  z->rate = (z->rate * 3 + n) / 4;
+  z->target = std::min(std::max(2 * z->rate, (unsigned)ZALLOC_MIN),
+                       (unsigned)ZALLOC_MAX);
+  z->nalloc = 0;
+  z->window = now;
+}
+
+// Zero a batch of pages for this CPU's pool if it is below its target, or
+// free a batch if it is above.  Called from the idle loop; returns true if
+// it did any work, so the caller can check for runnable procs before doing
+// more.
+bool
+zidle(void)
+{
+  free_page::list_t batch;
+  unsigned want;
   {
-    frame_->inc();
+    scoped_cli cli;
+    update_target(&*z_);
+    if (z_->nPages > z_->target) {
+      unsigned n = std::min(z_->nPages - z_->target, (unsigned)ZALLOC_BATCH);
+      for (unsigned i = 0; i < n; i++) {
+        auto &r = z_->pages.front();
+        z_->pages.pop_front();
+        batch.push_front(&r);
+      }
+      z_->nPages -= n;
+      want = 0;
+    } else if (!prezero || z_->nPages == z_->target) {
+      return false;
+    } else {
+      want = std::min(z_->target - z_->nPages, (unsigned)ZALLOC_BATCH);
+    }
   }
 
-  virtual void run() override {
-    for (int i = 0; i < 32; i++) {
-      auto *r = (struct free_page*)kalloc("zpage");
-      if (r == nullptr)
-        break;
-      zpage_nc(r);
-      scoped_cli cli;
-      z_->pages.push_front(r);
-      ++z_->nPages;
+  if (!batch.empty()) {
+    while (!batch.empty()) {
+      auto &r = batch.front();
+      batch.pop_front();
+      kfree(&r);
     }
-    frame_->dec();
-    delete this;
+    return true;
   }
 
-  dwframe* frame_;
-
-  NEW_DELETE_OPS(zwork);
-};
+  unsigned n;
+  for (n = 0; n < want; n++) {
+    auto *r = (struct free_page*)kalloc("zpage");
+    if (r == nullptr)
+      break;
+    zpage_nc(r);
+    batch.push_front(r);
+  }
+  if (n == 0)
+    return false;
 
-static void
-tryrefill(void)
-{
-  int cpu = myid();
-  if (prezero && z_[cpu].nPages < 16 && z_[cpu].frame.zero()) {
-    zwork* w = new zwork(&z_[cpu].frame);
-    // XXX This is higher priority than doing actual work.  We should
-    // only do background zeroing if we would otherwise be idle.
-    if (dwork_push(w, cpu) < 0)
-      delete w;
+  scoped_cli cli;
+  while (!batch.empty()) {
+    auto &r = batch.front();
+    batch.pop_front();
+    z_->pages.push_front(&r);
   }
+  z_->nPages += n;
+  kstats::inc(&kstats::zalloc_prezero_count, (uint64_t)n);
+  return true;
 }
 
 // Allocate a zeroed page.  This page can be freed with kfree or, if
@@ -75,6 +129,7 @@ zalloc(const char* name)
 
   {
     scoped_cli cli;
+    ++z_->nalloc;
     if (!z_->pages.empty()) {
       p = (char*)&z_->pages.front();
       z_->pages.pop_front();
@@ -83,10 +138,12 @@ zalloc(const char* name)
   }
 
   if (p == nullptr) {
+    kstats::inc(&kstats::zalloc_miss_count);
     p = kalloc(name);
     if (p != nullptr)
       zpage(p);
   } else {
+    kstats::inc(&kstats::zalloc_hit_count);
     mtunlabel(mtrace_label_block, p);
     mtlabel(mtrace_label_block, p, PGSIZE, name, strlen(name));
     // Zero the free_page header
@@ -95,7 +152,6 @@ zalloc(const char* name)
       for (int i = 0; i < PGSIZE; i++)
         assert(p[i] == 0);
   }
-  tryrefill();
   return p;
 }
 
@@ -107,13 +163,21 @@ zfree(void* p)
     for (int i = 0; i < 4096; i++)
       assert(((char*)p)[i] == 0);
 
-  scoped_cli cli;
-  mtunlabel(mtrace_label_block, p);
-  z_->pages.push_front((struct free_page*)p);
-  ++z_->nPages;
+  {
+    scoped_cli cli;
+    if (z_->nPages < z_->target) {
+      mtunlabel(mtrace_label_block, p);
+      z_->pages.push_front((struct free_page*)p);
+      ++z_->nPages;
+      return;
+    }
+  }
+  kfree(p);
 }
 
 void
 initz(void)
 {
+  for (int c = 0; c < ncpu; c++)
+    z_[c].target = ZALLOC_MIN;
 }
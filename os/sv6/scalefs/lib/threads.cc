@@ -254,6 +254,15 @@ pthread_mutex_lock(pthread_mutex_t *mutex)
   return 1;
 }
 
+// Lock mutex, assuming it has other waiters, which is the case for a
+// thread that was requeued onto it by pthread_cond_broadcast.
+static void
+mutex_lock_contended(pthread_mutex_t *mutex)
+{
+  while (__atomic_exchange_n(mutex, 2, __ATOMIC_SEQ_CST) != 0)
+    futex((const u64 *)mutex, FUTEX_WAIT, 2, 0);
+}
+
 int
 pthread_mutex_trylock(pthread_mutex_t *mutex)
 {
@@ -315,11 +324,12 @@ pthread_cond_timedwait(pthread_cond_t *cv, pthread_mutex_t *mtx,
 {
   int value = __atomic_load_n(&cv->value, __ATOMIC_SEQ_CST);
   __atomic_store_n(&cv->previous, value, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&cv->mutex, mtx, __ATOMIC_RELAXED);
 
   pthread_mutex_unlock(mtx);
   futex((const u64 *)&cv->value, FUTEX_WAIT, value,
         (u64)(ts ? ts->after_nano_sec : 0));
-  pthread_mutex_lock(mtx);
+  mutex_lock_contended(mtx);
   return 0;
 }
 
@@ -330,7 +340,13 @@ pthread_cond_broadcast(pthread_cond_t *cv)
 
   __atomic_store_n(&cv->value, value, __ATOMIC_SEQ_CST);
 
-  futex((const u64 *)&cv->value, FUTEX_WAKE, INT_MAX, 0);
+  // Wake one waiter and move the rest over to the mutex, where unlock
+  // hands it to them one at a time.  Fall back to waking them all if
+  // there is no mutex yet or the value changed under us.
+  pthread_mutex_t *mtx = __atomic_load_n(&cv->mutex, __ATOMIC_RELAXED);
+  if (!mtx || futex_requeue((const u64 *)&cv->value, 1, (const u64 *)mtx,
+                            INT_MAX, value) < 0)
+    futex((const u64 *)&cv->value, FUTEX_WAKE, INT_MAX, 0);
 
   return 1;
 }
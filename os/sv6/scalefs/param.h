@@ -38,11 +38,22 @@
 #define KSTACK_DEBUG  DEBUG // use guard pages for over/underflow protection
 #define USTACKPAGES   8
 #define GCINTERVAL    10000 // max. time between GC runs (in msec)
-#define GC_GLOBAL     true
+#define GC_FANOUT     4     // fan-out of the gc epoch tree
+#define GC_DELAYED_HIGH (8*1024*1024) // per-core delayed-free bytes that expedite gc
+#define GC_EXPEDITE_INTERVAL 10 // time between GC runs while expediting (in msec)
 // The MMU scheme.  One of:
 //  mmu_shared_page_table
 //  mmu_per_core_page_table
 #define MMU_SCHEME    mmu_per_core_page_table
+// Number of pages (a power of two) around a read fault that are
+// mapped if they are already resident.  1 disables fault-around.
+#define VM_FAULT_AROUND 16
+// Transparent large pages for anonymous memory.  0 never maps them, 1
+// only in ranges marked with madvise(MADV_HUGEPAGE), and 2 everywhere
+// but in ranges marked with madvise(MADV_NOHUGEPAGE).  With 2, every
+// anonymous fault in a partly populated 2MB region pays for a scan of
+// the region, and a single touch commits and zeroes 2MB.
+#define VM_THP 1
 // The TLB shootdown scheme, for shared page tables.  One of:
 //  batched_shootdown
 //  core_tracking_shootdown
@@ -53,7 +64,31 @@
 //  locked_snzi:: for SNZI counters
 #define PAGE_REFCOUNT refcache::
 // The maximum number of recently freed pages to cache per core.
-#define KALLOC_HOT_PAGES 128
+#define KALLOC_HOT_PAGES 512
+// Each core moves pages between its hot list and the buddy allocators in
+// batches of at least KALLOC_HOT_BATCH (and at most KALLOC_HOT_PAGES/2)
+// pages.  The batch doubles when the previous refill or flush was less
+// than KALLOC_HOT_FAST nsec ago, and halves when it was more than
+// KALLOC_HOT_SLOW nsec ago.
+#define KALLOC_HOT_BATCH 32
+#define KALLOC_HOT_FAST  1000000
+#define KALLOC_HOT_SLOW  100000000
+// Pre-zeroed page pools.  Each core's pool aims for twice its zalloc rate
+// per ZALLOC_WINDOW nsec, within [ZALLOC_MIN, ZALLOC_MAX] pages, and its
+// idle loop zeroes ZALLOC_BATCH pages at a time to get there.
+#define ZALLOC_MIN    16
+#define ZALLOC_MAX    2048
+#define ZALLOC_BATCH  16
+#define ZALLOC_WINDOW 100000000
+// Page-cache reclaim.  A core's reclaimer starts evicting clean file
+// pages when the free memory of its local buddy allocators drops below
+// 1/PAGE_RECLAIM_LOW of their capacity, and stops once it is back above
+// 1/PAGE_RECLAIM_HIGH.  It checks at least every PAGE_RECLAIM_INTERVAL
+// msec, and whenever PAGE_RECLAIM_BATCH pages were added to the cache.
+#define PAGE_RECLAIM_LOW      32
+#define PAGE_RECLAIM_HIGH     16
+#define PAGE_RECLAIM_INTERVAL 100
+#define PAGE_RECLAIM_BATCH    256
 // How to balance memory load.  If 1, dynamically load balance pages
 // between buddy allocators.  If 0, directly steal and return memory
 // from remote buddy allocators.
@@ -61,12 +96,22 @@
 // Buddy allocator granularity.  If 0, create a buddy per NUMA node.
 // If 1, create a buddy per CPU.
 #define KALLOC_BUDDY_PER_CPU 1
-// Whether or not to load balance in the scheduler.
+// Whether or not to load balance in the scheduler.  Idle CPUs look for
+// work to steal; busy ones rebalance every SCHED_BALANCE_TICKS ticks.
+// One steal moves at most SCHED_STEAL_MAX procs.
 #define SCHED_LOAD_BALANCE 0
+#define SCHED_BALANCE_TICKS 4
+#define SCHED_STEAL_MAX    8
+// Number of scheduling decisions in a row a runnable thread of a less
+// important scheduler class can be passed over before it gets a turn.
+#define SCHED_STARVE_TURNS 8
 // Reference counting scheme for inode's nlink.  One of:
 //  :: for shared reference counters
 //  refcache:: for refcache counters
 #define FS_NLINK_REFCOUNT refcache::
+// Number of blocks that a CPU moves from the file system's global reserve
+// pool over to its own freelist at a time, once it runs out of free blocks.
+#define RESERVE_REFILL_BLOCKS 256
 #define RANDOMIZE_KMALLOC 1
 // Track kernel memory usage
 #define KERNEL_HEAP_PROFILE 0
@@ -173,3 +218,10 @@
 #ifndef QUANTUM
 #define QUANTUM      1  // scheduling time quantum and tick length (in msec)
 #endif
+#ifndef NOHZ
+// Whether CPUs with nothing queued to run stretch their timer tick
+#define NOHZ         1
+#endif
+#ifndef NOHZ_MAX_TICKS
+#define NOHZ_MAX_TICKS 10  // longest stretched tick (in quanta)
+#endif
@@ -19,6 +19,7 @@ typedef int pthread_mutexattr_t;
 typedef struct {
   unsigned int value;
   unsigned int previous;
+  pthread_mutex_t *mutex;       // For broadcast to requeue waiters onto
 } pthread_cond_t;
 typedef int pthread_condattr_t;
 struct timespec {
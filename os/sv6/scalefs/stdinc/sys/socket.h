@@ -16,5 +16,10 @@ int socket(int domain, int type, int protocol);
 ssize_t recv(int sockfd, void *buf, size_t len, int flags);
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
                  struct sockaddr *src_addr, socklen_t *addrlen);
+int setsockopt(int sockfd, int level, int optname, const void *optval,
+               socklen_t optlen);
+int sendmmsg(int sockfd, struct msgvec *vec, unsigned int vlen, int flags,
+             const struct sockaddr *dest_addr, socklen_t addrlen);
+int recvmmsg(int sockfd, struct msgvec *vec, unsigned int vlen, int flags);
 
 END_DECLS
@@ -5,5 +5,9 @@ struct gc_stat {
   u64 nrun;
   u64 ncycles;
   u64 nop;
+  u64 delayed_bytes;         /* bytes waiting to be freed */
+  u64 max_delayed_bytes;     /* high-water mark of delayed_bytes */
+  u64 nexpedite;             /* times delayed_bytes crossed GC_DELAYED_HIGH */
+  u64 nhelp;                 /* frees done by threads leaving an epoch */
 };
 
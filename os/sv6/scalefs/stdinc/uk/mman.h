@@ -14,6 +14,8 @@
 #define MAP_FAILED ((void*)-1)
 
 #define MADV_WILLNEED 3
+#define MADV_HUGEPAGE 14
+#define MADV_NOHUGEPAGE 15
 
 // xv6 extension: invalidate all page tables
 #define MADV_INVALIDATE_CACHE 1000
@@ -53,3 +53,15 @@ static_assert(SOCK_DGRAM_UNORDERED != SOCK_STREAM,
 static_assert(SOCK_DGRAM_UNORDERED != SOCK_DGRAM,
               "SOCK_DGRAM_UNORDERED == SOCK_DGRAM");
 #endif
+
+// setsockopt options of local sockets
+#define SOL_LOCAL 0
+#define LOCAL_QUEUELEN 1        // int: messages a receive queue holds
+
+// One message of a sendmmsg/recvmmsg batch.  recvmmsg sets msg_len to
+// the length of the message it stored at msg_base.
+struct msgvec
+{
+  void *msg_base;
+  size_t msg_len;
+};
@@ -11,6 +11,15 @@ enum stat_flags {
   STAT_OMIT_NLINK = 1<<0
 };
 
+// xv6 scheduler classes (setschedclass), most important first.  A
+// runnable thread is always picked ahead of threads of less important
+// classes, except that a class that has been passed over for
+// SCHED_STARVE_TURNS scheduling decisions in a row gets one turn.
+#define SCHED_CLASS_LATENCY 0   // Latency-critical (servers, flushers)
+#define SCHED_CLASS_NORMAL  1   // Default
+#define SCHED_CLASS_BATCH   2   // Background CPU hogs
+#define SCHED_NCLASS        3
+
 // lseek flags
 #define SEEK_SET 0
 #define SEEK_CUR 1
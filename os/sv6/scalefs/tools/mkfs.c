@@ -17,6 +17,7 @@ char zeroes[BSIZE];
 u32 freeblock;
 u32 usedblocks;
 u32 bitblocks;
+u32 journalblocks;
 u32 freeinode = 1;
 
 void balloc(int);
@@ -26,6 +27,7 @@ void rinode(u32 inum, struct dinode *ip);
 void rsect(u32 sec, void *buf);
 u32 ialloc(u16 type);
 void iappend(u32 inum, void *p, int n);
+u32 journal_size(u32 nblks);
 
 // convert to intel byte order
 u16
@@ -75,13 +77,23 @@ main(int argc, char *argv[])
   }
 
   bitblocks = (size+BSIZE*8-1)/(BSIZE*8);
+  journalblocks = journal_size(size);
   usedblocks = ninodes / IPB + 3 + bitblocks;
   freeblock = usedblocks;
 
+  // Lay out the per-core journals contiguously, right after the bitmap.
+  for(i = 0; i < NCPU; i++){
+    sb.journal_blknums[i].start_blknum = xint(freeblock);
+    freeblock += journalblocks;
+    sb.journal_blknums[i].end_blknum = xint(freeblock - 1); // Inclusive
+  }
+  usedblocks = freeblock;
+
   nblocks = size - usedblocks;
 
-  printf("used %d (bit %d ninode %zu) free %u total %d\n", usedblocks,
-         bitblocks, ninodes/IPB + 1, freeblock, nblocks+usedblocks);
+  printf("used %d (bit %d ninode %zu journal %d x %u) free %u total %d\n",
+         usedblocks, bitblocks, ninodes/IPB + 1, NCPU, journalblocks,
+         freeblock, nblocks+usedblocks);
 
   for(i = 0; i < nblocks + usedblocks; i++)
     wsect(i, zeroes);
@@ -127,20 +139,9 @@ main(int argc, char *argv[])
     strncpy(de.name, argv[i], DIRSIZ);
     iappend(rootino, &de, sizeof(de));
 
-    int jnum;
-
-    if (strncmp(argv[i], "sv6journal", 10) == 0) {
-      jnum = atoi(argv[i]+10);
-      sb.journal_blknums[jnum].start_blknum = xint(freeblock);
-    }
-
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
 
-    if (strncmp(argv[i], "sv6journal", 10) == 0) {
-      sb.journal_blknums[jnum].end_blknum = xint(freeblock - 1); // Inclusive
-    }
-
     close(fd);
   }
 
@@ -254,6 +255,20 @@ balloc(int used)
   }
 }
 
+// Size (in blocks) of each per-core journal on a disk of nblks blocks.
+// See JOURNAL_DISK_FRACTION in include/fs.h.
+u32
+journal_size(u32 nblks)
+{
+  u32 n = nblks / JOURNAL_DISK_FRACTION / NCPU;
+
+  if(n < JOURNAL_MIN_BLKS)
+    n = JOURNAL_MIN_BLKS;
+  if(n > JOURNAL_MAX_BLKS)
+    n = JOURNAL_MAX_BLKS;
+  return n;
+}
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
 void